@@ -1,4 +1,6 @@
 
+#include <arch/thread.h>
+
 #include "fs.h"
 
 // Return the virtual address of this disk block.
@@ -26,7 +28,7 @@ va_is_dirty(void *va)
 
 // Fault any disk block that is read in to memory by
 // loading it from disk.
-// Hint: Use ide_read and BLKSECTS.
+// Hint: Use disk_read and BLKSECTS.
 static void
 bc_pgfault(struct UTrapframe *utf)
 {
@@ -71,11 +73,136 @@ bc_pgfault(struct UTrapframe *utf)
 		panic("reading free block %08x\n", blockno);
 }
 
+// Blocks being read in by bc_fetch.  busy is cleared when the block
+// has been mapped into the cache.
+static struct {
+	uint32_t blockno;
+	uint32_t busy;
+} fetching[NFETCH];
+
+// Make sure block blockno is in the cache.  In a request thread that
+// may block (serve_may_block), the read is started asynchronously and
+// other requests run until it completes; the block is read into a
+// staging page and only mapped into the cache once it is complete, so
+// no other request ever sees a partly read block.  Anywhere else this
+// is the same as touching the block, which faults it in.
+void
+bc_fetch(uint32_t blockno)
+{
+	void *addr = diskaddr(blockno), *va;
+	struct DiskReq req;
+	int i, slot = -1, r;
+
+	if (va_is_mapped(addr)) {
+		fscounters.ret_bc_hits++;
+		return;
+	}
+	fscounters.ret_bc_misses++;
+	if (!serve_may_block()) {
+		(void) *(volatile char *) addr;
+		return;
+	}
+
+	for (i = 0; i < NFETCH; i++) {
+		if (fetching[i].busy && fetching[i].blockno == blockno) {
+			// Someone else is already reading it.
+			while (fetching[i].busy && fetching[i].blockno == blockno)
+				thread_wait(&fetching[i].busy, 1, ~0);
+			return;
+		}
+		if (!fetching[i].busy && slot < 0)
+			slot = i;
+	}
+	if (slot < 0) {
+		(void) *(volatile char *) addr;
+		return;
+	}
+
+	fetching[slot].blockno = blockno;
+	fetching[slot].busy = 1;
+	va = (void *) (FETCHVA + (uintptr_t) slot * PGSIZE);
+	if ((r = sys_page_alloc(0, va, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("bc_fetch: sys_page_alloc: %e", r);
+	req.secno = blockno * BLKSECTS;
+	req.buf = va;
+	req.nsecs = BLKSECTS;
+	req.write = 0;
+	disk_submit(&req);
+	while (req.result > 0)
+		thread_wait((volatile uint32_t *) &req.result, 1, ~0);
+	if (req.result < 0)
+		panic("bc_fetch: reading block %08x: %e", blockno, req.result);
+
+	// A synchronous fault may have brought the block in meanwhile;
+	// its copy is at least as recent as ours.
+	if (!va_is_mapped(addr)
+	    && (r = sys_page_map(0, va, 0, addr, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("bc_fetch: sys_page_map: %e", r);
+	sys_page_unmap(0, va);
+	fetching[slot].busy = 0;
+	thread_wakeup(&fetching[slot].busy);
+}
+
+// Is block blockno's cache page also mapped by another environment, a
+// client that mapped it with FSREQ_READ_MAP or FSREQ_MAP?
+bool
+bc_mapped_out(uint32_t blockno)
+{
+	void *addr = diskaddr(blockno);
+
+	return va_is_mapped(addr) && pageref(addr) > 1;
+}
+
+// Bring block blockno into the cache as zeros, without reading it, for
+// a block just allocated to a file, so that whatever the disk held
+// there before never shows through.  The page is left dirty, and the
+// zeros reach the disk when the file is flushed.
+void
+bc_zero(uint32_t blockno)
+{
+	void *addr = diskaddr(blockno);
+	int r;
+
+	if ((r = sys_page_alloc(0, addr, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("bc_zero: sys_page_alloc: %e", r);
+	memset(addr, 0, BLKSIZE);
+}
+
+// Write zeros over disk blocks [blockno, blockno + n) without bringing
+// them into the cache, for blocks preallocated to a file that may not
+// be touched for a long time: bc_zero would pin a page of memory for
+// each one.  Stale cached copies of the blocks are dropped.  The zeros
+// are on disk when this returns, before any metadata that points at the
+// blocks can commit.
+int
+bc_zero_run(uint32_t blockno, uint32_t n)
+{
+	static char zeros[BLKSIZE] __attribute__((aligned(PGSIZE)));
+	struct DiskReq reqs[NFETCH];
+	uint32_t i, m;
+	int r;
+
+	for (; n > 0; blockno += m, n -= m) {
+		m = MIN(n, NFETCH);
+		for (i = 0; i < m; i++) {
+			if (va_is_mapped(diskaddr(blockno + i)))
+				sys_page_unmap(0, diskaddr(blockno + i));
+			reqs[i].secno = (blockno + i) * BLKSECTS;
+			reqs[i].buf = zeros;
+			reqs[i].nsecs = BLKSECTS;
+			reqs[i].write = 1;
+		}
+		if ((r = disk_rw_batch(reqs, m)) < 0)
+			return r;
+	}
+	return 0;
+}
+
 // Flush the contents of the block containing VA out to disk if
 // necessary, then clear the PTE_D bit using sys_page_map.
 // If the block is not in the block cache or is not dirty, does
 // nothing.
-// Hint: Use va_is_mapped, va_is_dirty, and ide_write.
+// Hint: Use va_is_mapped, va_is_dirty, and disk_write.
 // Hint: Use the PTE_SYSCALL constant when calling sys_page_map.
 // Hint: Don't forget to round addr down.
 void
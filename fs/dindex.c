@@ -0,0 +1,188 @@
+/*
+ * Hashed directory index.
+ *
+ * Large directories get an open-addressing hash table, keyed on
+ * dindex_hash(name), that maps names to entry positions.  The table
+ * is only an accelerator: the directory entries keep their linear
+ * format, and a directory without FFLAG_DINDEX is simply scanned.
+ */
+
+#include <inc/string.h>
+
+#include "fs.h"
+
+static struct DirSlot *
+dindex_slot(struct File *dir, uint32_t i)
+{
+	uint32_t *root = diskaddr(dir->f_dindex);
+
+	return (struct DirSlot *) diskaddr(root[i / BLKDIRSLOTS])
+		+ i % BLKDIRSLOTS;
+}
+
+// Return the directory entry at position ent, or NULL on error.
+static struct File *
+dir_entry(struct File *dir, uint32_t ent)
+{
+	char *blk;
+
+	if (file_get_block(dir, ent / BLKFILES, &blk) < 0)
+		return NULL;
+	return (struct File *) blk + ent % BLKFILES;
+}
+
+// Free dir's index and clear FFLAG_DINDEX.
+void
+dindex_free(struct File *dir)
+{
+	uint32_t *root, i;
+
+	if (!(dir->f_flags & FFLAG_DINDEX))
+		return;
+	root = diskaddr(dir->f_dindex);
+	for (i = 0; i < dir->f_dislots / BLKDIRSLOTS; i++)
+		free_block(root[i]);
+	free_block(dir->f_dindex);
+	dir->f_flags &= ~FFLAG_DINDEX;
+	dir->f_dindex = dir->f_dislots = dir->f_diused = 0;
+}
+
+static void
+dindex_put(struct File *dir, uint32_t hash, uint32_t ent)
+{
+	uint32_t i, mask = dir->f_dislots - 1;
+	struct DirSlot *s;
+
+	for (i = hash & mask; ; i = (i + 1) & mask) {
+		s = dindex_slot(dir, i);
+		if (s->ds_ent == 0 || s->ds_ent == DINDEX_DELETED)
+			break;
+	}
+	if (s->ds_ent == 0)
+		dir->f_diused++;
+	s->ds_hash = hash;
+	s->ds_ent = ent + 1;
+}
+
+// (Re)build dir's index with room for at least twice its entries.
+// If the disk is full the directory is left without an index, which
+// only costs lookup speed.
+// Returns 0 on success, < 0 on error.
+int
+dindex_build(struct File *dir)
+{
+	uint32_t nents, nslots, i, *root;
+	struct File *f;
+	int r;
+
+	dindex_free(dir);
+
+	nents = dir->f_size / sizeof(struct File);
+	for (nslots = BLKDIRSLOTS; nslots < 2 * nents; nslots *= 2)
+		;
+	if (nslots > DINDEX_MAXSLOTS)
+		return -E_NO_DISK;
+
+	if ((r = alloc_block()) < 0)
+		return r;
+	dir->f_dindex = r;
+	root = diskaddr(r);
+	memset(root, 0, BLKSIZE);
+	for (i = 0; i < nslots / BLKDIRSLOTS; i++) {
+		if ((r = alloc_block()) < 0) {
+			while (i-- > 0)
+				free_block(root[i]);
+			free_block(dir->f_dindex);
+			dir->f_dindex = 0;
+			return r;
+		}
+		root[i] = r;
+		memset(diskaddr(r), 0, BLKSIZE);
+	}
+	dir->f_dislots = nslots;
+	dir->f_diused = 0;
+	dir->f_flags |= FFLAG_DINDEX;
+
+	for (i = 0; i < nents; i++)
+		if ((f = dir_entry(dir, i)) && f->f_name[0] != '\0')
+			dindex_put(dir, dindex_hash(f->f_name), i);
+	return 0;
+}
+
+// Note that entry position ent of dir, named name, is now in use.
+// Builds the index once the directory gets large, and rebuilds it
+// when it gets too full.
+void
+dindex_insert(struct File *dir, const char *name, uint32_t ent)
+{
+	if (!(dir->f_flags & FFLAG_DINDEX)) {
+		if (dir->f_size / BLKSIZE >= DINDEX_MIN_BLOCKS)
+			dindex_build(dir);
+		return;
+	}
+	// Keep the load factor (counting deleted slots) under 3/4.
+	if ((dir->f_diused + 1) * 4 > dir->f_dislots * 3) {
+		dindex_build(dir);
+		return;
+	}
+	dindex_put(dir, dindex_hash(name), ent);
+}
+
+// Find the index slot for the entry named name, or NULL.
+static struct DirSlot *
+dindex_find(struct File *dir, const char *name, struct File **file)
+{
+	uint32_t hash = dindex_hash(name), i, n, mask = dir->f_dislots - 1;
+	struct DirSlot *s;
+	struct File *f;
+
+	for (i = hash & mask, n = 0; n < dir->f_dislots; i = (i + 1) & mask, n++) {
+		s = dindex_slot(dir, i);
+		if (s->ds_ent == 0)
+			break;
+		if (s->ds_ent == DINDEX_DELETED || s->ds_hash != hash)
+			continue;
+		if ((f = dir_entry(dir, s->ds_ent - 1))
+		    && strcmp(f->f_name, name) == 0) {
+			*file = f;
+			return s;
+		}
+	}
+	return NULL;
+}
+
+// Note that the entry named name is being removed from dir.
+void
+dindex_remove(struct File *dir, const char *name)
+{
+	struct DirSlot *s;
+	struct File *f;
+
+	if (!(dir->f_flags & FFLAG_DINDEX))
+		return;
+	if ((s = dindex_find(dir, name, &f)))
+		s->ds_ent = DINDEX_DELETED;
+}
+
+// Look up name in dir's index.
+// Returns 0 and sets *file on success, < 0 on error.  Errors are:
+//	-E_NOT_FOUND if there is no such entry.
+int
+dindex_lookup(struct File *dir, const char *name, struct File **file)
+{
+	return dindex_find(dir, name, file) ? 0 : -E_NOT_FOUND;
+}
+
+// Flush dir's index blocks.
+void
+dindex_flush(struct File *dir)
+{
+	uint32_t *root, i;
+
+	if (!(dir->f_flags & FFLAG_DINDEX))
+		return;
+	root = diskaddr(dir->f_dindex);
+	for (i = 0; i < dir->f_dislots / BLKDIRSLOTS; i++)
+		journal_dirty(diskaddr(root[i]));
+	journal_dirty(root);
+}
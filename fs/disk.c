@@ -0,0 +1,175 @@
+/*
+ * Disk backend selection.  The rest of the file system goes through
+ * disk_read and disk_write, which forward to whichever driver
+ * disk_init found: virtio-blk if the machine has one, otherwise the
+ * PIO IDE driver (or, in a VMM guest, the host file server).
+ */
+
+#include "fs.h"
+
+static enum {
+	DISK_IDE,
+	DISK_VIRTIO,
+	DISK_HOST,
+} disk_type;
+
+// Count a transfer in fscounters.
+static void
+disk_count(bool write, size_t nsecs)
+{
+	if (write) {
+		fscounters.ret_disk_writes++;
+		fscounters.ret_disk_wsecs += nsecs;
+	} else {
+		fscounters.ret_disk_reads++;
+		fscounters.ret_disk_rsecs += nsecs;
+	}
+}
+
+void
+disk_init(void)
+{
+#ifndef VMM_GUEST
+	if (virtio_init() == 0) {
+		disk_type = DISK_VIRTIO;
+		return;
+	}
+
+	// Find a JOS disk.  Use the second IDE disk (number 1) if available.
+	disk_type = DISK_IDE;
+	if (ide_probe_disk1())
+		ide_set_disk(1);
+	else
+		ide_set_disk(0);
+#else
+	// Guest disk traffic goes to the host's file server, which in
+	// turn uses whatever disk the host has.
+	disk_type = DISK_HOST;
+	host_ipc_init();
+#endif
+}
+
+int
+disk_read(uint32_t secno, void *dst, size_t nsecs)
+{
+	disk_count(0, nsecs);
+	switch (disk_type) {
+#ifndef VMM_GUEST
+	case DISK_VIRTIO:
+		return virtio_read(secno, dst, nsecs);
+	case DISK_IDE:
+		return ide_read(secno, dst, nsecs);
+#else
+	case DISK_HOST:
+		return host_read(secno, dst, nsecs);
+#endif
+	default:
+		panic("disk_read: no disk");
+	}
+}
+
+int
+disk_write(uint32_t secno, const void *src, size_t nsecs)
+{
+	disk_count(1, nsecs);
+	switch (disk_type) {
+#ifndef VMM_GUEST
+	case DISK_VIRTIO:
+		return virtio_write(secno, src, nsecs);
+	case DISK_IDE:
+		return ide_write(secno, src, nsecs);
+#else
+	case DISK_HOST:
+		return host_write(secno, src, nsecs);
+#endif
+	default:
+		panic("disk_write: no disk");
+	}
+}
+
+// Start the transfer 'r' without waiting for it to finish.  r->result
+// stays positive until the transfer completes, which happens in
+// disk_intr (or in any synchronous transfer that needs to wait on the
+// device anyway).  Drivers without a request queue just do the
+// transfer before returning.
+void
+disk_submit(struct DiskReq *r)
+{
+#ifndef VMM_GUEST
+	if (disk_type == DISK_VIRTIO) {
+		disk_count(r->write, r->nsecs);
+		while (virtio_submit(r) < 0) {
+			virtio_kick();
+			virtio_wait();
+		}
+		virtio_kick();
+		return;
+	}
+#endif
+	if (r->write)
+		r->result = disk_write(r->secno, r->buf, r->nsecs);
+	else
+		r->result = disk_read(r->secno, r->buf, r->nsecs);
+}
+
+// The IRQ that signals completion of disk_submit'ed transfers, or -1 if
+// there is none and they complete synchronously or must be polled.
+int
+disk_irq(void)
+{
+#ifndef VMM_GUEST
+	if (disk_type == DISK_VIRTIO)
+		return virtio_irq();
+#endif
+	return -1;
+}
+
+// Handle an interrupt on disk_irq().
+void
+disk_intr(void)
+{
+#ifndef VMM_GUEST
+	if (disk_type == DISK_VIRTIO)
+		virtio_intr();
+#endif
+}
+
+// Perform all of the transfers in 'reqs', in no particular order.
+// With virtio every request is queued before the device is notified,
+// so the device sees the whole batch at once; the other drivers simply
+// do one transfer at a time.  Each request's result is set, and the
+// first error (if any) is returned.
+int
+disk_rw_batch(struct DiskReq *reqs, int n)
+{
+	int i, r = 0;
+
+#ifndef VMM_GUEST
+	if (disk_type == DISK_VIRTIO) {
+		for (i = 0; i < n; i++) {
+			disk_count(reqs[i].write, reqs[i].nsecs);
+			while (virtio_submit(&reqs[i]) < 0) {
+				virtio_kick();
+				virtio_wait();
+			}
+		}
+		virtio_kick();
+		for (i = 0; i < n; i++)
+			while (reqs[i].result > 0)
+				virtio_wait();
+	} else
+#endif
+	for (i = 0; i < n; i++) {
+		if (reqs[i].write)
+			reqs[i].result = disk_write(reqs[i].secno,
+						    reqs[i].buf, reqs[i].nsecs);
+		else
+			reqs[i].result = disk_read(reqs[i].secno,
+						   reqs[i].buf, reqs[i].nsecs);
+	}
+
+	for (i = 0; i < n; i++)
+		if (reqs[i].result < 0 && r == 0)
+			r = reqs[i].result;
+	return r;
+}
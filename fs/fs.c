@@ -35,6 +35,15 @@ block_is_free(uint32_t blockno)
 	return 0;
 }
 
+// In-memory summary of the free bitmap: the number of free blocks
+// tracked by each bitmap block, so the allocator can skip full regions
+// without scanning them.  alloc_cursor is where the next-fit search
+// resumes.
+#define MAXBITBLOCKS	(DISKSIZE / BLKSIZE / BLKBITSIZE)
+
+static uint32_t bitblock_nfree[MAXBITBLOCKS];
+static uint32_t alloc_cursor;
+
 // Mark a block free in the bitmap
 void
 free_block(uint32_t blockno)
@@ -42,7 +51,65 @@ free_block(uint32_t blockno)
 	// Blockno zero is the null pointer of block numbers.
 	if (blockno == 0)
 		panic("attempt to free zero block");
+	// Blocks still copied in the journal are freed at checkpoint.
+	if (journal_forget(blockno))
+		return;
+	if (!block_is_free(blockno))
+		bitblock_nfree[blockno / BLKBITSIZE]++;
 	bitmap[blockno/32] |= 1<<(blockno%32);
+	journal_dirty(&bitmap[blockno/32]);
+}
+
+static void
+mark_block_used(uint32_t blockno)
+{
+	bitmap[blockno/32] &= ~(1<<(blockno%32));
+	bitblock_nfree[blockno / BLKBITSIZE]--;
+}
+
+// Count the free blocks under each bitmap block.
+static void
+init_free_counts(void)
+{
+	uint32_t i;
+
+	memset(bitblock_nfree, 0, sizeof(bitblock_nfree));
+	for (i = 0; i < super->s_nblocks; i++)
+		if (block_is_free(i))
+			bitblock_nfree[i / BLKBITSIZE]++;
+	alloc_cursor = 0;
+}
+
+// Return the first free block at or after 'goal', wrapping around to
+// the start of the disk, or -E_NO_DISK.  Bitmap blocks with no free
+// blocks are skipped using the summary, and words with no free bits
+// are skipped 32 blocks at a time.
+static int
+find_free_block(uint32_t goal)
+{
+	uint32_t nbitblocks, i, bb, start, end, b;
+
+	nbitblocks = (super->s_nblocks + BLKBITSIZE - 1) / BLKBITSIZE;
+	if (goal >= super->s_nblocks)
+		goal = 0;
+	// The first bitmap block is visited twice: from goal on, and
+	// after wrapping around, from its beginning.
+	for (i = 0; i <= nbitblocks; i++) {
+		bb = (goal / BLKBITSIZE + i) % nbitblocks;
+		if (bitblock_nfree[bb] == 0)
+			continue;
+		start = i == 0 ? goal : bb * BLKBITSIZE;
+		end = MIN((bb + 1) * BLKBITSIZE, super->s_nblocks);
+		for (b = start; b < end; b++) {
+			if (b % 32 == 0 && bitmap[b / 32] == 0) {
+				b += 31;
+				continue;
+			}
+			if (block_is_free(b))
+				return b;
+		}
+	}
+	return -E_NO_DISK;
 }
 
 // Search the bitmap for a free block and allocate it.  When you
@@ -52,17 +119,60 @@ free_block(uint32_t blockno)
 // Return block number allocated on success,
 // -E_NO_DISK if we are out of blocks.
 //
-// Hint: use free_block as an example for manipulating the bitmap.
+// Allocation is next-fit: the search starts just after the block
+// allocated last, so it does not rescan the full front of the disk.
 int
 alloc_block(void)
 {
-	// The bitmap consists of one or more blocks.  A single bitmap block
-	// contains the in-use bits for BLKBITSIZE blocks.  There are
-	// super->s_nblocks blocks in the disk altogether.
+	int r;
 
-	// LAB 5: Your code here.
-	panic("alloc_block not implemented");
-	return -E_NO_DISK;
+	if ((r = find_free_block(alloc_cursor)) < 0)
+		return r;
+	mark_block_used(r);
+	alloc_cursor = r + 1;
+	journal_dirty(&bitmap[r/32]);
+	return r;
+}
+
+// Allocate a block, preferring 'goal' (typically the block after the
+// file's last block) so that files stay contiguous on disk, and
+// otherwise the next free block after it.
+int
+alloc_block_near(uint32_t goal)
+{
+	int r;
+
+	if (goal == 0)
+		return alloc_block();
+	if ((r = find_free_block(goal)) < 0)
+		return r;
+	mark_block_used(r);
+	journal_dirty(&bitmap[r/32]);
+	return r;
+}
+
+// Allocate a run of up to 'n' contiguous blocks, starting at the first
+// free block at or after 'goal' (or the next-fit cursor if goal is 0).
+// Sets *pcount to the length of the run, which is at least 1.
+// Returns the first block of the run, or -E_NO_DISK.
+int
+alloc_block_run(uint32_t goal, uint32_t n, uint32_t *pcount)
+{
+	int r;
+	uint32_t count;
+
+	if ((r = find_free_block(goal ? goal : alloc_cursor)) < 0)
+		return r;
+	for (count = 0; count < n && block_is_free(r + count); count++) {
+		mark_block_used(r + count);
+		if ((r + count) % BLKBITSIZE == BLKBITSIZE - 1)
+			journal_dirty(&bitmap[(r + count) / 32]);
+	}
+	journal_dirty(&bitmap[(r + count - 1) / 32]);
+	if (!goal)
+		alloc_cursor = r + count;
+	*pcount = count;
+	return r;
 }
 
 // Validate the file system bitmap.
@@ -96,18 +206,7 @@ fs_init(void)
 {
 	static_assert(sizeof(struct File) == 256);
 
-
-#ifndef VMM_GUEST
-	// Find a JOS disk.  Use the second IDE disk (number 1) if available.
-	if (ide_probe_disk1())
-		ide_set_disk(1);
-	else
-		ide_set_disk(0);
-#else
-	host_ipc_init();
-#endif
-
-
+	disk_init();
 	bc_init();
 
 	// Set "super" to point to the super block.
@@ -116,7 +215,252 @@ fs_init(void)
 
 	// Set "bitmap" to the beginning of the first bitmap block.
 	bitmap = diskaddr(2);
+	journal_init();
 	check_bitmap();
+	init_free_counts();
+}
+
+// --------------------------------------------------------------
+// Extents
+// --------------------------------------------------------------
+
+// Most blocks file_set_size preallocates at once.
+#define PREALLOC_MAX	256
+
+// Set *pext to point at extent number i of the extent-based file f.
+// The first NEXTENT extents live in the File itself; the rest continue
+// in the chain of extent blocks starting at f->f_extblock.  If alloc
+// is set, extend the chain when it is too short.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_NOT_FOUND if the chain is too short and alloc was 0.
+//	-E_NO_DISK if there's no space on the disk for an extent block.
+static int
+extent_slot(struct File *f, uint32_t i, bool alloc, struct Extent **pext)
+{
+	uint32_t *pbno;
+	struct ExtentBlock *eb;
+	int r;
+
+	if (i < NEXTENT) {
+		*pext = &f->f_extents[i];
+		return 0;
+	}
+	i -= NEXTENT;
+	for (pbno = &f->f_extblock; ; pbno = &eb->eb_next) {
+		if (*pbno == 0) {
+			if (!alloc)
+				return -E_NOT_FOUND;
+			if ((r = alloc_block()) < 0)
+				return r;
+			memset(diskaddr(r), 0, BLKSIZE);
+			*pbno = r;
+		}
+		eb = diskaddr(*pbno);
+		if (i < NBLKEXTENT) {
+			*pext = &eb->eb_ext[i];
+			return 0;
+		}
+		i -= NBLKEXTENT;
+	}
+}
+
+static struct Extent *
+extent_get(struct File *f, uint32_t i)
+{
+	struct Extent *e;
+	int r;
+
+	if ((r = extent_slot(f, i, 0, &e)) < 0)
+		panic("extent %d of %s: %e", i, f->f_name, r);
+	return e;
+}
+
+// Return the index of the last extent of f that starts at or before
+// file block filebno, or -1 if there is none.
+static int
+extent_find(struct File *f, uint32_t filebno)
+{
+	int lo = 0, hi = f->f_nextents - 1, mid;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (extent_get(f, mid)->e_fblock <= filebno)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	return hi;
+}
+
+// Set *pdiskbno to the disk block holding block filebno of the
+// extent-based file f.  If the block isn't allocated, either allocate
+// it (if alloc is set) or set *pdiskbno to 0.  New blocks read as
+// zeros, and are placed right after their predecessor when possible,
+// so a file that is written sequentially stays a single extent.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_NO_DISK if a block needed to be allocated but the disk is full.
+//	-E_INVAL if filebno is out of range.
+static int
+extent_map_block(struct File *f, uint32_t filebno, uint32_t *pdiskbno, bool alloc)
+{
+	struct Extent *prev = 0, *next = 0, *e;
+	uint32_t goal = 0, bno, j;
+	int i, r;
+
+	if (filebno >= MAXEXTFILESIZE / BLKSIZE)
+		return -E_INVAL;
+
+	if ((i = extent_find(f, filebno)) >= 0) {
+		prev = extent_get(f, i);
+		if (filebno < prev->e_fblock + prev->e_len) {
+			*pdiskbno = prev->e_dblock + filebno - prev->e_fblock;
+			return 0;
+		}
+		goal = prev->e_dblock + filebno - prev->e_fblock;
+	}
+	if (!alloc) {
+		*pdiskbno = 0;
+		return 0;
+	}
+	if (i + 1 < f->f_nextents)
+		next = extent_get(f, i + 1);
+
+	if ((r = alloc_block_near(goal)) < 0)
+		return r;
+	bno = r;
+	bc_zero(bno);
+
+	if (prev && filebno == prev->e_fblock + prev->e_len
+	    && bno == prev->e_dblock + prev->e_len)
+		prev->e_len++;
+	else if (next && filebno + 1 == next->e_fblock
+		 && bno + 1 == next->e_dblock) {
+		next->e_fblock--;
+		next->e_dblock--;
+		next->e_len++;
+	} else {
+		// Insert a new extent after prev.
+		if ((r = extent_slot(f, f->f_nextents, 1, &e)) < 0) {
+			free_block(bno);
+			return r;
+		}
+		for (j = f->f_nextents; j > i + 1; j--)
+			*extent_get(f, j) = *extent_get(f, j - 1);
+		e = extent_get(f, i + 1);
+		e->e_fblock = filebno;
+		e->e_dblock = bno;
+		e->e_len = 1;
+		f->f_nextents++;
+	}
+	*pdiskbno = bno;
+	return 0;
+}
+
+// Allocate disk blocks for file blocks [start, end) of extent-based
+// file f, which must lie past its last extent.  Blocks are allocated in
+// contiguous runs continuing the last extent where possible, so a file
+// that grows by ftruncate or by appending stays in few extents.  The
+// new blocks are zeroed on disk, not in the cache.
+// On error, blocks allocated so far are left in place; the caller
+// truncates them away.
+static int
+extent_prealloc(struct File *f, uint32_t start, uint32_t end)
+{
+	struct Extent *last, *e;
+	uint32_t goal, bno, n;
+	int r;
+
+	while (start < end) {
+		last = f->f_nextents ? extent_get(f, f->f_nextents - 1) : 0;
+		if (last && start < last->e_fblock + last->e_len) {
+			start = last->e_fblock + last->e_len;
+			continue;
+		}
+		goal = last ? last->e_dblock + start - last->e_fblock : 0;
+		if ((r = alloc_block_run(goal, end - start, &n)) < 0)
+			return r;
+		bno = r;
+		if ((r = bc_zero_run(bno, n)) < 0)
+			goto fail;
+		if (last && start == last->e_fblock + last->e_len
+		    && bno == last->e_dblock + last->e_len)
+			last->e_len += n;
+		else {
+			if ((r = extent_slot(f, f->f_nextents, 1, &e)) < 0)
+				goto fail;
+			e->e_fblock = start;
+			e->e_dblock = bno;
+			e->e_len = n;
+			f->f_nextents++;
+		}
+		start += n;
+	}
+	return 0;
+
+fail:
+	while (n-- > 0)
+		free_block(bno + n);
+	return r;
+}
+
+// Free the blocks of extent-based file f from file block new_nblocks
+// on, along with any extent blocks no longer needed.
+static void
+extent_truncate_blocks(struct File *f, uint32_t new_nblocks)
+{
+	struct Extent *e;
+	struct ExtentBlock *eb;
+	uint32_t b, keep, nchain, *pbno, bno;
+
+	while (f->f_nextents > 0) {
+		e = extent_get(f, f->f_nextents - 1);
+		if (e->e_fblock + e->e_len <= new_nblocks)
+			break;
+		keep = e->e_fblock < new_nblocks ? new_nblocks - e->e_fblock : 0;
+		for (b = keep; b < e->e_len; b++)
+			free_block(e->e_dblock + b);
+		if (keep) {
+			e->e_len = keep;
+			break;
+		}
+		memset(e, 0, sizeof(*e));
+		f->f_nextents--;
+	}
+
+	// Keep only as many extent blocks as the remaining extents need.
+	if (f->f_nextents <= NEXTENT)
+		nchain = 0;
+	else
+		nchain = ROUNDUP(f->f_nextents - NEXTENT, NBLKEXTENT) / NBLKEXTENT;
+	for (pbno = &f->f_extblock; nchain > 0; nchain--)
+		pbno = &((struct ExtentBlock *) diskaddr(*pbno))->eb_next;
+	bno = *pbno;
+	*pbno = 0;
+	while (bno) {
+		eb = diskaddr(bno);
+		b = eb->eb_next;
+		free_block(bno);
+		bno = b;
+	}
+}
+
+// Set *pdiskbno to the disk block holding block filebno of file f, or
+// to 0 if that block is not allocated.  Works for both block-pointer
+// and extent-based files, and never allocates.
+int
+file_map_block(struct File *f, uint32_t filebno, uint32_t *pdiskbno)
+{
+	uint32_t *ptr;
+	int r;
+
+	if (f->f_flags & FFLAG_EXTENT)
+		return extent_map_block(f, filebno, pdiskbno, 0);
+	if ((r = file_block_walk(f, filebno, &ptr, 0)) < 0)
+		return r;
+	*pdiskbno = ptr ? *ptr : 0;
+	return 0;
 }
 
 // Find the disk block number slot for the 'filebno'th block in file 'f'.
@@ -145,6 +489,69 @@ file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool all
         panic("file_block_walk not implemented");
 }
 
+// Write the dirty data blocks of regular file f out in place.
+void
+file_flush_data(struct File *f)
+{
+	int i;
+	uint32_t b, diskbno;
+	struct Extent *e;
+
+	if (f->f_flags & FFLAG_EXTENT) {
+		for (i = 0; i < f->f_nextents; i++) {
+			e = extent_get(f, i);
+			for (b = 0; b < e->e_len; b++)
+				flush_block(diskaddr(e->e_dblock + b));
+		}
+		return;
+	}
+	for (i = 0; i < (f->f_size + BLKSIZE - 1) / BLKSIZE; i++)
+		if (file_map_block(f, i, &diskbno) == 0 && diskbno != 0)
+			flush_block(diskaddr(diskbno));
+}
+
+// Add the metadata of file f to the running transaction: the File
+// itself, its extent or indirect blocks and directory index, and, for
+// a directory, its contents.  A regular file's data is written in
+// place just before the transaction commits (see journal_order).
+static void
+file_dirty(struct File *f)
+{
+	int i;
+	uint32_t b, diskbno, bno;
+	struct Extent *e;
+
+	if (f->f_flags & FFLAG_EXTENT) {
+		for (i = 0; f->f_type == FTYPE_DIR && i < f->f_nextents; i++) {
+			e = extent_get(f, i);
+			for (b = 0; b < e->e_len; b++)
+				journal_dirty(diskaddr(e->e_dblock + b));
+		}
+		for (bno = f->f_extblock; bno;
+		     bno = ((struct ExtentBlock *) diskaddr(bno))->eb_next)
+			journal_dirty(diskaddr(bno));
+	} else {
+		for (i = 0; f->f_type == FTYPE_DIR
+			    && i < (f->f_size + BLKSIZE - 1) / BLKSIZE; i++)
+			if (file_map_block(f, i, &diskbno) == 0 && diskbno != 0)
+				journal_dirty(diskaddr(diskbno));
+		if (f->f_indirect)
+			journal_dirty(diskaddr(f->f_indirect));
+	}
+	dindex_flush(f);
+	journal_dirty(f);
+	if (f->f_type == FTYPE_REG)
+		journal_order(f);
+}
+
+// The file that overlay f is backed by.
+static struct File *
+file_backing(struct File *f)
+{
+	return (struct File *) diskaddr(f->f_backing / BLKFILES)
+		+ f->f_backing % BLKFILES;
+}
+
 // Set *blk to the address in memory where the filebno'th
 // block of file 'f' would be mapped.
 //
@@ -155,10 +562,92 @@ file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool all
 int
 file_get_block(struct File *f, uint32_t filebno, char **blk)
 {
+	uint32_t diskbno;
+	char *src;
+	int r;
+
+	// The first write to an overlay block copies it up from the
+	// backing file.
+	if ((f->f_flags & FFLAG_OVERLAY) && filebno < f->f_backsize) {
+		if ((r = extent_map_block(f, filebno, &diskbno, 0)) < 0)
+			return r;
+		if (diskbno == 0) {
+			assert(!serve_may_block());
+			if ((r = file_read_block(file_backing(f), filebno, &src)) < 0
+			    || (r = extent_map_block(f, filebno, &diskbno, 1)) < 0)
+				return r;
+			memmove(diskaddr(diskbno), src, BLKSIZE);
+			file_dirty(f);
+		}
+	}
+
+	if (f->f_flags & FFLAG_EXTENT) {
+		if ((r = extent_map_block(f, filebno, &diskbno, 0)) < 0)
+			return r;
+		if (diskbno == 0) {
+			// Only requests in the main thread change the file
+			// system, and what they allocate is journaled.
+			assert(!serve_may_block());
+			if ((r = extent_map_block(f, filebno, &diskbno, 1)) < 0)
+				return r;
+			file_dirty(f);
+		}
+		bc_fetch(diskbno);
+		*blk = diskaddr(diskbno);
+		return 0;
+	}
+
 	// LAB 5: Your code here.
 	panic("file_block_walk not implemented");
 }
 
+// Like file_get_block, but for reading: blocks that an overlay has not
+// written are read from its backing file instead of copied up, and a
+// block that isn't allocated reads as a shared page of zeros, which the
+// caller must not write.  Never allocates, so reader threads can use it
+// without changing the file system.
+int
+file_read_block(struct File *f, uint32_t filebno, char **blk)
+{
+	static char zeroblk[BLKSIZE] __attribute__((aligned(PGSIZE)));
+	uint32_t diskbno;
+	int r;
+
+	if ((f->f_flags & FFLAG_OVERLAY) && filebno < f->f_backsize) {
+		if ((r = extent_map_block(f, filebno, &diskbno, 0)) < 0)
+			return r;
+		if (diskbno == 0)
+			return file_read_block(file_backing(f), filebno, blk);
+	}
+	if ((r = file_map_block(f, filebno, &diskbno)) < 0 && r != -E_NOT_FOUND)
+		return r;
+	if (r < 0 || diskbno == 0) {
+		*blk = zeroblk;
+		return 0;
+	}
+	bc_fetch(diskbno);
+	*blk = diskaddr(diskbno);
+	return 0;
+}
+
+// A small cache of recent dir_lookup results, keyed on the directory
+// and name, so that repeated lookups don't touch the directory at all.
+// Entries are validated against the entry's name on use, and the whole
+// cache is dropped whenever a file is removed.
+#define NCACHE		128
+
+static struct {
+	struct File *dir;
+	struct File *file;
+} ncache[NCACHE];
+
+static uint32_t
+ncache_slot(struct File *dir, const char *name)
+{
+	return (dindex_hash(name) ^ ((uintptr_t) dir / sizeof(struct File)))
+		% NCACHE;
+}
+
 // Try to find a file named "name" in dir.  If so, set *file to it.
 //
 // Returns 0 and sets *file on success, < 0 on error.  Errors are:
@@ -167,32 +656,53 @@ static int
 dir_lookup(struct File *dir, const char *name, struct File **file)
 {
 	int r;
-	uint32_t i, j, nblock;
+	uint32_t i, j, nblock, slot;
 	char *blk;
 	struct File *f;
 
+	slot = ncache_slot(dir, name);
+	if (ncache[slot].dir == dir
+	    && strcmp(ncache[slot].file->f_name, name) == 0) {
+		*file = ncache[slot].file;
+		return 0;
+	}
+
+	// Large directories have a hash index; use it if present.
+	if (dir->f_flags & FFLAG_DINDEX) {
+		if ((r = dindex_lookup(dir, name, &f)) < 0)
+			return r;
+		goto found;
+	}
+
 	// Search dir for name.
 	// We maintain the invariant that the size of a directory-file
 	// is always a multiple of the file system's block size.
 	assert((dir->f_size % BLKSIZE) == 0);
 	nblock = dir->f_size / BLKSIZE;
 	for (i = 0; i < nblock; i++) {
-		if ((r = file_get_block(dir, i, &blk)) < 0)
+		if ((r = file_read_block(dir, i, &blk)) < 0)
 			return r;
 		f = (struct File*) blk;
 		for (j = 0; j < BLKFILES; j++)
 			if (strcmp(f[j].f_name, name) == 0) {
-				*file = &f[j];
-				return 0;
+				f = &f[j];
+				goto found;
 			}
 	}
 	return -E_NOT_FOUND;
+
+found:
+	ncache[slot].dir = dir;
+	ncache[slot].file = f;
+	*file = f;
+	return 0;
 }
 
-// Set *file to point at a free File structure in dir.  The caller is
-// responsible for filling in the File fields.
+// Set *file to point at a free File structure in dir, and *pent to its
+// position in the directory.  The caller is responsible for filling in
+// the File fields.
 static int
-dir_alloc_file(struct File *dir, struct File **file)
+dir_alloc_file(struct File *dir, struct File **file, uint32_t *pent)
 {
 	int r;
 	uint32_t nblock, i, j;
@@ -208,6 +718,7 @@ dir_alloc_file(struct File *dir, struct File **file)
 		for (j = 0; j < BLKFILES; j++)
 			if (f[j].f_name[0] == '\0') {
 				*file = &f[j];
+				*pent = i * BLKFILES + j;
 				return 0;
 			}
 	}
@@ -216,6 +727,7 @@ dir_alloc_file(struct File *dir, struct File **file)
 		return r;
 	f = (struct File*) blk;
 	*file = &f[0];
+	*pent = i * BLKFILES;
 	return 0;
 }
 
@@ -228,6 +740,63 @@ skip_slash(const char *p)
 	return p;
 }
 
+// A cache of whole paths that walk_path has resolved, so that looking
+// up a path again costs a hash and a string compare rather than a
+// dir_lookup per path element.  Negative entries remember paths that
+// don't exist, along with the directory the file would go in.  Creating
+// a file invalidates the negative entries; removing one invalidates
+// everything.  Both are done by bumping a generation number.
+#define NDCACHE		256
+// Longer paths are not cached
+#define DCACHE_PATHLEN	128
+
+static struct Dentry {
+	uint32_t d_gen;
+	struct File *d_dir;	// as walk_path sets *pdir
+	struct File *d_file;	// 0 for a negative entry
+	char d_path[DCACHE_PATHLEN];
+} dcache[NDCACHE];
+
+static uint32_t dcache_gen = 1;		// for positive entries
+static uint32_t dcache_neg_gen = 1;	// for negative entries
+
+static struct Dentry *
+dcache_slot(const char *path)
+{
+	return &dcache[dindex_hash(path) % NDCACHE];
+}
+
+// A file was created: paths that were missing may exist now.
+static void
+dcache_created(void)
+{
+	dcache_neg_gen++;
+}
+
+// A file was removed: paths that existed may be gone, and so may the
+// directories that negative entries point at.
+static void
+dcache_removed(void)
+{
+	dcache_gen++;
+	dcache_neg_gen++;
+}
+
+// Copy the last element of path into lastelem.
+static void
+last_elem(const char *path, char *lastelem)
+{
+	const char *p, *end;
+
+	end = path + strlen(path);
+	while (end > path && end[-1] == '/')
+		end--;
+	for (p = end; p > path && p[-1] != '/'; p--)
+		;
+	memmove(lastelem, p, end - p);
+	lastelem[end - p] = '\0';
+}
+
 // Evaluate a path name, starting at the root.
 // On success, set *pf to the file we found
 // and set *pdir to the directory the file is in.
@@ -235,7 +804,8 @@ skip_slash(const char *p)
 // it should be in, set *pdir and copy the final path
 // element into lastelem.
 static int
-walk_path(const char *path, struct File **pdir, struct File **pf, char *lastelem)
+walk_path_uncached(const char *path, struct File **pdir, struct File **pf,
+		   char *lastelem)
 {
 	const char *p;
 	char name[MAXNAMELEN];
@@ -284,6 +854,43 @@ walk_path(const char *path, struct File **pdir, struct File **pf, char *lastelem
 	return 0;
 }
 
+// walk_path_uncached, through the dentry cache.
+static int
+walk_path(const char *path, struct File **pdir, struct File **pf, char *lastelem)
+{
+	struct Dentry *d;
+	struct File *dir;
+	int r;
+
+	path = skip_slash(path);
+	if (strlen(path) >= DCACHE_PATHLEN)
+		return walk_path_uncached(path, pdir, pf, lastelem);
+
+	d = dcache_slot(path);
+	if (strcmp(d->d_path, path) == 0
+	    && d->d_gen == (d->d_file ? dcache_gen : dcache_neg_gen)) {
+		if (pdir)
+			*pdir = d->d_dir;
+		*pf = d->d_file;
+		if (d->d_file)
+			return 0;
+		if (d->d_dir && lastelem)
+			last_elem(path, lastelem);
+		return -E_NOT_FOUND;
+	}
+
+	r = walk_path_uncached(path, &dir, pf, lastelem);
+	if (pdir)
+		*pdir = dir;
+	if (r == 0 || r == -E_NOT_FOUND) {
+		strcpy(d->d_path, path);
+		d->d_dir = dir;
+		d->d_file = *pf;
+		d->d_gen = *pf ? dcache_gen : dcache_neg_gen;
+	}
+	return r;
+}
+
 // --------------------------------------------------------------
 // File operations
 // --------------------------------------------------------------
@@ -295,17 +902,51 @@ file_create(const char *path, struct File **pf)
 {
 	char name[MAXNAMELEN];
 	int r;
+	uint32_t ent;
 	struct File *dir, *f;
 
 	if ((r = walk_path(path, &dir, &f, name)) == 0)
 		return -E_FILE_EXISTS;
 	if (r != -E_NOT_FOUND || dir == 0)
 		return r;
-	if ((r = dir_alloc_file(dir, &f)) < 0)
+	if ((r = dir_alloc_file(dir, &f, &ent)) < 0)
 		return r;
+	memset(f, 0, sizeof(struct File));
 	strcpy(f->f_name, name);
+	f->f_flags = FFLAG_EXTENT;
+	dindex_insert(dir, name, ent);
+	dcache_created();
+	*pf = f;
+	file_dirty(dir);
+	return 0;
+}
+
+// Create "path" as a copy-on-write overlay of the regular file
+// "backing".  It starts out with backing's contents but no blocks of
+// its own; blocks are copied up from backing as they are written.
+// backing can't be removed or opened for writing while it has
+// overlays.  On success set *pf to point at the file and return 0.
+// On error return < 0.
+int
+file_overlay(const char *path, const char *backing, struct File **pf)
+{
+	struct File *b, *f;
+	int r;
+
+	if ((r = file_open(backing, &b)) < 0)
+		return r;
+	if (b->f_type != FTYPE_REG || !(b->f_flags & FFLAG_EXTENT))
+		return -E_INVAL;
+	if ((r = file_create(path, &f)) < 0)
+		return r;
+	f->f_flags |= FFLAG_OVERLAY;
+	f->f_backing = ((uintptr_t) b - DISKMAP) / sizeof(struct File);
+	f->f_backsize = ROUNDUP(b->f_size, BLKSIZE) / BLKSIZE;
+	f->f_size = b->f_size;
+	b->f_noverlays++;
+	journal_dirty(b);
+	journal_dirty(f);
 	*pf = f;
-	file_flush(dir);
 	return 0;
 }
 
@@ -333,7 +974,7 @@ file_read(struct File *f, void *buf, size_t count, off_t offset)
 	count = MIN(count, f->f_size - offset);
 
 	for (pos = offset; pos < offset + count; ) {
-		if ((r = file_get_block(f, pos / BLKSIZE, &blk)) < 0)
+		if ((r = file_read_block(f, pos / BLKSIZE, &blk)) < 0)
 			return r;
 		bn = MIN(BLKSIZE - pos % BLKSIZE, offset + count - pos);
 		memmove(buf, blk + pos % BLKSIZE, bn);
@@ -390,6 +1031,33 @@ file_free_block(struct File *f, uint32_t filebno)
 	return 0;
 }
 
+// Is any block of file f from file block nblocks on still mapped by a
+// client?  Such blocks can't be freed: the client would go on using
+// them after they were reused.
+static bool
+file_blocks_mapped_out(struct File *f, uint32_t nblocks)
+{
+	int i;
+	uint32_t b, diskbno;
+	struct Extent *e;
+
+	if (f->f_flags & FFLAG_EXTENT) {
+		for (i = 0; i < f->f_nextents; i++) {
+			e = extent_get(f, i);
+			for (b = 0; b < e->e_len; b++)
+				if (e->e_fblock + b >= nblocks
+				    && bc_mapped_out(e->e_dblock + b))
+					return 1;
+		}
+		return 0;
+	}
+	for (i = nblocks; i < (f->f_size + BLKSIZE - 1) / BLKSIZE; i++)
+		if (file_map_block(f, i, &diskbno) == 0 && diskbno != 0
+		    && bc_mapped_out(diskbno))
+			return 1;
+	return 0;
+}
+
 // Remove any blocks currently used by file 'f',
 // but not necessary for a file of size 'newsize'.
 // For both the old and new sizes, figure out the number of blocks required,
@@ -407,6 +1075,16 @@ file_truncate_blocks(struct File *f, off_t newsize)
 
 	old_nblocks = (f->f_size + BLKSIZE - 1) / BLKSIZE;
 	new_nblocks = (newsize + BLKSIZE - 1) / BLKSIZE;
+	if (new_nblocks == 0)
+		dindex_free(f);
+	// Don't let the backing file show through again if f regrows.
+	if ((f->f_flags & FFLAG_OVERLAY) && f->f_backsize > new_nblocks)
+		f->f_backsize = new_nblocks;
+	if (f->f_flags & FFLAG_EXTENT) {
+		extent_truncate_blocks(f, new_nblocks);
+		return;
+	}
+
 	for (bno = new_nblocks; bno < old_nblocks; bno++)
 		if ((r = file_free_block(f, bno)) < 0)
 			cprintf("warning: file_free_block: %e", r);
@@ -418,51 +1096,80 @@ file_truncate_blocks(struct File *f, off_t newsize)
 }
 
 // Set the size of file f, truncating or extending as necessary.
+// Returns -E_BUSY if truncating would free blocks a client has mapped.
 int
 file_set_size(struct File *f, off_t newsize)
 {
+	uint32_t old_nblocks, new_nblocks;
+	int r;
+
+	if (newsize < 0 || newsize > ((f->f_flags & FFLAG_EXTENT)
+				      ? MAXEXTFILESIZE : MAXFILESIZE))
+		return -E_INVAL;
+	if (f->f_size > newsize
+	    && file_blocks_mapped_out(f, (newsize + BLKSIZE - 1) / BLKSIZE))
+		return -E_BUSY;
 	if (f->f_size > newsize)
 		file_truncate_blocks(f, newsize);
+	else if (f->f_flags & FFLAG_EXTENT) {
+		// Preallocate the first PREALLOC_MAX new blocks as one run;
+		// any past that stay holes until they are written.
+		old_nblocks = (f->f_size + BLKSIZE - 1) / BLKSIZE;
+		new_nblocks = (newsize + BLKSIZE - 1) / BLKSIZE;
+		new_nblocks = MIN(new_nblocks, old_nblocks + PREALLOC_MAX);
+		if ((r = extent_prealloc(f, old_nblocks, new_nblocks)) < 0) {
+			extent_truncate_blocks(f, old_nblocks);
+			return r;
+		}
+	}
 	f->f_size = newsize;
-	flush_block(f);
+	file_dirty(f);
 	return 0;
 }
 
-// Flush the contents and metadata of file f out to disk.
-// Loop over all the blocks in file.
-// Translate the file block number into a disk block number
-// and then check whether that disk block is dirty.  If so, write it out.
+// Flush the contents and metadata of file f out to disk, committing
+// the running transaction.  File data is written in place; directory
+// contents are metadata and go through the journal.  Data goes first,
+// so the metadata committed after it never points at stale blocks.
 void
 file_flush(struct File *f)
 {
-	int i;
-	uint32_t *pdiskbno;
-
-	for (i = 0; i < (f->f_size + BLKSIZE - 1) / BLKSIZE; i++) {
-		if (file_block_walk(f, i, &pdiskbno, 0) < 0 ||
-		    pdiskbno == NULL || *pdiskbno == 0)
-			continue;
-		flush_block(diskaddr(*pdiskbno));
-	}
-	flush_block(f);
-	if (f->f_indirect)
-		flush_block(diskaddr(f->f_indirect));
+	if (f->f_type == FTYPE_REG)
+		file_flush_data(f);
+	file_dirty(f);
+	journal_commit();
 }
 
 // Remove a file by truncating it and then zeroing the name.
+// Returns -E_BUSY while a client has blocks of it mapped.
 int
 file_remove(const char *path)
 {
 	int r;
-	struct File *f;
+	struct File *dir, *f, *b;
 
-	if ((r = walk_path(path, 0, &f, 0)) < 0)
+	if ((r = walk_path(path, &dir, &f, 0)) < 0)
 		return r;
+	if (dir == 0)
+		return -E_INVAL;
+	if (f->f_noverlays)
+		return -E_NOT_SUPP;
+	if (file_blocks_mapped_out(f, 0))
+		return -E_BUSY;
+	if (f->f_flags & FFLAG_OVERLAY) {
+		b = file_backing(f);
+		b->f_noverlays--;
+		journal_dirty(b);
+	}
 
+	memset(ncache, 0, sizeof(ncache));
+	dcache_removed();
+	dindex_remove(dir, f->f_name);
+	dindex_flush(dir);
 	file_truncate_blocks(f, 0);
 	f->f_name[0] = '\0';
 	f->f_size = 0;
-	flush_block(f);
+	journal_dirty(f);
 
 	return 0;
 }
@@ -472,6 +1179,8 @@ void
 fs_sync(void)
 {
 	int i;
+
+	journal_checkpoint();
 	for (i = 1; i < super->s_nblocks; i++)
 		flush_block(diskaddr(i));
 }
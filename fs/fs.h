@@ -11,8 +11,49 @@
 /* Maximum disk size we can handle (3GB) */
 #define DISKSIZE	0xC0000000
 
+/* Physically contiguous pages shared with disk devices are mapped here. */
+#define DMAVA		0x0ff80000
+
+/* Blocks being read by bc_fetch, and the argument pages of requests in
+ * progress.  Both stay clear of the malloc arena, which the request
+ * threads allocate their stacks from. */
+#define FETCHVA		0x07000000
+#define NFETCH		16
+#define REQVA		0x07100000
+#define NREQ		32
+
 struct Super *super;		// superblock
 uint32_t *bitmap;		// bitmap blocks mapped in memory
+extern struct Fsret_stats fscounters;	// for FSREQ_STATS
+
+// A disk transfer, for batched or asynchronous I/O.
+struct DiskReq {
+	uint32_t secno;
+	void *buf;
+	size_t nsecs;
+	bool write;
+	int result;		// > 0 while in flight, then 0 or < 0
+};
+
+/* disk.c */
+void   disk_init(void);
+int    disk_read(uint32_t secno, void *dst, size_t nsecs);
+int    disk_write(uint32_t secno, const void *src, size_t nsecs);
+int    disk_rw_batch(struct DiskReq *reqs, int n);
+void   disk_submit(struct DiskReq *r);
+int    disk_irq(void);
+void   disk_intr(void);
+
+/* virtio.c */
+int    virtio_init(void);
+int    virtio_submit(struct DiskReq *r);
+void   virtio_kick(void);
+int    virtio_reap(void);
+void   virtio_wait(void);
+int    virtio_irq(void);
+void   virtio_intr(void);
+int    virtio_read(uint32_t secno, void *dst, size_t nsecs);
+int    virtio_write(uint32_t secno, const void *src, size_t nsecs);
 
 /* ide.c */
 bool   ide_probe_disk1(void);
@@ -26,22 +67,56 @@ bool   va_is_mapped(void *va);
 bool   va_is_dirty(void *va);
 void   flush_block(void *addr);
 void   bc_init(void);
+void   bc_fetch(uint32_t blockno);
+void   bc_zero(uint32_t blockno);
+int    bc_zero_run(uint32_t blockno, uint32_t n);
+bool   bc_mapped_out(uint32_t blockno);
+
+/* serv.c */
+bool   serve_may_block(void);
 
 /* fs.c */
 void   fs_init(void);
 int    file_get_block(struct File *f, uint32_t file_blockno, char **pblk);
+int    file_read_block(struct File *f, uint32_t file_blockno, char **pblk);
+int    file_map_block(struct File *f, uint32_t filebno, uint32_t *pdiskbno);
 int    file_create(const char *path, struct File **f);
+int    file_overlay(const char *path, const char *backing, struct File **f);
 int    file_open(const char *path, struct File **f);
 ssize_t file_read(struct File *f, void *buf, size_t count, off_t offset);
 int    file_write(struct File *f, const void *buf, size_t count, off_t offset);
 int    file_set_size(struct File *f, off_t newsize);
 void   file_flush(struct File *f);
+void   file_flush_data(struct File *f);
 int    file_remove(const char *path);
 void   fs_sync(void);
 int    file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool alloc);
 /* int	map_block(uint32_t); */
 bool   block_is_free(uint32_t blockno);
+void   free_block(uint32_t blockno);
 int    alloc_block(void);
+int    alloc_block_near(uint32_t goal);
+int    alloc_block_run(uint32_t goal, uint32_t n, uint32_t *pcount);
+
+/* journal.c */
+#define JOURNAL_COMMIT_MS	1000	// Longest a transaction stays open
+
+void   journal_init(void);
+void   journal_dirty(void *addr);
+void   journal_order(struct File *f);
+void   journal_begin(void);
+bool   journal_running(void);
+void   journal_commit(void);
+void   journal_checkpoint(void);
+int    journal_forget(uint32_t blockno);
+
+/* dindex.c */
+int    dindex_build(struct File *dir);
+void   dindex_insert(struct File *dir, const char *name, uint32_t ent);
+void   dindex_remove(struct File *dir, const char *name);
+int    dindex_lookup(struct File *dir, const char *name, struct File **file);
+void   dindex_free(struct File *dir);
+void   dindex_flush(struct File *dir);
 
 /* test.c */
 void   fs_test(void);
@@ -17,6 +17,7 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #undef off_t
 #undef bool
 
@@ -47,10 +48,22 @@ struct Dir
 	int n;
 };
 
+// A file whose blocks have been laid out but not yet copied in.
+struct Copy
+{
+	const char *name;
+	uint32_t start;
+	off_t size;
+};
+
 uint32_t nblocks;
+int diskfd;
 char *diskmap, *diskpos;
 struct Super *super;
 uint32_t *bitmap;
+struct Copy *copies;
+int ncopies;
+int njobs = 1;
 
 void
 panic(const char *fmt, ...)
@@ -69,7 +82,7 @@ readn(int f, void *out, size_t n)
 {
 	size_t p = 0;
 	while (p < n) {
-		size_t m = read(f, out + p, n - p);
+		ssize_t m = read(f, out + p, n - p);
 		if (m < 0)
 			panic("read: %s", strerror(errno));
 		if (m == 0)
@@ -88,6 +101,8 @@ void *
 alloc(uint32_t bytes)
 {
 	void *start = diskpos;
+	if (bytes == 0)
+		return start;
 	diskpos += ROUNDUP(bytes, BLKSIZE);
 	if (blockof(diskpos) >= nblocks)
 		panic("out of disk blocks");
@@ -97,7 +112,9 @@ alloc(uint32_t bytes)
 void
 opendisk(const char *name)
 {
-	int r, diskfd, nbitblocks;
+	int r, nbitblocks;
+	uint32_t njournal;
+	struct JournalHeader *jh;
 
 	if ((diskfd = open(name, O_RDWR | O_CREAT, 0666)) < 0)
 		panic("open %s: %s", name, strerror(errno));
@@ -110,8 +127,6 @@ opendisk(const char *name)
 			    MAP_SHARED, diskfd, 0)) == MAP_FAILED)
 		panic("mmap %s: %s", name, strerror(errno));
 
-	close(diskfd);
-
 	diskpos = diskmap;
 	alloc(BLKSIZE);
 	super = alloc(BLKSIZE);
@@ -123,6 +138,81 @@ opendisk(const char *name)
 	nbitblocks = (nblocks + BLKBITSIZE - 1) / BLKBITSIZE;
 	bitmap = alloc(nbitblocks * BLKSIZE);
 	memset(bitmap, 0xFF, nbitblocks * BLKSIZE);
+
+	// An empty metadata journal right after the bitmap.
+	njournal = nblocks / 32;
+	if (njournal < 16)
+		njournal = 16;
+	if (njournal > 256)
+		njournal = 256;
+	jh = alloc(njournal * BLKSIZE);
+	jh->jh_magic = JOURNAL_MAGIC;
+	jh->jh_seq = 1;
+	super->s_journal = blockof(jh);
+	super->s_njournal = njournal;
+}
+
+static bool
+iszero(const char *buf, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		if (buf[i])
+			return 0;
+	return 1;
+}
+
+// Copy a file's contents to the blocks laid out for it.  Blocks of
+// zeroes are skipped, leaving holes in the image, which is sparse to
+// begin with.  The metadata is written through diskmap instead; the
+// two are coherent since diskmap is a shared mapping.
+void
+copyfile(struct Copy *c)
+{
+	int fd;
+	off_t off;
+	size_t n;
+	char buf[BLKSIZE];
+
+	if ((fd = open(c->name, O_RDONLY)) < 0)
+		panic("open %s: %s", c->name, strerror(errno));
+	for (off = 0; off < c->size; off += BLKSIZE) {
+		n = c->size - off < BLKSIZE ? c->size - off : BLKSIZE;
+		readn(fd, buf, n);
+		if (iszero(buf, n))
+			continue;
+		if (pwrite(diskfd, buf, n, (off_t) c->start * BLKSIZE + off) != n)
+			panic("write %s: %s", c->name, strerror(errno));
+	}
+	close(fd);
+}
+
+// Copy in all the files, split among njobs processes.
+void
+copyfiles(void)
+{
+	int i, j, status;
+	pid_t pid;
+
+	if (njobs == 1) {
+		for (i = 0; i < ncopies; i++)
+			copyfile(&copies[i]);
+		return;
+	}
+	for (j = 0; j < njobs; j++) {
+		if ((pid = fork()) < 0)
+			panic("fork: %s", strerror(errno));
+		if (pid == 0) {
+			for (i = j; i < ncopies; i += njobs)
+				copyfile(&copies[i]);
+			_exit(0);
+		}
+	}
+	for (j = 0; j < njobs; j++)
+		if (wait(&status) < 0 || !WIFEXITED(status)
+		    || WEXITSTATUS(status) != 0)
+			panic("copying files failed");
 }
 
 void
@@ -133,31 +223,31 @@ finishdisk(void)
 	for (i = 0; i < blockof(diskpos); ++i)
 		bitmap[i/32] &= ~(1<<(i%32));
 
+	copyfiles();
 	if ((r = msync(diskmap, nblocks * BLKSIZE, MS_SYNC)) < 0)
 		panic("msync: %s", strerror(errno));
+	close(diskfd);
 }
 
+// Files are laid out contiguously, so each one is a single extent.
 void
 finishfile(struct File *f, uint32_t start, uint32_t len)
 {
-	int i;
 	f->f_size = len;
-	len = ROUNDUP(len, BLKSIZE);
-	for (i = 0; i < len / BLKSIZE && i < NDIRECT; ++i)
-		f->f_direct[i] = start + i;
-	if (i == NDIRECT) {
-		uint32_t *ind = alloc(BLKSIZE);
-		f->f_indirect = blockof(ind);
-		for (; i < len / BLKSIZE; ++i)
-			ind[i - NDIRECT] = start + i;
-	}
+	f->f_flags = FFLAG_EXTENT;
+	if (len == 0)
+		return;
+	f->f_nextents = 1;
+	f->f_extents[0].e_fblock = 0;
+	f->f_extents[0].e_dblock = start;
+	f->f_extents[0].e_len = ROUNDUP(len, BLKSIZE) / BLKSIZE;
 }
 
 void
 startdir(struct File *f, struct Dir *dout)
 {
 	dout->f = f;
-	dout->ents = malloc(MAX_DIR_ENTS * sizeof *dout->ents);
+	dout->ents = calloc(MAX_DIR_ENTS, sizeof *dout->ents);
 	dout->n = 0;
 }
 
@@ -172,33 +262,69 @@ diradd(struct Dir *d, uint32_t type, const char *name)
 	return out;
 }
 
+// Give a large directory the hash index the file server would build
+// for it, so that lookups in it are fast from the start.
+void
+builddindex(struct File *dir, struct File *ents, int n)
+{
+	uint32_t nslots, i, j, mask, *root;
+	struct DirSlot *slots;
+
+	for (nslots = BLKDIRSLOTS; nslots < 2 * n; nslots *= 2)
+		;
+	if (nslots > DINDEX_MAXSLOTS)
+		return;
+	root = alloc(BLKSIZE);
+	slots = alloc(nslots * sizeof(struct DirSlot));
+	for (i = 0; i < nslots / BLKDIRSLOTS; i++)
+		root[i] = blockof(slots) + i;
+
+	mask = nslots - 1;
+	for (i = 0; i < n; i++) {
+		j = dindex_hash(ents[i].f_name) & mask;
+		while (slots[j].ds_ent != 0)
+			j = (j + 1) & mask;
+		slots[j].ds_hash = dindex_hash(ents[i].f_name);
+		slots[j].ds_ent = i + 1;
+	}
+	dir->f_dindex = blockof(root);
+	dir->f_dislots = nslots;
+	dir->f_diused = n;
+	dir->f_flags |= FFLAG_DINDEX;
+}
+
 void
 finishdir(struct Dir *d)
 {
 	int size = d->n * sizeof(struct File);
 	struct File *start = alloc(size);
 	memmove(start, d->ents, size);
-	finishfile(d->f, blockof(start), ROUNDUP(size, BLKSIZE));
+	finishfile(d->f, blockof(start), size ? ROUNDUP(size, BLKSIZE) : 0);
+	if (size && ROUNDUP(size, BLKSIZE) / BLKSIZE >= DINDEX_MIN_BLOCKS)
+		builddindex(d->f, start, d->n);
 	free(d->ents);
 	d->ents = NULL;
 }
 
+// Add a file to dir.  Files are laid out one after another in the
+// order they are given, each in a single extent: a block lookup in the
+// file server is then one comparison against the File's first extent,
+// and reading a file, or files listed together, is one sequential pass
+// over the disk.  The contents are copied in later, by copyfiles.
 void
 writefile(struct Dir *dir, const char *name)
 {
-	int r, fd;
+	int r;
 	struct File *f;
 	struct stat st;
 	const char *last;
 	char *start;
 
-	if ((fd = open(name, O_RDONLY)) < 0)
-		panic("open %s: %s", name, strerror(errno));
-	if ((r = fstat(fd, &st)) < 0)
+	if ((r = stat(name, &st)) < 0)
 		panic("stat %s: %s", name, strerror(errno));
 	if (!S_ISREG(st.st_mode))
 		panic("%s is not a regular file", name);
-	if (st.st_size >= MAXFILESIZE)
+	if (st.st_size >= MAXEXTFILESIZE)
 		panic("%s too large", name);
 
 	last = strrchr(name, '/');
@@ -209,15 +335,20 @@ writefile(struct Dir *dir, const char *name)
 
 	f = diradd(dir, FTYPE_REG, last);
 	start = alloc(st.st_size);
-	readn(fd, start, st.st_size);
 	finishfile(f, blockof(start), st.st_size);
-	close(fd);
+
+	if (!(copies = realloc(copies, (ncopies + 1) * sizeof *copies)))
+		panic("out of memory");
+	copies[ncopies].name = name;
+	copies[ncopies].start = blockof(start);
+	copies[ncopies].size = st.st_size;
+	ncopies++;
 }
 
 void
 usage(void)
 {
-	fprintf(stderr, "Usage: fsformat fs.img NBLOCKS files...\n");
+	fprintf(stderr, "Usage: fsformat [-j JOBS] fs.img NBLOCKS files...\n");
 	exit(2);
 }
 
@@ -234,6 +365,13 @@ main(int argc, char **argv)
 	struct File *v;
 	assert(BLKSIZE % sizeof(struct File) == 0);
 
+	if (argc > 2 && strcmp(argv[1], "-j") == 0) {
+		njobs = strtol(argv[2], &s, 0);
+		if (*s || s == argv[2] || njobs < 1)
+			usage();
+		argc -= 2;
+		argv += 2;
+	}
 	if (argc < 3)
 		usage();
 
@@ -0,0 +1,385 @@
+/*
+ * Write-ahead metadata journal.
+ *
+ * Metadata blocks (File structures, directory contents, the bitmap,
+ * extent and index blocks) are not written in place when they change.
+ * Instead journal_dirty adds them to the running transaction, and
+ * journal_commit appends copies of all of them to the journal in one
+ * sequential batch, followed by a commit block.  The transaction
+ * collects the changes of many requests: it is committed by file_flush
+ * and fs_sync, by journal_begin between requests once it is large, and
+ * by the file server's commit timer JOURNAL_COMMIT_MS after it starts.
+ * It never commits in the middle of a request, so a crash never leaves
+ * half a request on disk.  Only committed blocks are later written
+ * home, by checkpointing, which happens when the journal fills up and
+ * on fs_sync.  File data is written in place before the metadata that
+ * refers to it is committed (see journal_order).
+ *
+ * After a crash, journal_init replays every committed transaction, so
+ * the metadata is always the state as of some commit and no full
+ * bitmap check is needed.
+ */
+
+#include <inc/string.h>
+
+#include "fs.h"
+
+// Blocks after which journal_begin commits the transaction, most
+// committed blocks awaiting checkpoint, and most files whose data the
+// transaction waits for.
+#define JOURNAL_TXBLOCKS	128
+#define JOURNAL_PENDING		1024
+#define JOURNAL_FILES		64
+
+static uint32_t jtx[JOURNAL_MAXTX];		// Running transaction
+static int njtx;
+static struct File *jfiles[JOURNAL_FILES];	// Data to write first
+static int njfiles;
+static uint32_t jpending[JOURNAL_PENDING];	// Committed, not yet home
+static int njpending;
+static uint32_t jdeferred[JOURNAL_PENDING];	// Frees awaiting checkpoint
+static int njdeferred;
+
+static uint32_t jhead;		// Next free journal block, from s_journal
+static uint32_t jseq;		// Sequence number of the next transaction
+static uint32_t jtxmax;		// Commit between requests at this size
+static uint32_t jtxlimit;	// Largest transaction the journal holds
+
+static uint8_t jbuf[BLKSIZE] __attribute__((aligned(PGSIZE)));
+static struct DiskReq jreqs[JOURNAL_MAXTX + 1];
+
+static bool
+journal_enabled(void)
+{
+	return super && super->s_journal;
+}
+
+static uint32_t
+blockof(void *addr)
+{
+	return ((uintptr_t) addr - DISKMAP) / BLKSIZE;
+}
+
+static int
+find_block(uint32_t *list, int n, uint32_t blockno)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (list[i] == blockno)
+			return i;
+	return -1;
+}
+
+static void
+journal_io(uint32_t jblock, void *buf, bool write)
+{
+	int r;
+
+	jblock += super->s_journal;
+	if (write)
+		r = disk_write(jblock * BLKSECTS, buf, BLKSECTS);
+	else
+		r = disk_read(jblock * BLKSECTS, buf, BLKSECTS);
+	if (r < 0)
+		panic("journal block %08x: %e", jblock, r);
+}
+
+// Clear the PTE_D bit of a block cache page whose contents are safe
+// on disk.
+static void
+clear_dirty(void *addr)
+{
+	int r;
+
+	if (!va_is_mapped(addr) || !va_is_dirty(addr))
+		return;
+	if ((r = sys_page_map(0, addr, 0, addr,
+			      uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0)
+		panic("journal clear_dirty: %e", r);
+}
+
+static uint32_t
+block_sum(const uint32_t *p)
+{
+	uint32_t sum = 0;
+	int i;
+
+	for (i = 0; i < BLKSIZE / 4; i++)
+		sum += p[i];
+	return sum;
+}
+
+// Write every committed block home.  The journal keeps its copies
+// until journal_write_home empties it.
+static void
+pending_flush(void)
+{
+	int i, n, r;
+
+	for (i = 0; i < njpending; i += n) {
+		n = MIN(njpending - i, JOURNAL_MAXTX + 1);
+		for (r = 0; r < n; r++) {
+			jreqs[r].secno = jpending[i + r] * BLKSECTS;
+			jreqs[r].buf = diskaddr(jpending[i + r]);
+			jreqs[r].nsecs = BLKSECTS;
+			jreqs[r].write = 1;
+		}
+		if ((r = disk_rw_batch(jreqs, n)) < 0)
+			panic("journal checkpoint: %e", r);
+	}
+	for (i = 0; i < njpending; i++)
+		clear_dirty(diskaddr(jpending[i]));
+	njpending = 0;
+}
+
+// Write every committed block home, then empty the journal.  This
+// leaves the running transaction alone, so it is safe in the middle of
+// a request, but not while a commit or replay is walking the journal.
+static void
+journal_write_home(void)
+{
+	struct JournalHeader *jh;
+	uint32_t bno;
+
+	pending_flush();
+
+	// The journal no longer holds copies of these, so they can be
+	// reused without replay clobbering them.
+	while (njdeferred > 0) {
+		bno = jdeferred[--njdeferred];
+		free_block(bno);
+	}
+
+	memset(jbuf, 0, BLKSIZE);
+	jh = (struct JournalHeader *) jbuf;
+	jh->jh_magic = JOURNAL_MAGIC;
+	jh->jh_seq = jseq;
+	journal_io(0, jbuf, 1);
+	jhead = 1;
+}
+
+// Note that committed block blockno has yet to be written home.  When
+// too many are waiting, they are written home but the journal is left
+// alone: this runs while a commit or replay is walking the journal.
+static void
+pending_add(uint32_t blockno)
+{
+	if (find_block(jpending, njpending, blockno) >= 0)
+		return;
+	if (njpending == JOURNAL_PENDING)
+		pending_flush();
+	jpending[njpending++] = blockno;
+}
+
+// Add the block containing addr to the running transaction, if it is
+// dirty.  The transaction may grow past jtxmax until the request ends,
+// up to what the journal holds.  Without a journal, just write it in
+// place.
+void
+journal_dirty(void *addr)
+{
+	uint32_t blockno = blockof(addr);
+
+	if (!journal_enabled()) {
+		flush_block(addr);
+		return;
+	}
+	addr = diskaddr(blockno);
+	if (!va_is_mapped(addr) || !va_is_dirty(addr))
+		return;
+	if (find_block(jtx, njtx, blockno) >= 0)
+		return;
+	if (njtx == jtxlimit)
+		panic("journal: request changed more than %d blocks", jtxlimit);
+	jtx[njtx++] = blockno;
+}
+
+// Have the data of regular file f, whose metadata is in the running
+// transaction, written in place before the transaction commits, so
+// that committed metadata never points at blocks that don't hold
+// their data yet.  When too many are waiting, their data is written
+// now: it can go out early, just not late.
+void
+journal_order(struct File *f)
+{
+	int i;
+
+	if (!journal_enabled())
+		return;
+	for (i = 0; i < njfiles; i++)
+		if (jfiles[i] == f)
+			return;
+	if (njfiles == JOURNAL_FILES)
+		while (njfiles > 0)
+			file_flush_data(jfiles[--njfiles]);
+	jfiles[njfiles++] = f;
+}
+
+// Does the running transaction hold any changes?
+bool
+journal_running(void)
+{
+	return journal_enabled() && (njtx > 0 || njfiles > 0);
+}
+
+// Called by the file server between requests, the only place besides
+// an explicit flush where the running transaction may commit: commit it
+// if it has reached jtxmax, leaving the rest of the journal for the
+// next request.
+void
+journal_begin(void)
+{
+	if (journal_enabled() && njtx >= jtxmax)
+		journal_commit();
+}
+
+// Commit the running transaction: write the data it waits for in
+// place, then its blocks to the journal in one batch, then the commit
+// block.
+void
+journal_commit(void)
+{
+	struct JournalDesc *jd = (struct JournalDesc *) jbuf;
+	struct JournalCommit *jc = (struct JournalCommit *) jbuf;
+	uint32_t sum = 0;
+	int i, r;
+
+	if (!journal_enabled())
+		return;
+	for (i = 0; i < njfiles; i++)
+		file_flush_data(jfiles[i]);
+	njfiles = 0;
+	if (njtx == 0)
+		return;
+	if (jhead + njtx + 2 > super->s_njournal)
+		journal_write_home();
+
+	memset(jbuf, 0, BLKSIZE);
+	jd->jd_magic = JDESC_MAGIC;
+	jd->jd_seq = jseq;
+	jd->jd_nblocks = njtx;
+	jreqs[0].secno = (super->s_journal + jhead) * BLKSECTS;
+	jreqs[0].buf = jbuf;
+	jreqs[0].nsecs = BLKSECTS;
+	jreqs[0].write = 1;
+	for (i = 0; i < njtx; i++) {
+		jd->jd_blocks[i] = jtx[i];
+		sum += block_sum(diskaddr(jtx[i]));
+		jreqs[i + 1].secno = (super->s_journal + jhead + 1 + i) * BLKSECTS;
+		jreqs[i + 1].buf = diskaddr(jtx[i]);
+		jreqs[i + 1].nsecs = BLKSECTS;
+		jreqs[i + 1].write = 1;
+	}
+	if ((r = disk_rw_batch(jreqs, njtx + 1)) < 0)
+		panic("journal commit: %e", r);
+
+	// The commit block goes out only once everything it covers is
+	// on disk.
+	memset(jbuf, 0, BLKSIZE);
+	jc->jc_magic = JCOMMIT_MAGIC;
+	jc->jc_seq = jseq;
+	jc->jc_sum = sum;
+	journal_io(jhead + 1 + njtx, jbuf, 1);
+
+	for (i = 0; i < njtx; i++) {
+		clear_dirty(diskaddr(jtx[i]));
+		pending_add(jtx[i]);
+	}
+	jhead += njtx + 2;
+	jseq++;
+	njtx = 0;
+}
+
+// Commit, then write everything home and empty the journal.
+void
+journal_checkpoint(void)
+{
+	if (!journal_enabled())
+		return;
+	journal_commit();
+	journal_write_home();
+}
+
+// Called when blockno is freed.  Returns 1 if the free has to wait for
+// the next checkpoint, because the journal still holds a copy of the
+// block that replay would write over its next user.
+int
+journal_forget(uint32_t blockno)
+{
+	int i;
+
+	if (!journal_enabled())
+		return 0;
+	if ((i = find_block(jtx, njtx, blockno)) >= 0)
+		jtx[i] = jtx[--njtx];
+	if (find_block(jpending, njpending, blockno) < 0)
+		return 0;
+	if (njdeferred == JOURNAL_PENDING)
+		journal_write_home();
+	if (find_block(jpending, njpending, blockno) < 0)
+		return 0;
+	jdeferred[njdeferred++] = blockno;
+	return 1;
+}
+
+// Replay committed transactions left in the journal by a crash, then
+// start a fresh journal.
+void
+journal_init(void)
+{
+	static uint32_t blocks[JOURNAL_MAXTX];
+	struct JournalHeader *jh = (struct JournalHeader *) jbuf;
+	struct JournalDesc *jd = (struct JournalDesc *) jbuf;
+	struct JournalCommit *jc = (struct JournalCommit *) jbuf;
+	uint32_t i, n, sum, ntx = 0;
+
+	if (!journal_enabled())
+		return;
+	if (super->s_njournal < 4
+	    || super->s_journal + super->s_njournal > super->s_nblocks)
+		panic("bad journal");
+	// Commit transactions at about half the journal, so that it
+	// holds several between checkpoints instead of being emptied
+	// after every commit, and so that a request that starts below
+	// that has the other half to itself.
+	jtxmax = MIN(JOURNAL_TXBLOCKS, (super->s_njournal - 2) / 2);
+	jtxlimit = MIN(JOURNAL_MAXTX, super->s_njournal - 3);
+
+	journal_io(0, jbuf, 0);
+	if (jh->jh_magic != JOURNAL_MAGIC)
+		panic("bad journal magic %08x", jh->jh_magic);
+	jseq = jh->jh_seq;
+
+	for (jhead = 1; jhead + 2 <= super->s_njournal; jhead += n + 2) {
+		journal_io(jhead, jbuf, 0);
+		n = jd->jd_nblocks;
+		if (jd->jd_magic != JDESC_MAGIC || jd->jd_seq != jseq
+		    || n == 0 || n > JOURNAL_MAXTX
+		    || jhead + n + 2 > super->s_njournal)
+			break;
+		memmove(blocks, jd->jd_blocks, n * sizeof(uint32_t));
+
+		journal_io(jhead + 1 + n, jbuf, 0);
+		if (jc->jc_magic != JCOMMIT_MAGIC || jc->jc_seq != jseq)
+			break;
+		sum = jc->jc_sum;
+		for (i = 0; i < n; i++) {
+			journal_io(jhead + 1 + i, jbuf, 0);
+			sum -= block_sum((uint32_t *) jbuf);
+		}
+		if (sum != 0)
+			break;
+
+		for (i = 0; i < n; i++) {
+			journal_io(jhead + 1 + i, jbuf, 0);
+			memmove(diskaddr(blocks[i]), jbuf, BLKSIZE);
+			pending_add(blocks[i]);
+		}
+		jseq++;
+		ntx++;
+	}
+	if (ntx)
+		cprintf("journal: replayed %d transactions\n", ntx);
+	journal_write_home();
+}
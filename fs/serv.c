@@ -5,6 +5,7 @@
 
 #include <inc/x86.h>
 #include <inc/string.h>
+#include <arch/thread.h>
 
 #include "fs.h"
 
@@ -22,81 +23,151 @@
 //    on *its own page* in memory, and it is shared with any
 //    environments that have the file open.
 // 3. 'struct OpenFile' links these other two structures, and is kept
-//    private to the file server.  The server maintains an array of
+//    private to the file server.  The server maintains a table of
 //    all open files, indexed by "file ID".  (There can be at most
 //    MAXOPEN files open concurrently.)  The client uses file IDs to
 //    communicate with the server.  File IDs are a lot like
 //    environment IDs in the kernel.  Use openfile_lookup to translate
 //    file IDs to struct OpenFile.
+//
+// Clients never tell us when they close a file; an entry is free again
+// once its Fd page is mapped only by us.  Rather than search for such
+// entries on every open, free entries are kept on a list, and the list
+// is refilled by sweeping the open entries only when it runs dry.  If a
+// sweep finds few closed files, the table grows instead, so each open
+// costs O(1) amortized.
 
 struct OpenFile {
 	uint32_t o_fileid;	// file id
 	struct File *o_file;	// mapped descriptor for open file
 	int o_mode;		// open mode
 	struct Fd *o_fd;	// Fd page
+	envid_t o_envid;	// environment that opened the file
+	int o_next;		// next entry on the free or open list
 };
 
 // Max number of open files in the file system at once
-#define MAXOPEN		1024
+#define MAXOPEN		16384
+// Max number of files one environment may have open at once
+#define MAXOPEN_ENV	1024
+// The table grows this many entries at a time
+#define OPENCHUNK	256
 #define FILEVA		0xD0000000
 
-// initialize to force into data section
-struct OpenFile opentab[MAXOPEN] = {
-	{ 0, 0, 1, 0 }
-};
+// The table is allocated in chunks that never move, so a request that
+// blocks can hold on to its struct OpenFile while the table grows.
+static struct OpenFile *opentab[MAXOPEN / OPENCHUNK];
+static int nopen;		// Entries in the table
+static int openfree = -1;	// Free entries
+static int openused = -1;	// Entries handed out since the last sweep
+static uint16_t envopen[NENV];	// Open files per environment
 
-// Virtual address at which to receive page mappings containing client requests.
-union Fsipc *fsreq = (union Fsipc *)0x0ffff000;
+static struct OpenFile *
+openfile(int i)
+{
+	return &opentab[i / OPENCHUNK][i % OPENCHUNK];
+}
 
 void
 serve_init(void)
 {
+	nopen = 0;
+	openfree = openused = -1;
+}
+
+// Add OPENCHUNK entries to the free list.
+static int
+openfile_grow(void)
+{
+	struct OpenFile *o;
 	int i;
-	uintptr_t va = FILEVA;
-	for (i = 0; i < MAXOPEN; i++) {
-		opentab[i].o_fileid = i;
-		opentab[i].o_fd = (struct Fd*) va;
-		va += PGSIZE;
+
+	if (nopen == MAXOPEN)
+		return -E_MAX_OPEN;
+	if (!(o = malloc(OPENCHUNK * sizeof(struct OpenFile))))
+		return -E_NO_MEM;
+	opentab[nopen / OPENCHUNK] = o;
+	for (i = OPENCHUNK - 1; i >= 0; i--) {
+		o[i].o_fileid = nopen + i;
+		o[i].o_fd = (struct Fd*) (FILEVA + (uintptr_t) (nopen + i) * PGSIZE);
+		o[i].o_next = openfree;
+		openfree = nopen + i;
 	}
+	nopen += OPENCHUNK;
+	return 0;
 }
 
-// Allocate an open file.
+// Move the entries whose files have been closed from the open list to
+// the free list.  Returns the number of entries freed.
+static int
+openfile_sweep(void)
+{
+	struct OpenFile *o;
+	int *prev = &openused;
+	int i, nfreed = 0;
+
+	while ((i = *prev) >= 0) {
+		o = openfile(i);
+		if (pageref(o->o_fd) > 1) {
+			prev = &o->o_next;
+			continue;
+		}
+		*prev = o->o_next;
+		o->o_next = openfree;
+		openfree = i;
+		envopen[ENVX(o->o_envid)]--;
+		nfreed++;
+	}
+	return nfreed;
+}
+
+// Allocate an open file for envid.
 int
-openfile_alloc(struct OpenFile **o)
+openfile_alloc(envid_t envid, struct OpenFile **o)
 {
+	struct OpenFile *of;
 	int i, r;
 
+	if (envopen[ENVX(envid)] >= MAXOPEN_ENV)
+		openfile_sweep();
+	if (envopen[ENVX(envid)] >= MAXOPEN_ENV)
+		return -E_MAX_OPEN;
+
 	// Find an available open-file table entry
-	for (i = 0; i < MAXOPEN; i++) {
-		switch (pageref(opentab[i].o_fd)) {
+	while (1) {
+		// Sweep when the free list runs dry, and grow the table
+		// too unless a good share of it was freed.
+		if (openfree < 0 && openfile_sweep() <= nopen / 4
+		    && (r = openfile_grow()) < 0 && openfree < 0)
+			return r;
 
-		case 0:
-			if ((r = sys_page_alloc(0, opentab[i].o_fd, PTE_P|PTE_U|PTE_W)) < 0)
-				return r;
+		i = openfree;
+		of = openfile(i);
+		openfree = of->o_next;
 #ifdef VMM_GUEST
-			opentab[i].o_fileid += MAXOPEN;
-			*o = &opentab[i];
-			memset(opentab[i].o_fd, 0, PGSIZE);
-			return (*o)->o_fileid;
-			break;
-#else
-			/* fall through */
-#endif // VMM_GUEST
-		case 1:
-#ifdef VMM_GUEST
-			if ((uint64_t) opentab[i].o_fd != get_host_fd()) {
+		// The host's Fd page may overlap the table; never reuse it.
+		if ((uint64_t) of->o_fd == get_host_fd())
+			continue;
 #endif // VMM_GUEST
+		break;
+	}
 
-			opentab[i].o_fileid += MAXOPEN;
-			*o = &opentab[i];
-			memset(opentab[i].o_fd, 0, PGSIZE);
-			return (*o)->o_fileid;
-#ifdef VMM_GUEST
-		        }
-#endif // VMM_GUEST
-	         }
-        }
-	return -E_MAX_OPEN;
+	if (pageref(of->o_fd) == 0
+	    && (r = sys_page_alloc(0, of->o_fd, PTE_P|PTE_U|PTE_W)) < 0) {
+		of->o_next = openfree;
+		openfree = i;
+		return r;
+	}
+	// A new ID for the same entry, wrapped to stay a positive int;
+	// 2^31 is a multiple of MAXOPEN, so the ID still maps to entry i.
+	of->o_fileid = (of->o_fileid + MAXOPEN) & 0x7FFFFFFF;
+	of->o_envid = envid;
+	of->o_next = openused;
+	openused = i;
+	envopen[ENVX(envid)]++;
+	memset(of->o_fd, 0, PGSIZE);
+	*o = of;
+	return of->o_fileid;
 }
 
 // Look up an open file for envid.
@@ -105,8 +176,10 @@ openfile_lookup(envid_t envid, uint32_t fileid, struct OpenFile **po)
 {
 	struct OpenFile *o;
 
-	o = &opentab[fileid % MAXOPEN];
-	if (pageref(o->o_fd) == 1 || o->o_fileid != fileid)
+	if (fileid % MAXOPEN >= nopen)
+		return -E_INVAL;
+	o = openfile(fileid % MAXOPEN);
+	if (pageref(o->o_fd) <= 1 || o->o_fileid != fileid)
 		return -E_INVAL;
 	*po = o;
 	return 0;
@@ -133,7 +206,7 @@ serve_open(envid_t envid, struct Fsreq_open *req,
 	path[MAXPATHLEN-1] = 0;
 
 	// Find an open file ID
-	if ((r = openfile_alloc(&o)) < 0) {
+	if ((r = openfile_alloc(envid, &o)) < 0) {
 		if (debug)
 			cprintf("openfile_alloc failed: %e", r);
 		return r;
@@ -149,6 +222,10 @@ serve_open(envid_t envid, struct Fsreq_open *req,
 				cprintf("file_create failed: %e", r);
 			return r;
 		}
+		if (req->req_omode & O_MKDIR) {
+			f->f_type = FTYPE_DIR;
+			journal_dirty(f);
+		}
 	} else {
 try_open:
 		if ((r = file_open(path, &f)) < 0) {
@@ -158,6 +235,11 @@ try_open:
 		}
 	}
 
+	// Overlays rely on their backing file never changing.
+	if (f->f_noverlays && ((req->req_omode & O_ACCMODE) != O_RDONLY
+			       || (req->req_omode & O_TRUNC)))
+		return -E_NOT_SUPP;
+
 	// Truncate
 	if (req->req_omode & O_TRUNC) {
 		if ((r = file_set_size(f, 0)) < 0) {
@@ -234,6 +316,89 @@ serve_read(envid_t envid, union Fsipc *ipc)
 	panic("serve_read not implemented");
 }
 
+// Map the block of req->req_fileid at req->req_offset, which must be
+// block-aligned, into the caller read-only, by returning the block
+// cache page itself in *pg_store.  Returns the number of valid bytes
+// in the block, 0 at end of file, or < 0 on error.  The file can't be
+// truncated past the block or removed until the caller unmaps it.
+int
+serve_read_map(envid_t envid, struct Fsreq_read_map *req,
+	       void **pg_store, int *perm_store)
+{
+	struct OpenFile *o;
+	char *blk;
+	int r;
+
+	if (debug)
+		cprintf("serve_read_map %08x %08x %08x\n", envid, req->req_fileid, req->req_offset);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	if ((o->o_mode & O_ACCMODE) == O_WRONLY)
+		return -E_INVAL;
+	if (req->req_offset < 0 || req->req_offset % BLKSIZE)
+		return -E_INVAL;
+	if (req->req_offset >= o->o_file->f_size)
+		return 0;
+	if ((r = file_read_block(o->o_file, req->req_offset / BLKSIZE, &blk)) < 0)
+		return r;
+
+	// Fault the block in, so there is a page to send.
+	(void) *(volatile char *) blk;
+	*pg_store = blk;
+	*perm_store = PTE_P|PTE_U;
+	return MIN(BLKSIZE, o->o_file->f_size - req->req_offset);
+}
+
+// Handle a page fault or msync for a client's memory mapping of the
+// block of req->req_fileid at req->req_offset.  Returns the block cache
+// page in *pg_store, writable and shared if req->req_flags has
+// FSMAP_WRITE.  With FSMAP_DIRTY, the client has written to its
+// mapping of the block; mark our own mapping dirty so the next
+// file_flush writes the block out, and return no page.  Only regular
+// files can be mapped writable, since anything else is metadata, and
+// the file can't be truncated past the block or removed until the
+// caller unmaps it.  Returns -E_EOF if the block is past the end of
+// the file.
+int
+serve_map(envid_t envid, struct Fsreq_map *req,
+	  void **pg_store, int *perm_store)
+{
+	struct OpenFile *o;
+	char *blk;
+	int r;
+
+	if (debug)
+		cprintf("serve_map %08x %08x %08x %x\n", envid, req->req_fileid, req->req_offset, req->req_flags);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	if ((req->req_flags & (FSMAP_WRITE|FSMAP_DIRTY))
+	    && ((o->o_mode & O_ACCMODE) == O_RDONLY
+		|| o->o_file->f_type != FTYPE_REG))
+		return -E_INVAL;
+	if (req->req_offset < 0 || req->req_offset % BLKSIZE)
+		return -E_INVAL;
+	if (req->req_offset >= o->o_file->f_size)
+		return -E_EOF;
+	if (req->req_flags & (FSMAP_WRITE|FSMAP_DIRTY))
+		r = file_get_block(o->o_file, req->req_offset / BLKSIZE, &blk);
+	else
+		r = file_read_block(o->o_file, req->req_offset / BLKSIZE, &blk);
+	if (r < 0)
+		return r;
+
+	if (req->req_flags & FSMAP_DIRTY) {
+		*(volatile char *) blk = *(volatile char *) blk;
+		return 0;
+	}
+	(void) *(volatile char *) blk;
+	*pg_store = blk;
+	*perm_store = PTE_P|PTE_U;
+	if (req->req_flags & FSMAP_WRITE)
+		*perm_store |= PTE_W|PTE_SHARE;
+	return 0;
+}
 
 // Write req->req_n bytes from req->req_buf to req_fileid, starting at
 // the current seek position, and update the seek position
@@ -308,6 +473,113 @@ serve_remove(envid_t envid, struct Fsreq_remove *req)
 	return file_remove(path);
 }
 
+// Return the file server's counters in ipc->statsRet.
+int
+serve_stats(envid_t envid, union Fsipc *ipc)
+{
+	ipc->statsRet = fscounters;
+	return 0;
+}
+
+// Create req->req_path as a copy-on-write overlay of req->req_backing.
+int
+serve_overlay(envid_t envid, struct Fsreq_overlay *req)
+{
+	char path[MAXPATHLEN], backing[MAXPATHLEN];
+	struct File *f;
+
+	if (debug)
+		cprintf("serve_overlay %08x %s %s\n", envid, req->req_path, req->req_backing);
+
+	memmove(path, req->req_path, MAXPATHLEN);
+	path[MAXPATHLEN-1] = 0;
+	memmove(backing, req->req_backing, MAXPATHLEN);
+	backing[MAXPATHLEN-1] = 0;
+	return file_overlay(path, backing, &f);
+}
+
+// Find the file that batch sub-request 'op' refers to: a file opened
+// by an earlier sub-request in files[], or an open file ID.
+static struct File *
+batch_file(envid_t envid, struct Fsbatch_op *op, struct File **files, int i)
+{
+	struct OpenFile *o;
+	int j;
+
+	if (op->file < 0) {
+		j = -1 - op->file;
+		return j < i ? files[j] : NULL;
+	}
+	if (openfile_lookup(envid, op->file, &o) < 0)
+		return NULL;
+	return o->o_file;
+}
+
+// Run the sub-requests of a batch in order, storing each one's result
+// in its result field and its output in req_data.  A sub-request whose
+// file failed to open gets -E_INVAL.  Only read-only sub-requests are
+// supported, so a batch never changes the file system.
+int
+serve_batch(envid_t envid, union Fsipc *ipc)
+{
+	struct Fsreq_batch *req = &ipc->batch;
+	struct File *files[FSBATCH_MAXOPS], *f;
+	struct Fsbatch_op *op;
+	struct Fsret_stat *st;
+	char path[MAXPATHLEN];
+	size_t datalen = sizeof(req->req_data);
+	int i;
+
+	if (debug)
+		cprintf("serve_batch %08x %d\n", envid, req->req_nops);
+
+	if (req->req_nops < 0 || req->req_nops > FSBATCH_MAXOPS)
+		return -E_INVAL;
+	memset(files, 0, sizeof(files));
+	for (i = 0; i < req->req_nops; i++) {
+		op = &req->req_ops[i];
+		op->result = -E_INVAL;
+		switch (op->op) {
+		case FSBATCH_OPEN:
+			if (op->off >= datalen || op->len != O_RDONLY)
+				break;
+			strncpy(path, req->req_data + op->off,
+				MIN(MAXPATHLEN, datalen - op->off));
+			path[MAXPATHLEN-1] = 0;
+			op->result = file_open(path, &files[i]);
+			break;
+
+		case FSBATCH_STAT:
+			if (!(f = batch_file(envid, op, files, i))
+			    || op->buf > datalen - sizeof(struct Fsret_stat))
+				break;
+			st = (struct Fsret_stat *) (req->req_data + op->buf);
+			strcpy(st->ret_name, f->f_name);
+			st->ret_size = f->f_size;
+			st->ret_isdir = (f->f_type == FTYPE_DIR);
+			op->result = 0;
+			break;
+
+		case FSBATCH_READ:
+			if (!(f = batch_file(envid, op, files, i))
+			    || op->buf > datalen || op->len > datalen - op->buf)
+				break;
+			op->result = file_read(f, req->req_data + op->buf,
+					       op->len, op->off);
+			break;
+
+		case FSBATCH_CLOSE:
+			if (op->file < 0 && -1 - op->file < i
+			    && files[-1 - op->file]) {
+				files[-1 - op->file] = NULL;
+				op->result = 0;
+			}
+			break;
+		}
+	}
+	return 0;
+}
+
 // Sync the file system.
 int
 serve_sync(envid_t envid, union Fsipc *req)
@@ -328,23 +600,148 @@ fshandler handlers[] = {
 	[FSREQ_SET_SIZE] =	(fshandler)serve_set_size,
 	[FSREQ_WRITE] =		(fshandler)serve_write,
 	[FSREQ_REMOVE] =	(fshandler)serve_remove,
-	[FSREQ_SYNC] =		serve_sync
+	[FSREQ_SYNC] =		serve_sync,
+	[FSREQ_BATCH] =		serve_batch,
+	[FSREQ_OVERLAY] =	(fshandler)serve_overlay,
+	[FSREQ_STATS] =		serve_stats
 };
 #define NHANDLERS (sizeof(handlers)/sizeof(handlers[0]))
 
+// Requests that only read file system state.  In threaded mode each
+// of these runs in a thread of its own, which yields to other requests
+// while it waits for a cache miss (bc_fetch).  All other requests run
+// one at a time in the main thread, once no reader is in progress, so
+// a reader never sees the file system change in the middle of a
+// request.
+static bool
+req_is_reader(uint32_t req, union Fsipc *ipc)
+{
+	return req == FSREQ_READ || req == FSREQ_STAT || req == FSREQ_READ_MAP
+		|| req == FSREQ_BATCH
+		|| (req == FSREQ_MAP
+		    && !(ipc->map.req_flags & (FSMAP_WRITE|FSMAP_DIRTY)));
+}
+
+struct ServeArgs {
+	envid_t whom;
+	uint32_t req;
+	union Fsipc *ipc;
+};
+
+struct Fsret_stats fscounters;
+
+static bool serve_threaded;	// Readers run in threads of their own
+static thread_id_t serve_tid;	// The main thread
+static int serve_irq = -1;	// Interrupt that completes disk_submit
+static envid_t commit_envid;	// The commit timer
+static bool commit_armed;	// The commit timer is counting down
+static int nreaders;		// Reader threads in progress
+
+// May the current request block, letting other requests run?
+bool
+serve_may_block(void)
+{
+	return serve_threaded && thread_id() != serve_tid;
+}
+
+// Find a free page at which to receive a request.  A page stays mapped
+// until its request has been answered.
+static union Fsipc *
+req_alloc(void)
+{
+	int i;
+
+	for (i = 0; i < NREQ; i++)
+		if (!va_is_mapped((void *) (REQVA + (uintptr_t) i * PGSIZE)))
+			return (union Fsipc *) (REQVA + (uintptr_t) i * PGSIZE);
+	return NULL;
+}
+
+// Handle request 'req' from 'whom', whose argument page is 'ipc', and
+// send the reply.
+static void
+serve_request(envid_t whom, uint32_t req, union Fsipc *ipc)
+{
+	int perm = 0, r;
+	void *pg = NULL;
+
+	fscounters.ret_requests++;
+	if (req == FSREQ_OPEN) {
+		r = serve_open(whom, (struct Fsreq_open*)ipc, &pg, &perm);
+	} else if (req == FSREQ_READ_MAP) {
+		r = serve_read_map(whom, (struct Fsreq_read_map*)ipc, &pg, &perm);
+	} else if (req == FSREQ_MAP) {
+		r = serve_map(whom, (struct Fsreq_map*)ipc, &pg, &perm);
+	} else if (req < NHANDLERS && handlers[req]) {
+		r = handlers[req](whom, ipc);
+	} else {
+		cprintf("Invalid request code %d from %08x\n", req, whom);
+		r = -E_INVAL;
+	}
+	ipc_send(whom, r, pg, perm);
+	if(debug)
+		cprintf("FS: Sent response %d to %x\n", r, whom);
+	sys_page_unmap(0, ipc);
+}
+
+static void
+serve_thread(uint64_t arg)
+{
+	struct ServeArgs *args = (struct ServeArgs *) arg;
+
+	serve_request(args->whom, args->req, args->ipc);
+	nreaders--;
+	free(args);
+}
+
 void
 serve(void)
 {
 	uint32_t req, whom;
-	int perm, r;
-	void *pg;
+	int perm;
+	union Fsipc *ipc;
+	struct ServeArgs *args;
 
 	while (1) {
+		// Let readers whose blocks have arrived finish before
+		// ipc_recv blocks the whole environment.  If any are still
+		// waiting, have the disk interrupt wake us up as an IPC.
+		thread_yield();
+		if (nreaders > 0 && sys_irq_notify(serve_irq) > 0) {
+			disk_intr();
+			continue;
+		}
+		while (!(ipc = req_alloc())) {
+			disk_intr();
+			thread_yield();
+		}
+
+		// Once a transaction has started, have the commit timer
+		// wake us up to commit it, even if no requests follow.
+		if (commit_envid && !commit_armed && journal_running()) {
+			ipc_send(commit_envid, JOURNAL_COMMIT_MS, 0, 0);
+			commit_armed = 1;
+		}
+
 		perm = 0;
-		req = ipc_recv((int32_t *) &whom, fsreq, &perm);
+		req = ipc_recv((int32_t *) &whom, ipc, &perm);
 		if (debug)
 			cprintf("fs req %d from %08x [page %08x: %s]\n",
-				req, whom, uvpt[PGNUM(fsreq)], fsreq);
+				req, whom, uvpt[PGNUM(ipc)], ipc);
+
+		if (whom == 0 && req == serve_irq) {
+			disk_intr();
+			continue;
+		}
+		if (whom == commit_envid && commit_envid) {
+			commit_armed = 0;
+			while (nreaders > 0) {
+				disk_intr();
+				thread_yield();
+			}
+			journal_commit();
+			continue;
+		}
 
 		// All requests must contain an argument page
 		if (!(perm & PTE_P)) {
@@ -353,25 +750,98 @@ serve(void)
 			continue; // just leave it hanging...
 		}
 
-		pg = NULL;
-		if (req == FSREQ_OPEN) {
-			r = serve_open(whom, (struct Fsreq_open*)fsreq, &pg, &perm);
-		} else if (req < NHANDLERS && handlers[req]) {
-			r = handlers[req](whom, fsreq);
-		} else {
-			cprintf("Invalid request code %d from %08x\n", req, whom);
-			r = -E_INVAL;
+		if (serve_threaded && req_is_reader(req, ipc)
+		    && (args = malloc(sizeof(struct ServeArgs)))) {
+			args->whom = whom;
+			args->req = req;
+			args->ipc = ipc;
+			nreaders++;
+			if (thread_create(0, "serve_thread", serve_thread,
+					  (uint64_t) args) == 0) {
+				thread_yield(); // let the thread created run
+				continue;
+			}
+			nreaders--;
+			free(args);
+		}
+
+		while (nreaders > 0) {
+			disk_intr();
+			thread_yield();
 		}
-		ipc_send(whom, r, pg, perm);
-		if(debug)
-			cprintf("FS: Sent response %d to %x\n", r, whom);
-		sys_page_unmap(0, fsreq);
+		journal_begin();
+		serve_request(whom, req, ipc);
 	}
 }
 
+// Start the commit timer, an environment that, like the network
+// server's timer, sleeps in sys_ipc_recv until we send it a timeout in
+// milliseconds, then messages us once that has passed.  We arm it only
+// when a transaction is waiting to commit, so it costs nothing while
+// the file system is idle.  fork would make our own pages copy-on-write,
+// which bc_pgfault does not handle, so instead the timer gets our
+// program read-only and a copy of our stack; since thisenv is ours, it
+// reads its messages from envs directly.
+static envid_t
+commit_timer(void)
+{
+	extern unsigned char end[];
+	envid_t envid, fsenv = sys_getenvid();
+	const volatile struct Env *e;
+	uint32_t stop;
+	uintptr_t va;
+	int r;
+
+	if ((envid = sys_exofork()) < 0)
+		return envid;
+	if (envid == 0) {
+		e = &envs[ENVX(sys_getenvid())];
+		while (1) {
+			if (sys_ipc_recv((void *) UTOP) < 0
+			    || e->env_ipc_from != fsenv)
+				continue;
+			stop = sys_time_msec() + e->env_ipc_value;
+			while (sys_time_msec() < stop)
+				sys_yield();
+			while (sys_ipc_try_send(fsenv, 0, 0, 0) == -E_IPC_NOT_RECV)
+				sys_yield();
+		}
+	}
+
+	for (va = UTEXT; va < (uintptr_t) end; va += PGSIZE)
+		if (va_is_mapped((void *) va)
+		    && (r = sys_page_map(0, (void *) va, envid, (void *) va,
+					 PTE_P|PTE_U)) < 0)
+			goto fail;
+	va = USTACKTOP - PGSIZE;
+	if ((r = sys_page_alloc(envid, (void *) va, PTE_P|PTE_U|PTE_W)) < 0
+	    || (r = sys_page_map(envid, (void *) va, 0, UTEMP,
+				 PTE_P|PTE_U|PTE_W)) < 0)
+		goto fail;
+	memmove(UTEMP, (void *) va, PGSIZE);
+	sys_page_unmap(0, UTEMP);
+	if ((r = sys_env_set_status(envid, ENV_RUNNABLE)) < 0)
+		goto fail;
+	return envid;
+
+fail:
+	sys_env_destroy(envid);
+	return r;
+}
+
+static void
+serve_main(uint64_t arg)
+{
+	serve_tid = thread_id();
+	serve_threaded = serve_irq >= 0;
+	serve();
+}
+
 void
 umain(int argc, char **argv)
 {
+	int r;
+
 	static_assert(sizeof(struct File) == 256);
 	binaryname = "fs";
 	cprintf("FS is running\n");
@@ -381,7 +851,19 @@ umain(int argc, char **argv)
 	cprintf("FS can do I/O\n");
 
 	serve_init();
+	if ((r = commit_timer()) < 0)
+		cprintf("FS commit timer: %e\n", r);
+	else
+		commit_envid = r;
 	fs_init();
-	serve();
+
+	// Requests run in cooperative threads, so that cache hits can be
+	// served while misses wait for the disk.  That needs a disk
+	// interrupt to tell us when the misses are done.
+	serve_irq = disk_irq();
+	thread_init();
+	thread_create(0, "main", serve_main, 0);
+	thread_yield();
+	// never coming here!
 }
 
@@ -9,9 +9,9 @@ static char *msg = "This is the NEW message of the day!\n\n";
 void
 fs_test(void)
 {
-	struct File *f;
-	int r;
-	char *blk;
+	struct File *f, *d;
+	int r, i;
+	char *blk, path[MAXPATHLEN];
 	uint32_t *bits;
 
 	// back up bitmap
@@ -50,13 +50,19 @@ fs_test(void)
 
 	if ((r = file_set_size(f, 0)) < 0)
 		panic("file_set_size: %e", r);
-	assert(f->f_direct[0] == 0);
+	if (f->f_flags & FFLAG_EXTENT)
+		assert(f->f_nextents == 0 && f->f_extblock == 0);
+	else
+		assert(f->f_direct[0] == 0);
+	// The new size waits in the running transaction.
+	if (super->s_journal)
+		assert(uvpt[PGNUM(f)] & PTE_D);
+	file_flush(f);
 	assert(!(uvpt[PGNUM(f)] & PTE_D));
 	cprintf("file_truncate is good\n");
 
 	if ((r = file_set_size(f, strlen(msg))) < 0)
 		panic("file_set_size 2: %e", r);
-	assert(!(uvpt[PGNUM(f)] & PTE_D));
 	if ((r = file_get_block(f, 0, &blk)) < 0)
 		panic("file_get_block 2: %e", r);
 	strcpy(blk, msg);
@@ -65,4 +71,170 @@ fs_test(void)
 	assert(!(uvpt[PGNUM(blk)] & PTE_D));
 	assert(!(uvpt[PGNUM(f)] & PTE_D));
 	cprintf("file rewrite is good\n");
+
+	// Extent-based files grow in contiguous runs, so a file that is
+	// extended in one step is still a single extent.
+	if (f->f_flags & FFLAG_EXTENT) {
+		if ((r = file_set_size(f, 16 * BLKSIZE)) < 0)
+			panic("file_set_size 3: %e", r);
+		assert(f->f_nextents == 1 && f->f_extents[0].e_len == 16);
+		if ((r = file_get_block(f, 15, &blk)) < 0)
+			panic("file_get_block 3: %e", r);
+		assert(blk == diskaddr(f->f_extents[0].e_dblock + 15));
+		if ((r = file_set_size(f, strlen(msg))) < 0)
+			panic("file_set_size 4: %e", r);
+		assert(f->f_nextents == 1 && f->f_extents[0].e_len == 1);
+
+		// They can also grow past the block-pointer limit.  Growth
+		// that large is only partly preallocated; the rest reads as
+		// zeros and is allocated when it is written.
+		if ((r = file_set_size(f, MAXFILESIZE + BLKSIZE)) < 0)
+			panic("file_set_size 5: %e", r);
+		assert(f->f_nextents == 1);
+		if ((r = file_read_block(f, MAXFILESIZE / BLKSIZE, &blk)) < 0)
+			panic("file_read_block: %e", r);
+		assert(blk[0] == 0 && blk[BLKSIZE - 1] == 0);
+		if ((r = file_get_block(f, MAXFILESIZE / BLKSIZE, &blk)) < 0)
+			panic("file_get_block 4: %e", r);
+		assert(f->f_nextents == 2);
+		assert(blk[0] == 0 && blk[BLKSIZE - 1] == 0);
+		if ((r = file_set_size(f, strlen(msg))) < 0)
+			panic("file_set_size 6: %e", r);
+		assert(f->f_nextents == 1 && f->f_extents[0].e_len == 1);
+		file_flush(f);
+		cprintf("file extents are good\n");
+
+		// A block that a client has mapped can't be freed.
+		if ((r = file_get_block(f, 0, &blk)) < 0)
+			panic("file_get_block 5: %e", r);
+		if ((r = sys_page_map(0, blk, 0, UTEMP, PTE_P|PTE_U)) < 0)
+			panic("sys_page_map: %e", r);
+		if ((r = file_set_size(f, 0)) != -E_BUSY)
+			panic("file_set_size of a mapped block: %e", r);
+		sys_page_unmap(0, UTEMP);
+		if ((r = file_set_size(f, 0)) < 0
+		    || (r = file_set_size(f, strlen(msg))) < 0)
+			panic("file_set_size 7: %e", r);
+		if ((r = file_get_block(f, 0, &blk)) < 0)
+			panic("file_get_block 6: %e", r);
+		strcpy(blk, msg);
+		file_flush(f);
+		cprintf("mapped blocks are pinned\n");
+	}
+
+	// A directory large enough to get a hash index.
+	if ((r = file_create("/dindex-test", &d)) < 0)
+		panic("file_create /dindex-test: %e", r);
+	d->f_type = FTYPE_DIR;
+	for (i = 0; i < 4 * BLKFILES; i++) {
+		snprintf(path, sizeof(path), "/dindex-test/f%d", i);
+		if ((r = file_create(path, &f)) < 0)
+			panic("file_create %s: %e", path, r);
+	}
+	assert(d->f_flags & FFLAG_DINDEX);
+	for (i = 0; i < 4 * BLKFILES; i += 7) {
+		snprintf(path, sizeof(path), "/dindex-test/f%d", i);
+		if ((r = file_open(path, &f)) < 0)
+			panic("file_open %s: %e", path, r);
+		if ((r = file_remove(path)) < 0)
+			panic("file_remove %s: %e", path, r);
+		if ((r = file_open(path, &f)) != -E_NOT_FOUND)
+			panic("file_open %s after remove: %e", path, r);
+	}
+	if ((r = file_remove("/dindex-test")) < 0)
+		panic("file_remove /dindex-test: %e", r);
+	cprintf("directory index is good\n");
+
+	// Cached paths, positive and negative, follow creates and removes.
+	if ((r = file_open("/dcache-test", &f)) != -E_NOT_FOUND
+	    || (r = file_open("/dcache-test", &f)) != -E_NOT_FOUND)
+		panic("file_open /dcache-test before create: %e", r);
+	if ((r = file_create("/dcache-test", &d)) < 0)
+		panic("file_create /dcache-test: %e", r);
+	if ((r = file_open("/dcache-test", &f)) < 0 || f != d)
+		panic("file_open /dcache-test after create: %e", r);
+	if ((r = file_open("//dcache-test", &f)) < 0 || f != d)
+		panic("file_open //dcache-test: %e", r);
+	if ((r = file_remove("/dcache-test")) < 0)
+		panic("file_remove /dcache-test: %e", r);
+	if ((r = file_open("/dcache-test", &f)) != -E_NOT_FOUND)
+		panic("file_open /dcache-test after remove: %e", r);
+	cprintf("dentry cache is good\n");
+
+	// An overlay reads through to its backing file until written.
+	if ((r = file_overlay("/overlay-test", "/newmotd", &f)) < 0)
+		panic("file_overlay: %e", r);
+	if ((r = file_open("/newmotd", &d)) < 0)
+		panic("file_open /newmotd: %e", r);
+	if ((r = file_read(f, bits, BLKSIZE, 0)) != d->f_size
+	    || memcmp(bits, msg, strlen(msg)) != 0)
+		panic("file_read overlay: %e", r);
+	if ((r = file_write(f, "Overlay", 7, 0)) != 7)
+		panic("file_write overlay: %e", r);
+	if ((r = file_read(d, bits, BLKSIZE, 0)) < 0
+	    || memcmp(bits, msg, strlen(msg)) != 0)
+		panic("overlay write reached the backing file");
+	if ((r = file_read(f, bits, BLKSIZE, 0)) < 0
+	    || memcmp(bits, "Overlay", 7) != 0
+	    || memcmp((char *) bits + 7, msg + 7, strlen(msg) - 7) != 0)
+		panic("file_read overlay after write");
+	if ((r = file_remove("/newmotd")) != -E_NOT_SUPP)
+		panic("file_remove of a backing file: %e", r);
+	if ((r = file_remove("/overlay-test")) < 0)
+		panic("file_remove /overlay-test: %e", r);
+	assert(d->f_noverlays == 0);
+	cprintf("file overlay is good\n");
+
+	// Committed metadata is clean in the cache and reaches its home
+	// location at checkpoint.
+	if (super->s_journal) {
+		if ((r = file_create("/journal-test", &f)) < 0)
+			panic("file_create /journal-test: %e", r);
+		if ((r = file_write(f, msg, strlen(msg), 0)) < 0)
+			panic("file_write /journal-test: %e", r);
+		file_flush(f);
+		assert(!va_is_dirty(f));
+		journal_checkpoint();
+		if ((r = disk_read(((uintptr_t) f - DISKMAP) / SECTSIZE, bits,
+				   1)) < 0)
+			panic("disk_read: %e", r);
+		assert(memcmp(bits + PGOFF(f) % SECTSIZE / 4, f,
+			      sizeof(struct File)) == 0);
+		if ((r = file_remove("/journal-test")) < 0)
+			panic("file_remove /journal-test: %e", r);
+
+		// Wrap the journal several times over, then leave a few
+		// transactions in it and replay them into a cache that
+		// has lost their blocks, as after a crash.
+		for (i = 0; i < 2 * super->s_njournal; i++) {
+			if ((r = file_create("/journal-wrap", &f)) < 0)
+				panic("file_create /journal-wrap: %e", r);
+			journal_commit();
+			if ((r = file_remove("/journal-wrap")) < 0)
+				panic("file_remove /journal-wrap: %e", r);
+			journal_commit();
+		}
+		journal_checkpoint();
+		for (i = 0; i < 3; i++) {
+			snprintf(path, sizeof(path), "/journal-replay%d", i);
+			if ((r = file_create(path, &f)) < 0)
+				panic("file_create %s: %e", path, r);
+			journal_commit();
+		}
+		if ((r = disk_read(((uintptr_t) f - DISKMAP) / SECTSIZE, bits,
+				   1)) < 0)
+			panic("disk_read: %e", r);
+		assert(strcmp(((struct File *) (bits + PGOFF(f) % SECTSIZE / 4))
+			      ->f_name, "journal-replay2") != 0);
+		if ((r = sys_page_unmap(0, ROUNDDOWN(f, PGSIZE))) < 0)
+			panic("sys_page_unmap: %e", r);
+		journal_init();
+		assert(strcmp(f->f_name, "journal-replay2") == 0);
+		for (i = 0; i < 3; i++) {
+			snprintf(path, sizeof(path), "/journal-replay%d", i);
+			if ((r = file_remove(path)) < 0)
+				panic("file_remove %s: %e", path, r);
+		}
+		cprintf("journal is good\n");
+	}
 }
@@ -0,0 +1,358 @@
+/*
+ * Minimal virtio-blk driver using the legacy (virtio 0.9.5) PCI
+ * interface and a single split virtqueue.
+ *
+ * The file system server runs with I/O privilege, so we talk to the
+ * device's I/O BAR and to PCI configuration space directly.  The rings
+ * live in physically contiguous pages from sys_dma_page_alloc, and
+ * block cache pages are handed to the device by physical address
+ * (sys_page_paddr), so data is never copied.
+ *
+ * Requests are queued with virtio_submit and pushed to the device
+ * with a single notification by virtio_kick.  Completions are reaped
+ * after the device's interrupt (sys_irq_wait); if the device has no
+ * usable IRQ we fall back to polling.
+ */
+
+#include "fs.h"
+#include <inc/x86.h>
+
+#define PCI_CONF_ADDR		0xCF8
+#define PCI_CONF_DATA		0xCFC
+
+#define VIRTIO_VENDOR		0x1AF4
+#define VIRTIO_BLK_DEVICE	0x1001
+
+// Legacy virtio PCI I/O register offsets
+#define VIRTIO_HOST_FEATURES	0x00
+#define VIRTIO_GUEST_FEATURES	0x04
+#define VIRTIO_QUEUE_PFN	0x08
+#define VIRTIO_QUEUE_NUM	0x0C
+#define VIRTIO_QUEUE_SEL	0x0E
+#define VIRTIO_QUEUE_NOTIFY	0x10
+#define VIRTIO_STATUS		0x12
+#define VIRTIO_ISR		0x13
+#define VIRTIO_BLK_CAPACITY	0x14
+
+#define VIRTIO_STATUS_ACK	1
+#define VIRTIO_STATUS_DRIVER	2
+#define VIRTIO_STATUS_DRIVER_OK	4
+#define VIRTIO_STATUS_FAILED	128
+
+#define VRING_DESC_F_NEXT	1
+#define VRING_DESC_F_WRITE	2
+
+#define VIRTIO_BLK_T_IN		0
+#define VIRTIO_BLK_T_OUT	1
+
+#define VIRTIO_MAXQ		256	// Largest queue we are willing to drive
+
+struct vring_desc {
+	uint64_t addr;
+	uint32_t len;
+	uint16_t flags;
+	uint16_t next;
+};
+
+struct vring_avail {
+	uint16_t flags;
+	uint16_t idx;
+	uint16_t ring[];
+};
+
+struct vring_used_elem {
+	uint32_t id;
+	uint32_t len;
+};
+
+struct vring_used {
+	uint16_t flags;
+	uint16_t idx;
+	struct vring_used_elem ring[];
+};
+
+struct virtio_blk_hdr {
+	uint32_t type;
+	uint32_t ioprio;
+	uint64_t sector;
+};
+
+static struct {
+	uint16_t iobase;
+	int irq;			// -1 if we have to poll
+	uint16_t qsize;
+	volatile struct vring_desc *desc;
+	volatile struct vring_avail *avail;
+	volatile struct vring_used *used;
+	uint16_t free_head;		// Free descriptors, linked by next
+	uint16_t nfree;
+	uint16_t last_used;
+	// Request header and status byte for the chain starting at
+	// descriptor i live in hdr[i] and status[i].
+	struct virtio_blk_hdr *hdr;
+	volatile uint8_t *status;
+	uint64_t hdr_pa, status_pa;
+	struct DiskReq *req[VIRTIO_MAXQ];
+} vq;
+
+static uint32_t
+pci_conf_read(int dev, int off)
+{
+	outl(PCI_CONF_ADDR, (1 << 31) | (dev << 11) | (off & 0xFC));
+	return inl(PCI_CONF_DATA);
+}
+
+static void
+pci_conf_write(int dev, int off, uint32_t v)
+{
+	outl(PCI_CONF_ADDR, (1 << 31) | (dev << 11) | (off & 0xFC));
+	outl(PCI_CONF_DATA, v);
+}
+
+// Find a legacy virtio-blk device on PCI bus 0.
+// Returns its device number, or -1.
+static int
+virtio_find(void)
+{
+	int dev;
+	uint32_t id;
+
+	for (dev = 0; dev < 32; dev++) {
+		id = pci_conf_read(dev, 0);
+		if ((id & 0xFFFF) == VIRTIO_VENDOR
+		    && (id >> 16) == VIRTIO_BLK_DEVICE)
+			return dev;
+	}
+	return -1;
+}
+
+// Probe for a virtio-blk device and set up its virtqueue.
+// Returns 0 on success, < 0 if there is no usable device.
+int
+virtio_init(void)
+{
+	int dev, i, r;
+	uint32_t bar, ndesc_bytes, used_off, npages;
+	uint8_t *va = (uint8_t *) DMAVA;
+	int64_t pa, ring_pa;
+
+	if ((dev = virtio_find()) < 0)
+		return -E_NOT_FOUND;
+	bar = pci_conf_read(dev, 0x10);
+	if (!(bar & 1))
+		return -E_NOT_SUPP;
+	vq.iobase = bar & ~3;
+	vq.irq = pci_conf_read(dev, 0x3C) & 0xFF;
+	if (vq.irq == 0 || vq.irq >= 16)
+		vq.irq = -1;
+	// Enable I/O space and bus mastering.
+	pci_conf_write(dev, 0x04, pci_conf_read(dev, 0x04) | 0x5);
+
+	outb(vq.iobase + VIRTIO_STATUS, 0);
+	outb(vq.iobase + VIRTIO_STATUS, VIRTIO_STATUS_ACK);
+	outb(vq.iobase + VIRTIO_STATUS,
+	     VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER);
+	// We need none of the optional features.
+	(void) inl(vq.iobase + VIRTIO_HOST_FEATURES);
+	outl(vq.iobase + VIRTIO_GUEST_FEATURES, 0);
+
+	outw(vq.iobase + VIRTIO_QUEUE_SEL, 0);
+	vq.qsize = inw(vq.iobase + VIRTIO_QUEUE_NUM);
+	if (vq.qsize == 0 || vq.qsize > VIRTIO_MAXQ)
+		goto fail;
+
+	// Legacy layout: descriptors and avail ring, then the used ring
+	// on the next page boundary.
+	ndesc_bytes = 16 * vq.qsize + 6 + 2 * vq.qsize;
+	used_off = ROUNDUP(ndesc_bytes, PGSIZE);
+	npages = (used_off + ROUNDUP(6 + 8 * vq.qsize, PGSIZE)) / PGSIZE;
+	if ((ring_pa = sys_dma_page_alloc(va, npages, PTE_P|PTE_U|PTE_W)) < 0)
+		goto fail;
+	vq.desc = (struct vring_desc *) va;
+	vq.avail = (struct vring_avail *) (va + 16 * vq.qsize);
+	vq.used = (struct vring_used *) (va + used_off);
+	va += npages * PGSIZE;
+
+	if ((pa = sys_dma_page_alloc(va, 2, PTE_P|PTE_U|PTE_W)) < 0)
+		goto fail_ring;
+	vq.hdr = (struct virtio_blk_hdr *) va;
+	vq.hdr_pa = pa;
+	vq.status = va + PGSIZE;
+	vq.status_pa = pa + PGSIZE;
+
+	for (i = 0; i < vq.qsize; i++)
+		vq.desc[i].next = i + 1;
+	vq.free_head = 0;
+	vq.nfree = vq.qsize;
+	vq.last_used = 0;
+
+	outl(vq.iobase + VIRTIO_QUEUE_PFN, ring_pa >> PGSHIFT);
+	outb(vq.iobase + VIRTIO_STATUS, VIRTIO_STATUS_ACK
+	     | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+
+	cprintf("virtio-blk: %d sectors, queue %d, irq %d\n",
+		inl(vq.iobase + VIRTIO_BLK_CAPACITY), vq.qsize, vq.irq);
+	return 0;
+
+fail_ring:
+	// The ring is still the pool's most recent allocation.
+	if ((r = sys_dma_page_free((void *) DMAVA, npages)) < 0)
+		panic("virtio_init: sys_dma_page_free: %e", r);
+fail:
+	outb(vq.iobase + VIRTIO_STATUS, VIRTIO_STATUS_FAILED);
+	return -E_NOT_SUPP;
+}
+
+static int
+desc_alloc(void)
+{
+	int i = vq.free_head;
+
+	vq.free_head = vq.desc[i].next;
+	vq.nfree--;
+	return i;
+}
+
+// Queue 'r' on the device without notifying it.
+// Returns 0 on success, or -E_NO_MEM if the ring is full, in which case
+// the caller should kick, reap some completions and try again.
+int
+virtio_submit(struct DiskReq *r)
+{
+	uintptr_t va = (uintptr_t) r->buf, end = va + r->nsecs * SECTSIZE;
+	int ndesc, head, prev, d;
+	int64_t pa;
+	uint32_t n;
+
+	ndesc = 2 + (ROUNDUP(end, PGSIZE) - ROUNDDOWN(va, PGSIZE)) / PGSIZE;
+	if (ndesc > vq.nfree)
+		return -E_NO_MEM;
+
+	head = desc_alloc();
+	vq.hdr[head].type = r->write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+	vq.hdr[head].ioprio = 0;
+	vq.hdr[head].sector = r->secno;
+	vq.desc[head].addr = vq.hdr_pa + head * sizeof(struct virtio_blk_hdr);
+	vq.desc[head].len = sizeof(struct virtio_blk_hdr);
+	vq.desc[head].flags = VRING_DESC_F_NEXT;
+	prev = head;
+
+	// One descriptor per page, since the buffer need not be
+	// physically contiguous.
+	for (; va < end; va += n) {
+		n = MIN(end - va, PGSIZE - PGOFF(va));
+		if ((pa = sys_page_paddr((void *) va)) < 0)
+			panic("virtio_submit: buffer %08x not mapped", va);
+		d = desc_alloc();
+		vq.desc[d].addr = pa;
+		vq.desc[d].len = n;
+		vq.desc[d].flags = VRING_DESC_F_NEXT
+			| (r->write ? 0 : VRING_DESC_F_WRITE);
+		vq.desc[prev].next = d;
+		prev = d;
+	}
+
+	d = desc_alloc();
+	vq.status[head] = 0xFF;
+	vq.desc[d].addr = vq.status_pa + head;
+	vq.desc[d].len = 1;
+	vq.desc[d].flags = VRING_DESC_F_WRITE;
+	vq.desc[prev].next = d;
+
+	vq.req[head] = r;
+	r->result = 1;
+	vq.avail->ring[vq.avail->idx % vq.qsize] = head;
+	__sync_synchronize();
+	vq.avail->idx++;
+	return 0;
+}
+
+// Tell the device about everything queued by virtio_submit.
+void
+virtio_kick(void)
+{
+	__sync_synchronize();
+	outw(vq.iobase + VIRTIO_QUEUE_NOTIFY, 0);
+}
+
+// Complete the requests the device has finished with.
+// Returns the number of requests completed.
+int
+virtio_reap(void)
+{
+	int n = 0, d;
+	uint32_t head;
+
+	while (vq.last_used != vq.used->idx) {
+		__sync_synchronize();
+		head = vq.used->ring[vq.last_used % vq.qsize].id;
+		vq.req[head]->result = vq.status[head] ? -E_UNSPECIFIED : 0;
+		vq.req[head] = 0;
+
+		// Return the chain to the free list.
+		for (d = head; vq.desc[d].flags & VRING_DESC_F_NEXT;
+		     d = vq.desc[d].next)
+			vq.nfree++;
+		vq.nfree++;
+		vq.desc[d].next = vq.free_head;
+		vq.free_head = head;
+
+		vq.last_used++;
+		n++;
+	}
+	return n;
+}
+
+// Block until at least one outstanding request completes.
+void
+virtio_wait(void)
+{
+	while (virtio_reap() == 0) {
+		if (vq.irq >= 0 && sys_irq_wait(vq.irq) == 0)
+			// Reading the ISR acknowledges the interrupt.
+			(void) inb(vq.iobase + VIRTIO_ISR);
+		else
+			sys_yield();
+	}
+}
+
+// The device's IRQ, or -1 if completions have to be polled for.
+int
+virtio_irq(void)
+{
+	return vq.irq;
+}
+
+// Handle an interrupt delivered some other way than virtio_wait:
+// acknowledge it and complete the finished requests.
+void
+virtio_intr(void)
+{
+	(void) inb(vq.iobase + VIRTIO_ISR);
+	virtio_reap();
+}
+
+static int
+virtio_rw(uint32_t secno, void *buf, size_t nsecs, bool write)
+{
+	struct DiskReq r = { secno, buf, nsecs, write, 0 };
+
+	while (virtio_submit(&r) < 0)
+		virtio_wait();
+	virtio_kick();
+	while (r.result > 0)
+		virtio_wait();
+	return r.result;
+}
+
+int
+virtio_read(uint32_t secno, void *dst, size_t nsecs)
+{
+	return virtio_rw(secno, dst, nsecs, 0);
+}
+
+int
+virtio_write(uint32_t secno, const void *src, size_t nsecs)
+{
+	return virtio_rw(secno, (void *) src, nsecs, 1);
+}
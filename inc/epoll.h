@@ -0,0 +1,33 @@
+#ifndef JOS_INC_EPOLL_H
+#define JOS_INC_EPOLL_H
+
+#include <inc/types.h>
+
+// An epoll-style interface to poll, for sockets only; see lib/epoll.c.
+
+// Events, which are those of poll
+#define EPOLLIN		0x01
+#define EPOLLOUT	0x02
+#define EPOLLERR	0x04
+#define EPOLLHUP	0x08
+// Edge-triggered: report a socket only after a new event
+#define EPOLLET		(1U << 31)
+
+// epoll_ctl operations
+#define EPOLL_CTL_ADD	1
+#define EPOLL_CTL_DEL	2
+#define EPOLL_CTL_MOD	3
+
+typedef union epoll_data {
+	void *ptr;
+	int fd;
+	uint32_t u32;
+	uint64_t u64;
+} epoll_data_t;
+
+struct epoll_event {
+	uint32_t events;
+	epoll_data_t data;
+};
+
+#endif	// not JOS_INC_EPOLL_H
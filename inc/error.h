@@ -33,6 +33,8 @@ enum {
 	E_VMX_ON = 19,    // Couldn't transition the cpu to VMX root mode
 	E_VMCS_INIT = 20, // Couldn't init the VMCS region
 	E_NO_ENT = 21,
+	E_AGAIN		= 22,	// Operation would block; try again
+	E_BUSY		= 23,	// Resource is in use
 	MAXERROR
 };
 
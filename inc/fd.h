@@ -61,5 +61,6 @@ extern struct Dev devfile;
 extern struct Dev devsock;
 extern struct Dev devcons;
 extern struct Dev devpipe;
+extern struct Dev devepoll;
 
 #endif	// not JOS_INC_FD_H
@@ -26,19 +26,67 @@
 
 #define MAXFILESIZE	((NDIRECT + NINDIRECT) * BLKSIZE)
 
+// A run of e_len contiguous disk blocks, starting at e_dblock, that
+// holds file blocks e_fblock through e_fblock + e_len - 1.
+struct Extent {
+	uint32_t e_fblock;
+	uint32_t e_dblock;
+	uint32_t e_len;
+} __attribute__((packed));
+
+// Number of extents in a File descriptor
+#define NEXTENT		6
+// Number of extents in an extent block
+#define NBLKEXTENT	((BLKSIZE - 8) / sizeof(struct Extent))
+
+// Extent-based files are limited only by off_t.
+#define MAXEXTFILESIZE	0x7FFFF000
+
+// Extents that don't fit in the File descriptor continue in a chain of
+// extent blocks, still sorted by e_fblock.
+struct ExtentBlock {
+	uint32_t eb_next;		// next extent block, or 0
+	uint32_t eb_pad;
+	struct Extent eb_ext[NBLKEXTENT];
+} __attribute__((packed));
+
 struct File {
 	char f_name[MAXNAMELEN];	// filename
 	off_t f_size;			// file size in bytes
 	uint32_t f_type;		// file type
 
-	// Block pointers.
-	// A block is allocated iff its value is != 0.
-	uint32_t f_direct[NDIRECT];	// direct blocks
-	uint32_t f_indirect;		// indirect block
+	union {
+		// Block pointers.
+		// A block is allocated iff its value is != 0.
+		struct {
+			uint32_t f_direct[NDIRECT];	// direct blocks
+			uint32_t f_indirect;		// indirect block
+		};
+		// Extents (if FFLAG_EXTENT), sorted by e_fblock.
+		struct {
+			uint32_t f_nextents;		// extents in use
+			uint32_t f_extblock;		// first extent block
+			struct Extent f_extents[NEXTENT];
+		};
+	};
+	uint32_t f_flags;		// FFLAG_*
+
+	// Directory hash index (if FFLAG_DINDEX).
+	uint32_t f_dindex;		// index root block
+	uint32_t f_dislots;		// index slots, a power of two
+	uint32_t f_diused;		// slots in use, including deleted ones
+
+	// Copy-on-write overlays (if FFLAG_OVERLAY).  Blocks below
+	// f_backsize that the overlay has not written come from the
+	// backing file, named by its position among all the File
+	// structures on disk.
+	uint32_t f_backing;		// backing file
+	uint32_t f_backsize;		// blocks visible from the backing file
+	uint32_t f_noverlays;		// overlays backed by this file
 
 	// Pad out to 256 bytes; must do arithmetic in case we're compiling
 	// fsformat on a 64-bit machine.
-	uint8_t f_pad[256 - MAXNAMELEN - 8 - 4*NDIRECT - 4];
+	uint8_t f_pad[256 - MAXNAMELEN - 8 - 8 - 12*NEXTENT - 4 - 12 - 12];
 } __attribute__((packed));	// required only on some 64-bit machines
 
 // An inode block contains exactly BLKFILES 'struct File's
@@ -48,6 +96,39 @@ struct File {
 #define FTYPE_REG	0	// Regular file
 #define FTYPE_DIR	1	// Directory
 
+// File flags
+#define FFLAG_EXTENT	0x1	// Blocks are described by extents
+#define FFLAG_DINDEX	0x2	// Directory has a hash index
+#define FFLAG_OVERLAY	0x4	// Unwritten blocks come from f_backing
+
+// A directory's hash index is an open-addressing table of DirSlots.
+// The root block f_dindex lists the blocks holding the table; the
+// directory entries themselves keep the usual linear format, so
+// readers that ignore the index still work.  ds_ent is the entry's
+// position in the directory plus one, 0 for a never-used slot, or
+// DINDEX_DELETED.
+struct DirSlot {
+	uint32_t ds_hash;		// dindex_hash of the entry's name
+	uint32_t ds_ent;
+};
+
+#define DINDEX_DELETED	0xFFFFFFFF
+// Directories with at least this many blocks get an index.
+#define DINDEX_MIN_BLOCKS	4
+#define BLKDIRSLOTS	(BLKSIZE / sizeof(struct DirSlot))
+#define DINDEX_MAXSLOTS	(BLKSIZE / 4 * BLKDIRSLOTS)
+
+// FNV-1a hash of a file name, as stored in ds_hash.
+static inline uint32_t
+dindex_hash(const char *name)
+{
+	uint32_t h = 2166136261U;
+
+	while (*name)
+		h = (h ^ (uint8_t) *name++) * 16777619U;
+	return h;
+}
+
 
 // File system super-block (both in-memory and on-disk)
 
@@ -57,6 +138,43 @@ struct Super {
 	uint32_t s_magic;		// Magic number: FS_MAGIC
 	uint32_t s_nblocks;		// Total number of blocks on disk
 	struct File s_root;		// Root directory node
+	uint32_t s_journal;		// First journal block, or 0 if none
+	uint32_t s_njournal;		// Number of journal blocks
+};
+
+// Metadata journal.
+//
+// The journal occupies s_njournal blocks starting at s_journal.  Its
+// first block holds a JournalHeader; transactions are appended after
+// it.  Each transaction is a JournalDesc block listing the home
+// locations of the blocks that follow it, one copy per listed block,
+// and a JournalCommit block.  A transaction counts only if its commit
+// block is present, and replay applies transactions in sequence order
+// starting from jh_seq.
+
+#define JOURNAL_MAGIC	0x4A4E4C30	// 'JNL0'
+#define JDESC_MAGIC	0x4A444553	// 'JDES'
+#define JCOMMIT_MAGIC	0x4A434D54	// 'JCMT'
+
+// Maximum blocks in one transaction
+#define JOURNAL_MAXTX	((BLKSIZE - 12) / 4)
+
+struct JournalHeader {
+	uint32_t jh_magic;		// JOURNAL_MAGIC
+	uint32_t jh_seq;		// First transaction to replay
+};
+
+struct JournalDesc {
+	uint32_t jd_magic;		// JDESC_MAGIC
+	uint32_t jd_seq;
+	uint32_t jd_nblocks;
+	uint32_t jd_blocks[JOURNAL_MAXTX];
+};
+
+struct JournalCommit {
+	uint32_t jc_magic;		// JCOMMIT_MAGIC
+	uint32_t jc_seq;
+	uint32_t jc_sum;		// Sum of the words of the copies
 };
 
 // Definitions for requests from clients to file system
@@ -70,7 +188,42 @@ enum {
 	FSREQ_STAT,
 	FSREQ_FLUSH,
 	FSREQ_REMOVE,
-	FSREQ_SYNC
+	FSREQ_SYNC,
+	// Read_map returns the block cache page itself, mapped read-only
+	FSREQ_READ_MAP,
+	// Map returns the block cache page, writable if FSMAP_WRITE
+	FSREQ_MAP,
+	// Batch runs several sub-requests, returning their results in place
+	FSREQ_BATCH,
+	FSREQ_OVERLAY,
+	// Stats returns a Fsret_stats on the request page
+	FSREQ_STATS
+};
+
+// Fsreq_map flags
+#define FSMAP_WRITE	0x1	// Map the block writable and shared
+#define FSMAP_DIRTY	0x2	// Client wrote the block; no page returned
+
+// Sub-requests of FSREQ_BATCH
+enum {
+	FSBATCH_OPEN = 1,	// Open the path at data[off] read-only
+	FSBATCH_STAT,		// Store a struct Fsret_stat at data[buf]
+	FSBATCH_READ,		// Read len bytes from offset off into data[buf]
+	FSBATCH_CLOSE		// Forget a file opened earlier in the batch
+};
+
+#define FSBATCH_MAXOPS	16
+// A sub-request's file argument naming the file that sub-request i of
+// the same batch opened, rather than a file ID.
+#define FSBATCH_SLOT(i)	(-1 - (i))
+
+struct Fsbatch_op {
+	int op;
+	int file;		// File ID or FSBATCH_SLOT
+	uint32_t off;
+	uint32_t len;
+	uint32_t buf;
+	int result;		// Set by the file server
 };
 
 union Fsipc {
@@ -89,6 +242,15 @@ union Fsipc {
 	struct Fsret_read {
 		char ret_buf[PGSIZE];
 	} readRet;
+	struct Fsreq_read_map {
+		int req_fileid;
+		off_t req_offset;
+	} read_map;
+	struct Fsreq_map {
+		int req_fileid;
+		off_t req_offset;
+		int req_flags;
+	} map;
 	struct Fsreq_write {
 		int req_fileid;
 		size_t req_n;
@@ -105,9 +267,28 @@ union Fsipc {
 	struct Fsreq_flush {
 		int req_fileid;
 	} flush;
+	struct Fsret_stats {
+		uint64_t ret_requests;		// requests served
+		uint64_t ret_bc_hits;		// file blocks found in the cache
+		uint64_t ret_bc_misses;		// file blocks read from disk
+		uint64_t ret_disk_reads;	// disk read operations
+		uint64_t ret_disk_writes;	// disk write operations
+		uint64_t ret_disk_rsecs;	// sectors read
+		uint64_t ret_disk_wsecs;	// sectors written
+	} statsRet;
+	struct Fsreq_batch {
+		int req_nops;
+		struct Fsbatch_op req_ops[FSBATCH_MAXOPS];
+		char req_data[PGSIZE - sizeof(int)
+			      - FSBATCH_MAXOPS * sizeof(struct Fsbatch_op)];
+	} batch;
 	struct Fsreq_remove {
 		char req_path[MAXPATHLEN];
 	} remove;
+	struct Fsreq_overlay {
+		char req_path[MAXPATHLEN];
+		char req_backing[MAXPATHLEN];
+	} overlay;
 
 	// Ensure Fsipc is one page
 	char _pad[PGSIZE];
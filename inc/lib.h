@@ -22,6 +22,7 @@
 #include <inc/args.h>
 #include <inc/malloc.h>
 #include <inc/ns.h>
+#include <inc/epoll.h>
 #include <inc/vmx.h>
 
 #define USED(x)		(void)(x)
@@ -63,6 +64,17 @@ int	sys_ipc_recv(void *rcv_pg);
 unsigned int sys_time_msec(void);
 int sys_ept_map(envid_t srcenvid, void *srcva, envid_t guest, void* guest_pa, int perm);
 envid_t sys_env_mkguest(uint64_t gphysz, uint64_t gRIP);
+int64_t	sys_dma_page_alloc(void *va, size_t npages, int perm);
+int	sys_dma_page_free(void *va, size_t npages);
+int64_t	sys_page_paddr(void *va);
+int	sys_irq_wait(int irq);
+int	sys_irq_notify(int irq);
+int	sys_net_transmit(const void *buf, size_t len);
+int	sys_net_transmit_sg(const struct net_frag *frags, int nfrags,
+			    const struct net_offload *off);
+int	sys_net_receive(void *buf, size_t len);
+int	sys_net_receive_page(void *va);
+int	sys_net_wait(int what);
 #ifndef VMM_GUEST
 void	sys_vmx_list_vms();
 int	sys_vmx_sel_resume(int i);
@@ -108,15 +120,36 @@ ssize_t	readn(int fd, void *buf, size_t nbytes);
 int	dup(int oldfd, int newfd);
 int	fstat(int fd, struct Stat *statbuf);
 int	stat(const char *path, struct Stat *statbuf);
+int	fcntl(int fd, int cmd, int arg);
 
 // file.c
 int	open(const char *path, int mode);
+ssize_t	read_map(int fd, off_t offset, void *dstva);
+ssize_t	read_mapped(int fd, void *dstva, void **pbuf);
+int	devfile_map(struct Fd *fd, off_t offset, int flags, void *dstva);
+int	devfile_sync(struct Fd *fd);
+void	fsbatch_begin(void);
+int	fsbatch_open(const char *path);
+int	fsbatch_stat(int fd, struct Stat *st);
+int	fsbatch_read(int fd, off_t offset, void *buf, size_t n);
+int	fsbatch_close(int fd);
+int	fsbatch_submit(void);
+int	fsbatch_result(int i);
+ssize_t	readfile(const char *path, void *buf, size_t n);
 int	ftruncate(int fd, off_t size);
 int	remove(const char *path);
+int	overlay(const char *path, const char *backing);
+int	fsstats(struct Fsret_stats *st);
 int	sync(void);
 int	copy(char *src, char *dest);
 
 
+// mmap.c
+void*	mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset);
+int	msync(void *addr, size_t len);
+int	munmap(void *addr, size_t len);
+void	mmap_flush(struct Fd *fd);
+
 // pageref.c
 int	pageref(void *addr);
 
@@ -127,9 +160,18 @@ int     shutdown(int s, int how);
 int     connect(int s, const struct sockaddr *name, socklen_t namelen);
 int     listen(int s, int backlog);
 int     socket(int domain, int type, int protocol);
+ssize_t recv(int s, void *buf, size_t len, unsigned int flags);
+ssize_t send(int s, const void *buf, size_t len, unsigned int flags);
+int     poll(struct pollfd *fds, nfds_t nfds, int timeout);
+
+// epoll.c
+int	epoll_create(int size);
+int	epoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
+int	epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout);
 
 // nsipc.c
-int     nsipc_accept(int s, struct sockaddr *addr, socklen_t *addrlen);
+int     nsipc_accept(int s, struct sockaddr *addr, socklen_t *addrlen,
+		     unsigned int flags);
 int     nsipc_bind(int s, struct sockaddr *name, socklen_t namelen);
 int     nsipc_shutdown(int s, int how);
 int     nsipc_close(int s);
@@ -138,6 +180,7 @@ int     nsipc_listen(int s, int backlog);
 int     nsipc_recv(int s, void *mem, int len, unsigned int flags);
 int     nsipc_send(int s, const void *buf, int size, unsigned int flags);
 int     nsipc_socket(int domain, int type, int protocol);
+int     nsipc_poll(struct lwip_pollfd *fds, int nfds, int timeout);
 
 // spawn.c
 envid_t	spawn(const char *program, const char **argv);
@@ -166,5 +209,17 @@ void	wait(envid_t env);
 #define	O_TRUNC		0x0200		/* truncate to zero length */
 #define	O_EXCL		0x0400		/* error if already exists */
 #define O_MKDIR		0x0800		/* create directory, not regular file */
+#define	O_NONBLOCK	0x1000		/* sockets: fail with -E_AGAIN, not wait */
+
+/* fcntl commands */
+#define	F_GETFL		3		/* get file status flags */
+#define	F_SETFL		4		/* set file status flags */
+
+/* mmap protections and flags */
+#define	PROT_READ	0x1		/* pages can be read */
+#define	PROT_WRITE	0x2		/* pages can be written */
+#define	MAP_SHARED	0x1		/* writes go to the file */
+#define	MAP_PRIVATE	0x2		/* writes are private copies */
+#define	MAP_FAILED	((void *) -1)
 
 #endif	// !JOS_INC_LIB_H
@@ -5,14 +5,85 @@
 
 #include <inc/types.h>
 #include <inc/mmu.h>
+#include <inc/env.h>
 #include <lwip/sockets.h>
 
 struct jif_pkt {
 	int jp_len;
+	int jp_flags;		// NET_RXCSUM_* on received packets
 	char jp_data[0];
 };
 
-// Definitions for requests from clients to network server
+// A single-producer, single-consumer ring of packets, shared between
+// the network server and its input or output environment so that
+// packets need not be passed one IPC at a time.  The producer fills
+// entry nr_prod % NETRING_SIZE and then advances nr_prod; the consumer
+// does the same with nr_cons.  The consumer clears nr_kick before it
+// sleeps in ipc_recv; a producer that finds nr_kick clear after
+// queueing sets it and sends a page-less NSREQ_INPUT or NSREQ_OUTPUT
+// to wake the consumer.  Wakeups for a full ring go the other way: the
+// producer sets nr_wait before it sleeps, and a consumer that frees an
+// entry and then takes nr_wait (clearing it with an atomic swap from
+// 1) sends the same message back to the producer.  A producer that
+// finds room after setting nr_wait takes it back the same way, or, if
+// the consumer took it first, waits for the wakeup it is owed.  Where
+// each entry's packet lives is up to the two sides.
+#define NETRING_SIZE	64		// Entries; a power of two
+#define NETRING_BUFSIZE	2048		// Bytes per packet buffer
+
+struct netring {
+	volatile uint32_t nr_prod;
+	volatile uint32_t nr_cons;
+	volatile uint32_t nr_kick;
+	volatile uint32_t nr_wait;
+	volatile int nr_len[NETRING_SIZE];
+};
+
+// The network server can run as NS_NSHARDS instances, each with its
+// own lwIP stack on the same address, to spread TCP connections over
+// several CPUs.  The input environment steers each received TCP
+// segment to the instance that ns_flow_shard picks for its connection,
+// and everything else to instance 0, which is the ENV_TYPE_NS
+// environment.  Socket ids name an instance's lwIP socket and the
+// instance, so that clients know where to send each request.
+// Override with -DNS_NSHARDS=... .
+#ifndef NS_NSHARDS
+#define NS_NSHARDS	1
+#endif
+#define NS_MAXSHARDS	8
+#if NS_NSHARDS < 1 || NS_NSHARDS > NS_MAXSHARDS
+# error "NS_NSHARDS must be from 1 to NS_MAXSHARDS"
+#endif
+
+#define NS_SOCKID(s, shard)	((s) * NS_NSHARDS + (shard))
+#define NS_SOCKSHARD(sockid)	((sockid) % NS_NSHARDS)
+#define NS_SOCKLWIP(sockid)	((sockid) / NS_NSHARDS)
+
+// The instance that owns the TCP connection between remote address
+// 'raddr' (network byte order) and port 'rport' and local port 'lport'
+// (host byte order).  Instances choose the local ports of their
+// outgoing connections so that the connections hash to themselves.
+static inline int
+ns_flow_shard(uint32_t raddr, uint16_t rport, uint16_t lport)
+{
+	uint32_t h = raddr ^ ((uint32_t) rport << 16 | lport);
+
+	h ^= h >> 16;
+	h *= 0x45d9f3b;
+	h ^= h >> 16;
+	return h % NS_NSHARDS;
+}
+
+// Sockets that one NSREQ_POLL can poll.
+#define NSPOLL_MAX	((PGSIZE - 2 * sizeof(int)) / sizeof(struct lwip_pollfd))
+
+// A poll that must look somewhere other than the lwIP stack it waits
+// on does so at least every NSPOLL_SLICE milliseconds.
+#define NSPOLL_SLICE	10
+
+// Definitions for requests from clients to network server.
+// An accept, recv or send with MSG_DONTWAIT in its flags that would
+// have to wait fails with -E_AGAIN instead.
 enum {
 	// The following messages pass a page containing an Nsipc.
 	// Accept returns a Nsret_accept on the request page.
@@ -26,20 +97,28 @@ enum {
 	NSREQ_RECV,
 	NSREQ_SEND,
 	NSREQ_SOCKET,
+	// Shards returns a Nsret_shards on the request page.
+	NSREQ_SHARDS,
+	// Poll fills in the revents and seq of its Nsreq_poll.
+	NSREQ_POLL,
 
-	// The following two messages pass a page containing a struct jif_pkt
+	// The following two messages pass a page containing a struct jif_pkt,
+	// or no page to say that packets are waiting in a struct netring
 	NSREQ_INPUT,
 	// NSREQ_OUTPUT, unlike all other messages, is sent *from* the
 	// network server, to the output environment
 	NSREQ_OUTPUT,
 
-	// The following message passes no page
+	// The following messages pass no page
 	NSREQ_TIMER,
+	// Sent by one instance to another that has work in shared memory
+	NSREQ_WAKEUP,
 };
 
 union Nsipc {
 	struct Nsreq_accept {
 		int req_s;
+		unsigned int req_flags;
 	} accept;
 
 	struct Nsret_accept {
@@ -71,8 +150,20 @@ union Nsipc {
 	struct Nsreq_listen {
 		int req_s;
 		int req_backlog;
+		// Accept queue of the listening socket that this one
+		// stands in for on another instance, or -1
+		int req_queue;
 	} listen;
 
+	// With several instances, a listening socket's connections on
+	// every instance go to its accept queue, which clients accept
+	// from through instance 0.
+	struct Nsret_listen {
+		int ret_queue;
+		struct sockaddr ret_name;
+		socklen_t ret_namelen;
+	} listenRet;
+
 	struct Nsreq_recv {
 		int req_s;
 		int req_len;
@@ -96,6 +187,18 @@ union Nsipc {
 		int req_protocol;
 	} socket;
 
+	struct Nsret_shards {
+		envid_t ret_envid[NS_MAXSHARDS];
+	} shardsRet;
+
+	// Every socket in req_fds, which holds socket ids, belongs to
+	// the instance that the request goes to.
+	struct Nsreq_poll {
+		int req_nfds;
+		int req_timeout;	// milliseconds; < 0 means forever
+		struct lwip_pollfd req_fds[NSPOLL_MAX];
+	} poll;
+
 	struct jif_pkt pkt;
 
 	// Ensure Nsipc is one page
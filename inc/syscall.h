@@ -1,6 +1,8 @@
 #ifndef JOS_INC_SYSCALL_H
 #define JOS_INC_SYSCALL_H
 
+#include <inc/types.h>
+
 /* system call numbers */
 enum {
 	SYS_cputs = 0,
@@ -20,6 +22,16 @@ enum {
 	SYS_time_msec,
 	SYS_ept_map,
 	SYS_env_mkguest,
+	SYS_dma_page_alloc,
+	SYS_dma_page_free,
+	SYS_page_paddr,
+	SYS_irq_wait,
+	SYS_irq_notify,
+	SYS_net_transmit,
+	SYS_net_transmit_sg,
+	SYS_net_receive,
+	SYS_net_receive_page,
+	SYS_net_wait,
 #ifndef VMM_GUEST
 	SYS_vmx_list_vms,
 	SYS_vmx_sel_resume,
@@ -29,4 +41,42 @@ enum {
 	NSYSCALLS
 };
 
+// Conditions for sys_net_wait.
+#define NET_RX		1	// A received packet is waiting
+#define NET_TX		2	// A transmit descriptor is free
+
+// A piece of a packet for sys_net_transmit_sg.
+struct net_frag {
+	uintptr_t nf_va;
+	uint32_t nf_len;
+};
+
+#define NET_MAXFRAGS	64		// Fragments per packet
+#define NET_SEQ_MASK	0x7fffffff	// Transmit sequence numbers wrap
+
+// Work sys_net_transmit_sg can ask the card to do on an IPv4 packet.
+// Offsets are from the start of the Ethernet frame.
+struct net_offload {
+	uint8_t no_flags;	// NET_OFFLOAD_*
+	uint8_t no_l3off;	// IPv4 header
+	uint8_t no_l4off;	// TCP header
+	uint8_t no_hdrlen;	// NET_OFFLOAD_TSO: bytes of headers
+	uint16_t no_mss;	// NET_OFFLOAD_TSO: payload bytes per segment
+};
+
+#define NET_OFFLOAD_IPCSUM	0x01	// Fill in the IPv4 header checksum
+#define NET_OFFLOAD_TCPCSUM	0x02	// Finish the TCP checksum, which
+					// holds the pseudo-header's sum
+#define NET_OFFLOAD_TSO		0x04	// Cut the packet into no_mss-byte
+					// TCP segments; implies both
+					// checksums, and the TCP checksum
+					// leaves the length out of the
+					// pseudo-header
+#define NET_MAXTSO	65535		// Largest packet, headers included,
+					// with NET_OFFLOAD_TSO
+
+// Checksums the card verified on a received packet, in jp_flags.
+#define NET_RXCSUM_IP	0x01		// IPv4 header checksum is good
+#define NET_RXCSUM_L4	0x02		// TCP or UDP checksum is good
+
 #endif /* !JOS_INC_SYSCALL_H */
@@ -0,0 +1,67 @@
+// Physically contiguous memory for device descriptor rings.
+//
+// page_alloc() hands out single pages from a free list, so consecutive
+// calls are not guaranteed to be physically adjacent.  Devices such as
+// virtio and the e1000 want their rings in one contiguous chunk, so we
+// carve those out of a page-aligned pool in the kernel's BSS instead.
+// Pool pages are never returned, except that a caller that cannot use
+// the run it just allocated may give it back with dma_page_free, as
+// sys_dma_page_free lets a user-level driver do.
+
+#include <inc/assert.h>
+#include <inc/string.h>
+#include <inc/mmu.h>
+
+#include <kern/pmap.h>
+#include <kern/dma.h>
+
+static uint8_t dma_pool[DMA_NPAGES * PGSIZE]
+	__attribute__((aligned(PGSIZE)));
+static size_t dma_next;
+
+// Allocate 'npages' physically contiguous, zeroed pages.
+// Each page starts with one reference held by the pool, so mapping
+// and unmapping the page in user space never frees it.
+// Returns the PageInfo of the first page, or NULL if the pool is
+// exhausted.
+struct PageInfo *
+dma_page_alloc(size_t npages)
+{
+	struct PageInfo *pp;
+	size_t i;
+
+	if (npages == 0 || dma_next + npages > DMA_NPAGES)
+		return NULL;
+
+	pp = pa2page(PADDR(dma_pool + dma_next * PGSIZE));
+	memset(dma_pool + dma_next * PGSIZE, 0, npages * PGSIZE);
+	for (i = 0; i < npages; i++)
+		pp[i].pp_ref++;
+	dma_next += npages;
+	return pp;
+}
+
+// Give back the run of 'npages' pages at 'pp' that dma_page_alloc
+// returned, which must be the most recent allocation and no longer be
+// mapped anywhere.
+void
+dma_page_free(struct PageInfo *pp, size_t npages)
+{
+	size_t i;
+
+	assert(page2kva(pp) == dma_pool + (dma_next - npages) * PGSIZE);
+	for (i = 0; i < npages; i++) {
+		assert(pp[i].pp_ref == 1);
+		pp[i].pp_ref--;
+	}
+	dma_next -= npages;
+}
+
+// Whether the 'npages' pages at 'pp' are the pool's most recent
+// allocation, which dma_page_free can give back.
+bool
+dma_page_last(struct PageInfo *pp, size_t npages)
+{
+	return npages <= dma_next
+		&& pp == pa2page(PADDR(dma_pool + (dma_next - npages) * PGSIZE));
+}
@@ -0,0 +1,16 @@
+#ifndef JOS_KERN_DMA_H
+#define JOS_KERN_DMA_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// Number of pages in the physically contiguous DMA pool.
+#define DMA_NPAGES	96
+
+struct PageInfo *dma_page_alloc(size_t npages);
+void dma_page_free(struct PageInfo *pp, size_t npages);
+bool dma_page_last(struct PageInfo *pp, size_t npages);
+
+#endif // !JOS_KERN_DMA_H
@@ -1,3 +1,566 @@
+// Driver for the Intel 82540EM gigabit Ethernet controller.
+//
+// The TX and RX descriptor rings live in physically contiguous DMA
+// memory.  Each TX descriptor owns a 2KB buffer for packets sent by
+// copying with e1000_transmit; e1000_transmit_sg instead points the
+// descriptors at the caller's own pages, pinned until the card has
+// sent them, one descriptor per physically contiguous piece.  Such a
+// packet may also ask the card to fill in its IPv4 and TCP checksums
+// or to cut it, up to 64KB, into TCP segments itself (TSO), which a
+// context descriptor ahead of its data descriptors sets up.  Each RX
+// descriptor owns a whole page, which the hardware fills at offset
+// RXOFF, just past a struct jif_pkt header, so that
+// e1000_receive_page can hand the page itself to the receiving
+// environment and let it pass the packet on by IPC without copying;
+// the header also says which checksums the card verified.
+// Rather than having the network server's input and output
+// environments poll, they block in e1000_wait() and are woken by the
+// RX and TX-done interrupts, which ITR limits to E1000_INTR_HZ.
+
+#include <inc/assert.h>
+#include <inc/error.h>
+#include <inc/string.h>
+#include <inc/syscall.h>
+
 #include <kern/e1000.h>
+#include <kern/pmap.h>
+#include <kern/dma.h>
+#include <kern/env.h>
+#include <kern/sched.h>
+#include <kern/picirq.h>
+
+#define RING_PAGES(n)	(ROUNDUP((n) * 16, PGSIZE) / PGSIZE)
+// Offset of jp_data in struct jif_pkt (inc/ns.h, which needs lwIP's
+// headers); the page starts with the ints jp_len and jp_flags.
+#define RXOFF		(2 * sizeof(int))
+
+int e1000_irq = -1;
+
+static volatile uint32_t *e1000;
+
+static volatile struct e1000_tx_desc *tx_ring;
+static volatile struct e1000_rx_desc *rx_ring;
+static uint8_t *tx_bufs[E1000_NTXDESC];
+static struct PageInfo *rx_pages[E1000_NRXDESC];
+static struct PageInfo *tx_pinned[E1000_NTXDESC];
+static bool tx_eop[E1000_NTXDESC];	// Descriptor ends a packet
+static uint32_t tx_tail;	// Next descriptor we fill
+static uint32_t tx_clean;	// Oldest descriptor not yet reclaimed
+static uint32_t tx_queued;	// Packets handed to the card
+static uint32_t tx_completed;	// Packets the card has sent
+static uint32_t rx_next;	// Next descriptor the hardware completes
+
+// Environments blocked in e1000_wait, or 0.  One environment receives,
+// but each network server instance and its output environment may
+// wait to transmit.
+#define NRXWAITERS	1
+#define NTXWAITERS	16
+static envid_t rx_waiter[NRXWAITERS], tx_waiter[NTXWAITERS];
+
+static uint16_t
+e1000_eeprom_read(int addr)
+{
+	uint32_t v;
+
+	e1000[E1000_EERD] = (addr << 8) | E1000_EERD_START;
+	while (!((v = e1000[E1000_EERD]) & E1000_EERD_DONE))
+		;
+	return v >> 16;
+}
+
+// Give every TX descriptor its own 2KB buffer, two to a page.
+static int
+e1000_alloc_bufs(uint8_t **bufs, int n)
+{
+	struct PageInfo *pp;
+	int i;
+
+	for (i = 0; i < n; i += PGSIZE / E1000_BUFSIZE) {
+		if (!(pp = page_alloc(ALLOC_ZERO)))
+			return -E_NO_MEM;
+		pp->pp_ref++;
+		bufs[i] = page2kva(pp);
+		bufs[i + 1] = bufs[i] + E1000_BUFSIZE;
+	}
+	return 0;
+}
+
+// Give RX descriptor i a fresh page, owned by the driver.  The whole
+// page goes to the receiving env, but the card fills at most
+// E1000_BUFSIZE of it, so it must not hold anyone's old data.
+static int
+e1000_rx_refill(int i)
+{
+	struct PageInfo *pp;
+
+	if (!(pp = page_alloc(ALLOC_ZERO)))
+		return -E_NO_MEM;
+	pp->pp_ref++;
+	rx_pages[i] = pp;
+	rx_ring[i].addr = page2pa(pp) + RXOFF;
+	rx_ring[i].status = 0;
+	return 0;
+}
+
+static int
+e1000_tx_init(void)
+{
+	struct PageInfo *pp;
+	int i, r;
+
+	if (!(pp = dma_page_alloc(RING_PAGES(E1000_NTXDESC))))
+		return -E_NO_MEM;
+	tx_ring = page2kva(pp);
+	if ((r = e1000_alloc_bufs(tx_bufs, E1000_NTXDESC)) < 0)
+		return r;
+	for (i = 0; i < E1000_NTXDESC; i++) {
+		tx_ring[i].addr = PADDR(tx_bufs[i]);
+		tx_ring[i].status = E1000_TXD_STAT_DD;
+	}
+
+	e1000[E1000_TDBAL] = page2pa(pp);
+	e1000[E1000_TDBAH] = (uint64_t) page2pa(pp) >> 32;
+	e1000[E1000_TDLEN] = E1000_NTXDESC * sizeof(struct e1000_tx_desc);
+	e1000[E1000_TDH] = 0;
+	e1000[E1000_TDT] = 0;
+	tx_tail = tx_clean = 0;
+	e1000[E1000_TCTL] = E1000_TCTL_EN | E1000_TCTL_PSP
+		| E1000_TCTL_CT | E1000_TCTL_COLD;
+	e1000[E1000_TIPG] = E1000_TIPG_DEFAULT;
+	return 0;
+}
+
+static int
+e1000_rx_init(void)
+{
+	struct PageInfo *pp;
+	uint16_t mac[3];
+	int i, r;
+
+	for (i = 0; i < 3; i++)
+		mac[i] = e1000_eeprom_read(i);
+	e1000[E1000_RAL] = mac[0] | (mac[1] << 16);
+	e1000[E1000_RAH] = mac[2] | E1000_RAH_AV;
+	for (i = 0; i < 128; i++)
+		e1000[E1000_MTA + i] = 0;
+
+	if (!(pp = dma_page_alloc(RING_PAGES(E1000_NRXDESC))))
+		return -E_NO_MEM;
+	rx_ring = page2kva(pp);
+	for (i = 0; i < E1000_NRXDESC; i++)
+		if ((r = e1000_rx_refill(i)) < 0)
+			return r;
+
+	e1000[E1000_RDBAL] = page2pa(pp);
+	e1000[E1000_RDBAH] = (uint64_t) page2pa(pp) >> 32;
+	e1000[E1000_RDLEN] = E1000_NRXDESC * sizeof(struct e1000_rx_desc);
+	// Hand every descriptor but one to the hardware; RDT == RDH would
+	// mean the ring is empty.
+	e1000[E1000_RDH] = 0;
+	e1000[E1000_RDT] = E1000_NRXDESC - 1;
+	rx_next = 0;
+	e1000[E1000_RDTR] = 0;
+	e1000[E1000_RXCSUM] = E1000_RXCSUM_IPOFL | E1000_RXCSUM_TUOFL;
+	// The hardware may write a full 2048 bytes past RXOFF, which still
+	// fits in the page.
+	e1000[E1000_RCTL] = E1000_RCTL_EN | E1000_RCTL_BAM
+		| E1000_RCTL_SZ_2048 | E1000_RCTL_SECRC;
+	return 0;
+}
+
+int
+e1000_attach(struct pci_func *pcif)
+{
+	int r;
+
+	pci_func_enable(pcif);
+	e1000 = mmio_map_region(pcif->reg_base[0], pcif->reg_size[0]);
+	cprintf("e1000: status 0x%08x, %d tx / %d rx descriptors\n",
+		e1000[E1000_STATUS], E1000_NTXDESC, E1000_NRXDESC);
+
+	e1000[E1000_IMC] = ~0;
+	if ((r = e1000_tx_init()) < 0 || (r = e1000_rx_init()) < 0) {
+		cprintf("e1000: %e\n", r);
+		e1000[E1000_RCTL] = 0;
+		e1000[E1000_TCTL] = 0;
+		e1000 = NULL;
+		return 0;
+	}
+
+	e1000_irq = pcif->irq_line;
+	e1000[E1000_ITR_REG] = E1000_ITR;
+	(void) e1000[E1000_ICR];
+	e1000[E1000_IMS] = E1000_INT_RXT0 | E1000_INT_RXO | E1000_INT_RXDMT0
+		| E1000_INT_TXDW | E1000_INT_LSC;
+	irq_mask_line(e1000_irq, 0);
+	return 1;
+}
+
+static void
+e1000_wake(envid_t *waiter, int n)
+{
+	struct Env *e;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (waiter[i] && envid2env(waiter[i], &e, 0) == 0
+		    && e->env_status == ENV_NOT_RUNNABLE)
+			e->env_status = ENV_RUNNABLE;
+		waiter[i] = 0;
+	}
+}
+
+// Called from trap_dispatch on e1000_irq.  Reading ICR acknowledges
+// the device's interrupt causes.
+void
+e1000_intr(void)
+{
+	uint32_t icr;
+
+	if (!e1000)
+		return;
+	icr = e1000[E1000_ICR];
+	if (icr & (E1000_INT_RXT0 | E1000_INT_RXO | E1000_INT_RXDMT0))
+		e1000_wake(rx_waiter, NRXWAITERS);
+	if (icr & E1000_INT_TXDW)
+		e1000_wake(tx_waiter, NTXWAITERS);
+}
+
+// Reclaim the descriptors the card has finished with, unpinning the
+// pages they sent from.
+static void
+e1000_tx_reclaim(void)
+{
+	volatile struct e1000_tx_desc *d;
+
+	while (tx_clean != tx_tail
+	       && ((d = &tx_ring[tx_clean])->status & E1000_TXD_STAT_DD)) {
+		if (tx_pinned[tx_clean]) {
+			page_decref(tx_pinned[tx_clean]);
+			tx_pinned[tx_clean] = NULL;
+		}
+		if (tx_eop[tx_clean])
+			tx_completed++;
+		tx_clean = (tx_clean + 1) & (E1000_NTXDESC - 1);
+	}
+}
+
+// Number of free TX descriptors.  One always stays unused so that
+// tx_tail == tx_clean means the ring is empty.
+static uint32_t
+tx_free(void)
+{
+	e1000_tx_reclaim();
+	return E1000_NTXDESC - 1 - ((tx_tail - tx_clean) & (E1000_NTXDESC - 1));
+}
+
+static bool
+tx_ready(void)
+{
+	return tx_free() > 0;
+}
+
+// Fill the data descriptor at tx_tail and advance it.  'cmd' and
+// 'popts' are 0 for a legacy descriptor; otherwise the descriptor is
+// extended, so that the last context descriptor applies to it.
+static void
+tx_fill(physaddr_t pa, size_t len, bool eop, uint8_t cmd, uint8_t popts)
+{
+	volatile struct e1000_tx_desc *d = &tx_ring[tx_tail];
+
+	d->addr = pa;
+	d->length = len;
+	d->cso = cmd ? E1000_TXD_DTYP_D : 0;
+	d->status = 0;
+	d->css = popts;
+	d->special = 0;
+	d->cmd = cmd | E1000_TXD_CMD_RS | E1000_TXD_CMD_IFCS
+		| (eop ? E1000_TXD_CMD_EOP : 0);
+	tx_eop[tx_tail] = eop;
+	tx_tail = (tx_tail + 1) & (E1000_NTXDESC - 1);
+}
+
+// Fill a context descriptor at tx_tail for a 'total'-byte packet
+// with offloads 'off', and advance tx_tail.  Returns the DCMD bits
+// for the packet's data descriptors.
+static uint8_t
+tx_fill_ctx(const struct net_offload *off, size_t total)
+{
+	volatile struct e1000_ctx_desc *c =
+		(volatile struct e1000_ctx_desc *) &tx_ring[tx_tail];
+	uint8_t tucmd = E1000_TXD_CMD_DEXT | E1000_TXD_CMD_RS
+		| E1000_TXC_CMD_IP | E1000_TXC_CMD_TCP;
+	uint8_t dcmd = E1000_TXD_CMD_DEXT;
+
+	c->ipcss = off->no_l3off;
+	c->ipcso = off->no_l3off + 10;
+	c->ipcse = off->no_l4off - 1;
+	c->tucss = off->no_l4off;
+	c->tucso = off->no_l4off + 16;
+	c->tucse = 0;
+	c->status = 0;
+	if (off->no_flags & NET_OFFLOAD_TSO) {
+		tucmd |= E1000_TXD_CMD_TSE;
+		dcmd |= E1000_TXD_CMD_TSE;
+		c->paylen = total - off->no_hdrlen;
+		c->hdrlen = off->no_hdrlen;
+		c->mss = off->no_mss;
+	} else {
+		c->paylen = 0;
+		c->hdrlen = 0;
+		c->mss = 0;
+	}
+	c->paylen |= (uint32_t) tucmd << E1000_TXC_TUCMD_SHIFT;
+	tx_pinned[tx_tail] = NULL;
+	tx_eop[tx_tail] = 0;
+	tx_tail = (tx_tail + 1) & (E1000_NTXDESC - 1);
+	return dcmd;
+}
+
+// Check that 'off' makes sense for a 'total'-byte packet.
+static bool
+offload_ok(const struct net_offload *off, size_t total)
+{
+	if (off->no_flags & ~(NET_OFFLOAD_IPCSUM | NET_OFFLOAD_TCPCSUM
+			      | NET_OFFLOAD_TSO))
+		return 0;
+	if (off->no_l3off + 20 > off->no_l4off || off->no_l4off > total)
+		return 0;
+	if ((off->no_flags & (NET_OFFLOAD_TCPCSUM | NET_OFFLOAD_TSO))
+	    && off->no_l4off + 20 > total)
+		return 0;
+	if (!(off->no_flags & NET_OFFLOAD_TSO))
+		return total <= E1000_MAXPKT;
+	return off->no_hdrlen >= off->no_l4off + 20
+		&& off->no_hdrlen < total && total <= NET_MAXTSO
+		&& off->no_mss > 0 && off->no_mss <= E1000_MAXPKT;
+}
+
+static bool
+rx_ready(void)
+{
+	return rx_ring[rx_next].status & E1000_RXD_STAT_DD;
+}
+
+// Queue a packet for transmission.
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if len is too large or there is no device.
+//	-E_AGAIN if the TX ring is full.
+int
+e1000_transmit(const void *data, size_t len)
+{
+	if (!e1000 || len > E1000_MAXPKT)
+		return -E_INVAL;
+	if (!tx_ready())
+		return -E_AGAIN;
+
+	memmove(tx_bufs[tx_tail], data, len);
+	tx_fill(PADDR(tx_bufs[tx_tail]), len, 1, 0, 0);
+	tx_queued++;
+	e1000[E1000_TDT] = tx_tail;
+	return 0;
+}
+
+// Queue a packet made of the 'nfrags' fragments in 'frags', which
+// live in curenv's memory, without copying it: the card reads each
+// fragment from its page, which stays pinned until the card is done.
+// Callers must not modify the fragments before then; see the return
+// value.  If 'off' is not NULL, the card also does the work it asks
+// for.  With nfrags == 0, just report progress.  'frags' and 'off'
+// themselves must be kernel copies, which can't change between being
+// checked and being used.
+// Returns a sequence number on success, < 0 on error.  For a packet,
+// the number is the packet's; it has been sent once the count of sent
+// packets, which nfrags == 0 returns, exceeds it.  Both wrap at
+// NET_SEQ_MASK.  Errors are:
+//	-E_INVAL if the packet is empty or too large, nfrags is out of
+//	range, 'off' is bad, or there is no device.
+//	-E_FAULT if a fragment is not mapped in curenv.
+//	-E_AGAIN if the TX ring doesn't have room for the packet.
+int
+e1000_transmit_sg(const struct net_frag *frags, int nfrags,
+		  const struct net_offload *off)
+{
+	static struct PageInfo *pages[E1000_NTXDESC];
+	struct PageInfo *pp;
+	uintptr_t va, end;
+	size_t total, n;
+	int i, j, ndesc;
+	uint8_t cmd, popts;
+	pte_t *pte;
+
+	if (!e1000 || nfrags < 0 || nfrags > NET_MAXFRAGS)
+		return -E_INVAL;
+	if (nfrags == 0) {
+		e1000_tx_reclaim();
+		return tx_completed & NET_SEQ_MASK;
+	}
+
+	total = 0;
+	ndesc = 0;
+	// Look up every page once, and fill the descriptors from these
+	// lookups.
+	for (i = 0; i < nfrags; i++) {
+		total += frags[i].nf_len;
+		va = frags[i].nf_va;
+		end = va + frags[i].nf_len;
+		if (end < va || end > UTOP)
+			return -E_FAULT;
+		for (; va < end; va = ROUNDDOWN(va, PGSIZE) + PGSIZE) {
+			if (ndesc == E1000_NTXDESC)
+				return -E_INVAL;
+			if (!(pp = page_lookup(curenv->env_pml4e, (void *) va,
+					       &pte))
+			    || !(*pte & PTE_U))
+				return -E_FAULT;
+			pages[ndesc++] = pp;
+		}
+	}
+	if (off && !off->no_flags)
+		off = NULL;
+	if (total == 0 || (off ? !offload_ok(off, total) : total > E1000_MAXPKT))
+		return -E_INVAL;
+	if (tx_free() < ndesc + (off != NULL))
+		return -E_AGAIN;
+
+	cmd = popts = 0;
+	if (off) {
+		cmd = tx_fill_ctx(off, total);
+		if (off->no_flags & (NET_OFFLOAD_IPCSUM | NET_OFFLOAD_TSO))
+			popts |= E1000_TXD_POPTS_IXSM;
+		if (off->no_flags & (NET_OFFLOAD_TCPCSUM | NET_OFFLOAD_TSO))
+			popts |= E1000_TXD_POPTS_TXSM;
+	}
+	for (i = j = 0; i < nfrags; i++)
+		for (va = frags[i].nf_va, end = va + frags[i].nf_len;
+		     va < end; va += n) {
+			n = MIN(end, ROUNDDOWN(va, PGSIZE) + PGSIZE) - va;
+			pp = pages[j++];
+			pp->pp_ref++;
+			tx_pinned[tx_tail] = pp;
+			tx_fill(page2pa(pp) + PGOFF(va), n, j == ndesc,
+				cmd, popts);
+		}
+	e1000[E1000_TDT] = tx_tail;
+	return tx_queued++ & NET_SEQ_MASK;
+}
+
+// The NET_RXCSUM_* flags for the packet in 'd'.
+static int
+rx_csum_flags(volatile struct e1000_rx_desc *d)
+{
+	int flags = 0;
+
+	if (d->status & E1000_RXD_STAT_IXSM)
+		return 0;
+	if ((d->status & E1000_RXD_STAT_IPCS) && !(d->errors & E1000_RXD_ERR_IPE))
+		flags |= NET_RXCSUM_IP;
+	if ((d->status & E1000_RXD_STAT_TCPCS)
+	    && !(d->errors & E1000_RXD_ERR_TCPE))
+		flags |= NET_RXCSUM_L4;
+	return flags;
+}
+
+// Copy the next received packet into buf, truncating it to len bytes.
+// Returns the packet's length on success, < 0 on error.  Errors are:
+//	-E_INVAL if there is no device.
+//	-E_AGAIN if no packet has arrived.
+int
+e1000_receive(void *buf, size_t len)
+{
+	volatile struct e1000_rx_desc *d;
+	size_t n;
+
+	if (!e1000)
+		return -E_INVAL;
+	if (!rx_ready())
+		return -E_AGAIN;
+
+	d = &rx_ring[rx_next];
+	n = d->length;
+	memmove(buf, (uint8_t *) page2kva(rx_pages[rx_next]) + RXOFF,
+		MIN(n, len));
+	d->status = 0;
+	e1000[E1000_RDT] = rx_next;
+	rx_next = (rx_next + 1) & (E1000_NRXDESC - 1);
+	return n;
+}
+
+// Map the page holding the next received packet at 'va' in curenv,
+// as a struct jif_pkt with jp_len and jp_flags filled in, and give its
+// descriptor a fresh page.  The packet is never copied.
+// Returns the packet's length on success, < 0 on error.  Errors are:
+//	-E_INVAL if there is no device.
+//	-E_AGAIN if no packet has arrived.
+//	-E_NO_MEM if there is no page to replace the packet's.
+int
+e1000_receive_page(void *va)
+{
+	volatile struct e1000_rx_desc *d;
+	struct PageInfo *pp;
+	int n, r;
+
+	if (!e1000)
+		return -E_INVAL;
+	if (!rx_ready())
+		return -E_AGAIN;
+
+	d = &rx_ring[rx_next];
+	pp = rx_pages[rx_next];
+	n = d->length;
+	((int *) page2kva(pp))[0] = n;
+	((int *) page2kva(pp))[1] = rx_csum_flags(d);
+	if ((r = page_insert(curenv->env_pml4e, pp, va,
+			     PTE_P | PTE_U | PTE_W)) < 0)
+		return r;
+	if ((r = e1000_rx_refill(rx_next)) < 0) {
+		page_remove(curenv->env_pml4e, va);
+		return r;
+	}
+	// curenv's mapping now holds the only reference.
+	page_decref(pp);
+
+	e1000[E1000_RDT] = rx_next;
+	rx_next = (rx_next + 1) & (E1000_NRXDESC - 1);
+	return n;
+}
+
+// Block curenv until a packet can be received (NET_RX) or a TX
+// descriptor is free (NET_TX).  Returns 0 at once if that is already
+// so; otherwise the next matching interrupt wakes curenv with 0.
+// Errors are:
+//	-E_INVAL if there is no device, 'what' is invalid, or as many
+//	live envs as can (one for NET_RX) are already waiting for it.
+int
+e1000_wait(int what)
+{
+	envid_t *waiter, *slot = 0;
+	struct Env *e;
+	int i, n;
+
+	if (!e1000)
+		return -E_INVAL;
+	if (what == NET_RX) {
+		if (rx_ready())
+			return 0;
+		waiter = rx_waiter;
+		n = NRXWAITERS;
+	} else if (what == NET_TX) {
+		if (tx_ready())
+			return 0;
+		waiter = tx_waiter;
+		n = NTXWAITERS;
+	} else
+		return -E_INVAL;
 
-// LAB 6: Your driver code here
+	for (i = 0; i < n && !slot; i++)
+		if (!waiter[i] || waiter[i] == curenv->env_id
+		    || envid2env(waiter[i], &e, 0) < 0)
+			slot = &waiter[i];
+	if (!slot)
+		return -E_INVAL;
+	*slot = curenv->env_id;
+	curenv->env_status = ENV_NOT_RUNNABLE;
+	curenv->env_tf.tf_regs.reg_rax = 0;
+	sched_yield();
+}
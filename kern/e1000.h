@@ -1,4 +1,161 @@
 #ifndef JOS_KERN_E1000_H
 #define JOS_KERN_E1000_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/syscall.h>
+#include <kern/pci.h>
+
+#define E1000_VENDOR	0x8086
+#define E1000_DEVICE	0x100E		// 82540EM, as emulated by QEMU
+
+// Descriptor ring sizes.  The hardware wants ring lengths that are a
+// multiple of 128 bytes, i.e. of 8 descriptors; we also want a power
+// of two so that ring indices wrap with a mask.  Override with
+// -DE1000_NTXDESC=... to trade memory for burst tolerance.
+#ifndef E1000_NTXDESC
+#define E1000_NTXDESC	256
+#endif
+#ifndef E1000_NRXDESC
+#define E1000_NRXDESC	256
+#endif
+#if E1000_NTXDESC < 256 || E1000_NTXDESC > 4096 \
+    || (E1000_NTXDESC & (E1000_NTXDESC - 1))
+# error "E1000_NTXDESC must be a power of two from 256 to 4096"
+#endif
+#if E1000_NRXDESC < 256 || E1000_NRXDESC > 4096 \
+    || (E1000_NRXDESC & (E1000_NRXDESC - 1))
+# error "E1000_NRXDESC must be a power of two from 256 to 4096"
+#endif
+
+// TX buffers are 2KB, two to a page.  RX buffers are whole pages, of
+// which the hardware uses 2KB (RCTL.BSIZE = 2048).
+#define E1000_BUFSIZE	2048
+#define E1000_MAXPKT	1518		// Largest Ethernet frame we send
+
+// Upper bound on the interrupt rate.  ITR counts in 256ns units.
+#define E1000_INTR_HZ	8000
+#define E1000_ITR	(1000000000 / (E1000_INTR_HZ * 256))
+
+// Registers, divided by 4 for use as uint32_t[] indices.
+#define E1000_CTRL	(0x00000/4)	// Device Control
+#define E1000_STATUS	(0x00008/4)	// Device Status
+#define E1000_EERD	(0x00014/4)	// EEPROM Read
+#define E1000_EERD_START	0x00000001
+#define E1000_EERD_DONE		0x00000010
+#define E1000_ICR	(0x000C0/4)	// Interrupt Cause Read
+#define E1000_ITR_REG	(0x000C4/4)	// Interrupt Throttling
+#define E1000_IMS	(0x000D0/4)	// Interrupt Mask Set
+#define E1000_IMC	(0x000D8/4)	// Interrupt Mask Clear
+#define E1000_RCTL	(0x00100/4)	// RX Control
+#define E1000_RCTL_EN		0x00000002
+#define E1000_RCTL_BAM		0x00008000	// Accept broadcast
+#define E1000_RCTL_SZ_2048	0x00000000
+#define E1000_RCTL_SECRC	0x04000000	// Strip Ethernet CRC
+#define E1000_TCTL	(0x00400/4)	// TX Control
+#define E1000_TCTL_EN		0x00000002
+#define E1000_TCTL_PSP		0x00000008	// Pad short packets
+#define E1000_TCTL_CT		0x00000100	// Collision threshold 0x10
+#define E1000_TCTL_COLD		0x00040000	// Collision distance 0x40
+#define E1000_TIPG	(0x00410/4)	// TX Inter-packet gap
+#define E1000_TIPG_DEFAULT	(10 | (4 << 10) | (6 << 20))
+#define E1000_RDBAL	(0x02800/4)	// RX Descriptor Base Low
+#define E1000_RDBAH	(0x02804/4)	// RX Descriptor Base High
+#define E1000_RDLEN	(0x02808/4)	// RX Descriptor Length
+#define E1000_RDH	(0x02810/4)	// RX Descriptor Head
+#define E1000_RDT	(0x02818/4)	// RX Descriptor Tail
+#define E1000_RDTR	(0x02820/4)	// RX Delay Timer
+#define E1000_TDBAL	(0x03800/4)	// TX Descriptor Base Low
+#define E1000_TDBAH	(0x03804/4)	// TX Descriptor Base High
+#define E1000_TDLEN	(0x03808/4)	// TX Descriptor Length
+#define E1000_TDH	(0x03810/4)	// TX Descriptor Head
+#define E1000_TDT	(0x03818/4)	// TX Descriptor Tail
+#define E1000_RXCSUM	(0x05000/4)	// RX Checksum Control
+#define E1000_RXCSUM_IPOFL	0x00000100	// Check IPv4 header checksums
+#define E1000_RXCSUM_TUOFL	0x00000200	// Check TCP/UDP checksums
+#define E1000_MTA	(0x05200/4)	// Multicast Table Array (128 entries)
+#define E1000_RAL	(0x05400/4)	// Receive Address Low
+#define E1000_RAH	(0x05404/4)	// Receive Address High
+#define E1000_RAH_AV		0x80000000	// Address valid
+
+// Interrupt causes, as read from ICR and written to IMS.
+#define E1000_INT_TXDW		0x00000001	// TX descriptor written back
+#define E1000_INT_LSC		0x00000004	// Link status change
+#define E1000_INT_RXDMT0	0x00000010	// RX ring running low
+#define E1000_INT_RXO		0x00000040	// RX overrun
+#define E1000_INT_RXT0		0x00000080	// RX timer expired
+
+struct e1000_tx_desc {
+	uint64_t addr;
+	uint16_t length;
+	uint8_t cso;
+	uint8_t cmd;
+	uint8_t status;
+	uint8_t css;
+	uint16_t special;
+} __attribute__((packed));
+
+#define E1000_TXD_CMD_EOP	0x01	// End of packet
+#define E1000_TXD_CMD_IFCS	0x02	// Insert FCS
+#define E1000_TXD_CMD_TSE	0x04	// TCP segmentation (extended only)
+#define E1000_TXD_CMD_RS	0x08	// Report status
+#define E1000_TXD_CMD_DEXT	0x20	// Extended descriptor
+#define E1000_TXD_STAT_DD	0x01	// Descriptor done
+
+// An extended data descriptor has the same layout, with the DTYP in
+// the top half of 'cso' and the POPTS in 'css'.
+#define E1000_TXD_DTYP_D	0x10	// Data descriptor
+#define E1000_TXD_POPTS_IXSM	0x01	// Insert IP checksum
+#define E1000_TXD_POPTS_TXSM	0x02	// Insert TCP/UDP checksum
+
+// A context descriptor sets up the checksum and segmentation offloads
+// for the extended data descriptors after it.  Offsets are from the
+// start of the frame; 'tucse' 0 means to the end of the packet.
+struct e1000_ctx_desc {
+	uint8_t ipcss;
+	uint8_t ipcso;
+	uint16_t ipcse;
+	uint8_t tucss;
+	uint8_t tucso;
+	uint16_t tucse;
+	uint32_t paylen;	// TSO payload in bits 0-19; DTYP 0; TUCMD
+	uint8_t status;
+	uint8_t hdrlen;
+	uint16_t mss;
+} __attribute__((packed));
+
+#define E1000_TXC_CMD_TCP	0x01	// TCP, not UDP
+#define E1000_TXC_CMD_IP	0x02	// IPv4, not IPv6
+#define E1000_TXC_TUCMD_SHIFT	24
+
+struct e1000_rx_desc {
+	uint64_t addr;
+	uint16_t length;
+	uint16_t csum;
+	uint8_t status;
+	uint8_t errors;
+	uint16_t special;
+} __attribute__((packed));
+
+#define E1000_RXD_STAT_DD	0x01	// Descriptor done
+#define E1000_RXD_STAT_EOP	0x02	// End of packet
+#define E1000_RXD_STAT_IXSM	0x04	// Checksums not checked
+#define E1000_RXD_STAT_TCPCS	0x20	// TCP/UDP checksum checked
+#define E1000_RXD_STAT_IPCS	0x40	// IPv4 header checksum checked
+#define E1000_RXD_ERR_TCPE	0x20	// TCP/UDP checksum bad
+#define E1000_RXD_ERR_IPE	0x40	// IPv4 header checksum bad
+
+extern int e1000_irq;
+
+int e1000_attach(struct pci_func *pcif);
+void e1000_intr(void);
+int e1000_transmit(const void *data, size_t len);
+int e1000_transmit_sg(const struct net_frag *frags, int nfrags,
+		      const struct net_offload *off);
+int e1000_receive(void *buf, size_t len);
+int e1000_receive_page(void *va);
+int e1000_wait(int what);
 
 #endif	// JOS_KERN_E1000_H
@@ -84,6 +84,25 @@ irq_setmask_8259A(uint16_t mask)
 	cprintf("\n");
 }
 
+// Mask or unmask a single IRQ line.  Unlike irq_setmask_8259A this
+// does not log, since user-level drivers toggle their line on every
+// interrupt (see irq_wait in kern/trap.c).
+void
+irq_mask_line(int irq, bool masked)
+{
+	uint16_t mask = irq_mask_8259A;
+
+	if (masked)
+		mask |= (1 << irq);
+	else
+		mask &= ~(1 << irq);
+	irq_mask_8259A = mask;
+	if (!didinit)
+		return;
+	outb(IO_PIC1+1, (char)mask);
+	outb(IO_PIC2+1, (char)(mask >> 8));
+}
+
 void
 irq_eoi(void)
 {
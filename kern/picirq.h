@@ -23,6 +23,7 @@
 extern uint16_t irq_mask_8259A;
 void pic_init(void);
 void irq_setmask_8259A(uint16_t mask);
+void irq_mask_line(int irq, bool masked);
 void irq_eoi(void);
 #endif // !__ASSEMBLER__
 
@@ -16,6 +16,8 @@
 #include <kern/console.h>
 #include <kern/sched.h>
 #include <kern/time.h>
+#include <kern/dma.h>
+#include <kern/e1000.h>
 #ifndef VMM_GUEST
 #include <vmm/ept.h>
 #include <vmm/vmx.h>
@@ -284,6 +286,11 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 static int
 sys_ipc_recv(void *dstva)
 {
+	// An interrupt the caller asked for with sys_irq_notify may
+	// have fired while it was busy.
+	if (irq_notify_pending(curenv))
+		return 0;
+
 	// LAB 4: Your code here.
 	panic("sys_ipc_recv not implemented");
 	return 0;
@@ -298,6 +305,224 @@ sys_time_msec(void)
 	panic("sys_time_msec not implemented");
 }
 
+// The next several calls exist for user-level device drivers, such as the
+// file server's virtio-blk driver.  They are restricted to environments
+// that were granted I/O privilege (FL_IOPL_MASK set in their eflags),
+// since they expose physical addresses and interrupts.
+
+// Allocate 'npages' physically contiguous pages from the DMA pool and
+// map them at 'va' in the current environment with permission 'perm'.
+//
+// Returns the physical address of the first page on success, < 0 on
+// error.  Errors are:
+//	-E_BAD_ENV if the environment lacks I/O privilege.
+//	-E_INVAL if va is not page-aligned, the range extends past UTOP,
+//		or perm is inappropriate (see sys_page_alloc).
+//	-E_NO_MEM if the pool is exhausted or page tables can't be
+//		allocated.
+static int64_t
+sys_dma_page_alloc(void *va, size_t npages, int perm)
+{
+	struct PageInfo *pp;
+	size_t i;
+	int r;
+
+	if (!(curenv->env_tf.tf_eflags & FL_IOPL_MASK))
+		return -E_BAD_ENV;
+	if ((uintptr_t) va % PGSIZE || npages == 0
+	    || (uintptr_t) va + npages * PGSIZE > UTOP
+	    || (uintptr_t) va + npages * PGSIZE < (uintptr_t) va)
+		return -E_INVAL;
+	if ((perm & (PTE_U | PTE_P)) != (PTE_U | PTE_P)
+	    || (perm & ~PTE_SYSCALL))
+		return -E_INVAL;
+
+	if (!(pp = dma_page_alloc(npages)))
+		return -E_NO_MEM;
+	for (i = 0; i < npages; i++)
+		if ((r = page_insert(curenv->env_pml4e, &pp[i],
+				     (uint8_t *) va + i * PGSIZE, perm)) < 0) {
+			// The pool is small: unmap what we mapped and
+			// give the whole run back.
+			while (i-- > 0)
+				page_remove(curenv->env_pml4e,
+					    (uint8_t *) va + i * PGSIZE);
+			dma_page_free(pp, npages);
+			return r;
+		}
+	return page2pa(pp);
+}
+
+// Unmap the 'npages' pages at 'va' that the most recent
+// sys_dma_page_alloc mapped there, and give them back to the DMA pool,
+// for a driver that finds it cannot use them.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if the environment lacks I/O privilege.
+//	-E_INVAL if the range is not the pool's most recent allocation,
+//		mapped only here, or is not page-aligned and below UTOP.
+static int
+sys_dma_page_free(void *va, size_t npages)
+{
+	struct PageInfo *pp;
+	size_t i;
+
+	if (!(curenv->env_tf.tf_eflags & FL_IOPL_MASK))
+		return -E_BAD_ENV;
+	if ((uintptr_t) va % PGSIZE || npages == 0
+	    || (uintptr_t) va + npages * PGSIZE > UTOP
+	    || (uintptr_t) va + npages * PGSIZE < (uintptr_t) va)
+		return -E_INVAL;
+	if (!(pp = page_lookup(curenv->env_pml4e, va, 0))
+	    || !dma_page_last(pp, npages))
+		return -E_INVAL;
+	for (i = 0; i < npages; i++)
+		if (page_lookup(curenv->env_pml4e, (uint8_t *) va + i * PGSIZE,
+				0) != &pp[i] || pp[i].pp_ref != 2)
+			return -E_INVAL;
+	for (i = 0; i < npages; i++)
+		page_remove(curenv->env_pml4e, (uint8_t *) va + i * PGSIZE);
+	dma_page_free(pp, npages);
+	return 0;
+}
+
+// Return the physical address that 'va' maps to in the current
+// environment.
+//
+// Returns < 0 on error.  Errors are:
+//	-E_BAD_ENV if the environment lacks I/O privilege.
+//	-E_INVAL if va >= UTOP or va is not mapped.
+static int64_t
+sys_page_paddr(void *va)
+{
+	struct PageInfo *pp;
+
+	if (!(curenv->env_tf.tf_eflags & FL_IOPL_MASK))
+		return -E_BAD_ENV;
+	if ((uintptr_t) va >= UTOP)
+		return -E_INVAL;
+	if (!(pp = page_lookup(curenv->env_pml4e, va, 0)))
+		return -E_INVAL;
+	return page2pa(pp) + PGOFF(va);
+}
+
+// Block until hardware interrupt 'irq' fires.  The first call claims
+// the IRQ for the calling environment.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if the environment lacks I/O privilege.
+//	-E_INVAL if irq is invalid or claimed by another environment.
+static int
+sys_irq_wait(int irq)
+{
+	if (!(curenv->env_tf.tf_eflags & FL_IOPL_MASK))
+		return -E_BAD_ENV;
+	return irq_wait(irq);
+}
+
+// Ask for the next interrupt on 'irq' to be delivered as an IPC message
+// from envid 0, whose value is 'irq'.  The first call claims the IRQ
+// for the calling environment.
+//
+// Returns 1 if the interrupt already fired (no message will follow),
+// 0 if the message is armed, < 0 on error.  Errors are:
+//	-E_BAD_ENV if the environment lacks I/O privilege.
+//	-E_INVAL if irq is invalid or claimed by another environment.
+static int
+sys_irq_notify(int irq)
+{
+	if (!(curenv->env_tf.tf_eflags & FL_IOPL_MASK))
+		return -E_BAD_ENV;
+	return irq_notify(irq);
+}
+
+// Queue the 'len'-byte packet at 'buf' on the network card.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_AGAIN if the transmit ring is full; see sys_net_wait.
+//	-E_INVAL if len is too large or there is no network card.
+static int
+sys_net_transmit(const void *buf, size_t len)
+{
+	user_mem_assert(curenv, buf, len, PTE_U);
+	return e1000_transmit(buf, len);
+}
+
+// Queue a packet made of 'nfrags' fragments of the caller's memory,
+// without copying it.  The pages stay pinned until the card has sent
+// them, but the caller must leave the bytes alone until then.  If
+// 'off' is not NULL, the card also fills in checksums or cuts the
+// packet into TCP segments, as it says.
+//
+// Returns the packet's sequence number on success; with nfrags == 0,
+// returns the number of packets sent, so that a packet has been sent
+// once that number exceeds its sequence number.  Both wrap at
+// NET_SEQ_MASK.  < 0 on error.  Errors are:
+//	-E_AGAIN if the transmit ring is full; see sys_net_wait.
+//	-E_FAULT if a fragment is not mapped.
+//	-E_INVAL if the packet is empty or too large, nfrags is out of
+//	range, 'off' asks for something the card can't do, or there is
+//	no network card.
+static int
+sys_net_transmit_sg(const struct net_frag *frags, int nfrags,
+		    const struct net_offload *off)
+{
+	static struct net_frag kfrags[NET_MAXFRAGS];
+	static struct net_offload koff;
+
+	if (nfrags < 0 || nfrags > NET_MAXFRAGS)
+		return -E_INVAL;
+	// Copy the arguments in once, so that another environment
+	// sharing their pages can't change them after they're checked.
+	user_mem_assert(curenv, frags, nfrags * sizeof(*frags), PTE_U);
+	memmove(kfrags, frags, nfrags * sizeof(*frags));
+	if (off) {
+		user_mem_assert(curenv, off, sizeof(*off), PTE_U);
+		koff = *off;
+	}
+	return e1000_transmit_sg(kfrags, nfrags, off ? &koff : NULL);
+}
+
+// Copy the next received packet into 'buf', truncated to 'len' bytes.
+//
+// Returns the packet's length on success, < 0 on error.  Errors are:
+//	-E_AGAIN if no packet is waiting; see sys_net_wait.
+//	-E_INVAL if there is no network card.
+static int
+sys_net_receive(void *buf, size_t len)
+{
+	user_mem_assert(curenv, buf, len, PTE_U | PTE_W);
+	return e1000_receive(buf, len);
+}
+
+// Map the page holding the next received packet at 'va', as a struct
+// jif_pkt, instead of copying the packet out.  Whatever was mapped at
+// 'va' is unmapped.
+//
+// Returns the packet's length on success, < 0 on error.  Errors are:
+//	-E_AGAIN if no packet is waiting; see sys_net_wait.
+//	-E_INVAL if va >= UTOP or va is not page-aligned, or there is no
+//	network card.
+//	-E_NO_MEM if there's no memory to replace the page or to map it.
+static int
+sys_net_receive_page(void *va)
+{
+	if ((uintptr_t) va >= UTOP || PGOFF(va))
+		return -E_INVAL;
+	return e1000_receive_page(va);
+}
+
+// Block until 'what' (NET_RX or NET_TX) holds, woken by the network
+// card's interrupt rather than by polling.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if what is invalid, another env is already waiting for
+//	it, or there is no network card.
+static int
+sys_net_wait(int what)
+{
+	return e1000_wait(what);
+}
 
 #ifndef VMM_GUEST
 static void
@@ -380,6 +605,27 @@ syscall(uint64_t syscallno, uint64_t a1, uint64_t a2, uint64_t a3, uint64_t a4,
 	panic("syscall not implemented");
 
 	switch (syscallno) {
+	case SYS_dma_page_alloc:
+		return sys_dma_page_alloc((void *) a1, a2, a3);
+	case SYS_dma_page_free:
+		return sys_dma_page_free((void *) a1, a2);
+	case SYS_page_paddr:
+		return sys_page_paddr((void *) a1);
+	case SYS_irq_wait:
+		return sys_irq_wait(a1);
+	case SYS_irq_notify:
+		return sys_irq_notify(a1);
+	case SYS_net_transmit:
+		return sys_net_transmit((const void *) a1, a2);
+	case SYS_net_transmit_sg:
+		return sys_net_transmit_sg((const struct net_frag *) a1, a2,
+					   (const struct net_offload *) a3);
+	case SYS_net_receive:
+		return sys_net_receive((void *) a1, a2);
+	case SYS_net_receive_page:
+		return sys_net_receive_page((void *) a1);
+	case SYS_net_wait:
+		return sys_net_wait(a1);
 #ifndef VMM_GUEST
 	case SYS_ept_map:
 		return sys_ept_map(a1, (void*) a2, a3, (void*) a4, a5);
@@ -1,6 +1,7 @@
 #include <inc/mmu.h>
 #include <inc/x86.h>
 #include <inc/assert.h>
+#include <inc/error.h>
 
 #include <kern/pmap.h>
 #include <kern/trap.h>
@@ -14,6 +15,7 @@
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
 #include <kern/time.h>
+#include <kern/e1000.h>
 #include <inc/vmx.h>
 
 extern uintptr_t gdtdesc_64;
@@ -176,6 +178,142 @@ print_regs(struct PushRegs *regs)
 	cprintf("  rax  0x%08x\n", regs->reg_rax);
 }
 
+// User-level drivers (such as the file server's virtio driver) wait for
+// their device's interrupt with sys_irq_wait.  The line stays masked
+// from the moment it fires until the driver waits again, so a
+// level-triggered device cannot storm us before the driver has had a
+// chance to acknowledge it.
+static struct {
+	envid_t owner;		// Env that last waited on this IRQ, or 0
+	bool waiting;		// Owner is blocked in irq_wait
+	bool notify;		// Owner wants the next interrupt as an IPC
+	uint32_t pending;	// Interrupts since the owner last waited
+} irq_waiters[MAX_IRQS];
+
+// Claim 'irq' for curenv and unmask it.
+// Returns 0 on success, -E_INVAL if irq is out of range or owned by
+// another live env.
+static int
+irq_claim(int irq)
+{
+	struct Env *e;
+
+	if (irq < 0 || irq >= MAX_IRQS || irq == IRQ_SLAVE
+	    || irq == IRQ_TIMER || irq == IRQ_SPURIOUS)
+		return -E_INVAL;
+	if (irq_waiters[irq].owner && irq_waiters[irq].owner != curenv->env_id
+	    && envid2env(irq_waiters[irq].owner, &e, 0) == 0)
+		return -E_INVAL;
+
+	irq_waiters[irq].owner = curenv->env_id;
+	irq_waiters[irq].notify = 0;
+	irq_mask_line(irq, 0);
+	return 0;
+}
+
+// Block curenv until 'irq' fires.  Returns immediately if the IRQ
+// fired since the last call.
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if irq is out of range or owned by another live env.
+int
+irq_wait(int irq)
+{
+	int r;
+
+	if ((r = irq_claim(irq)) < 0)
+		return r;
+	if (irq_waiters[irq].pending) {
+		irq_waiters[irq].pending = 0;
+		return 0;
+	}
+	irq_waiters[irq].waiting = 1;
+	curenv->env_status = ENV_NOT_RUNNABLE;
+	curenv->env_tf.tf_regs.reg_rax = 0;
+	sched_yield();
+}
+
+// Like irq_wait, but rather than blocking, arrange for the next
+// interrupt on 'irq' to arrive as an IPC message from envid 0 with
+// value 'irq', so that a server can wait for requests and for its
+// device at the same time.
+// Returns 1 if the IRQ fired since the last call, in which case no
+// message will be sent, 0 if the message is armed, < 0 on error.
+// Errors are:
+//	-E_INVAL if irq is out of range or owned by another live env.
+int
+irq_notify(int irq)
+{
+	int r;
+
+	if ((r = irq_claim(irq)) < 0)
+		return r;
+	if (irq_waiters[irq].pending) {
+		irq_waiters[irq].pending = 0;
+		return 1;
+	}
+	irq_waiters[irq].notify = 1;
+	return 0;
+}
+
+// Complete e's IPC receive with an interrupt message.
+static void
+irq_send(struct Env *e, int irq)
+{
+	e->env_ipc_recving = 0;
+	e->env_ipc_from = 0;
+	e->env_ipc_value = irq;
+	e->env_ipc_perm = 0;
+}
+
+// Called from sys_ipc_recv.  If an interrupt armed with irq_notify
+// fired while e was not receiving, deliver it now and return 1.
+int
+irq_notify_pending(struct Env *e)
+{
+	int irq;
+
+	for (irq = 0; irq < MAX_IRQS; irq++)
+		if (irq_waiters[irq].owner == e->env_id
+		    && irq_waiters[irq].notify && irq_waiters[irq].pending) {
+			irq_waiters[irq].notify = 0;
+			irq_waiters[irq].pending = 0;
+			irq_send(e, irq);
+			return 1;
+		}
+	return 0;
+}
+
+// Called from trap_dispatch for each hardware interrupt.
+// Returns 1 if a user-level driver owns 'irq', 0 otherwise.
+int
+irq_deliver(int irq)
+{
+	struct Env *e;
+
+	if (!irq_waiters[irq].owner)
+		return 0;
+	irq_mask_line(irq, 1);
+	irq_eoi();
+	if (envid2env(irq_waiters[irq].owner, &e, 0) < 0) {
+		irq_waiters[irq].owner = 0;
+		irq_waiters[irq].waiting = 0;
+		irq_waiters[irq].notify = 0;
+		return 1;
+	}
+	if (irq_waiters[irq].waiting && e->env_status == ENV_NOT_RUNNABLE) {
+		irq_waiters[irq].waiting = 0;
+		e->env_status = ENV_RUNNABLE;
+	} else if (irq_waiters[irq].notify && e->env_ipc_recving
+		   && e->env_status == ENV_NOT_RUNNABLE) {
+		irq_waiters[irq].notify = 0;
+		irq_send(e, irq);
+		e->env_tf.tf_regs.reg_rax = 0;
+		e->env_status = ENV_RUNNABLE;
+	} else
+		irq_waiters[irq].pending++;
+	return 1;
+}
+
 static void
 trap_dispatch(struct Trapframe *tf)
 {
@@ -204,6 +342,21 @@ trap_dispatch(struct Trapframe *tf)
 	// Handle keyboard and serial interrupts.
 	// LAB 5: Your code here.
 
+	// Handle e1000 interrupts.  The line may be shared with a device
+	// driven from user level, so offer it to that driver too, and
+	// acknowledge it ourselves if nobody has claimed it.
+	if (e1000_irq >= 0 && tf->tf_trapno == IRQ_OFFSET + e1000_irq) {
+		e1000_intr();
+		if (!irq_deliver(e1000_irq))
+			irq_eoi();
+		return;
+	}
+
+	// Handle interrupts claimed by user-level drivers.
+	if (tf->tf_trapno >= IRQ_OFFSET && tf->tf_trapno < IRQ_OFFSET + MAX_IRQS
+	    && irq_deliver(tf->tf_trapno - IRQ_OFFSET))
+		return;
+
 	// Unexpected trap: The user process or the kernel has a bug.
 	print_trapframe(tf);
 	if (tf->tf_cs == GD_KT)
@@ -8,6 +8,7 @@
 
 #include <inc/trap.h>
 #include <inc/mmu.h>
+#include <inc/env.h>
 
 /* The kernel's interrupt descriptor table */
 extern struct Gatedesc idt[];
@@ -19,5 +20,9 @@ void print_regs(struct PushRegs *regs);
 void print_trapframe(struct Trapframe *tf);
 void page_fault_handler(struct Trapframe *);
 void backtrace(struct Trapframe *);
+int irq_wait(int irq);
+int irq_notify(int irq);
+int irq_notify_pending(struct Env *e);
+int irq_deliver(int irq);
 
 #endif /* JOS_KERN_TRAP_H */
@@ -0,0 +1,229 @@
+// An epoll-style interface to the network server's poll.
+//
+// An epoll instance is a file descriptor whose data page holds the set
+// of sockets it watches, so that it is shared across fork and dup like
+// a pipe.  epoll_wait polls the whole set with one NSREQ_POLL per
+// network server instance.  An edge-triggered socket remembers the
+// event count that the server last reported for it, and the server
+// reports it again only once that count has moved on.
+
+#include <inc/lib.h>
+
+static int devepoll_close(struct Fd *fd);
+static int devepoll_stat(struct Fd *fd, struct Stat *stat);
+
+struct Dev devepoll =
+{
+	.dev_id =	'e',
+	.dev_name =	"epoll",
+	.dev_close =	devepoll_close,
+	.dev_stat =	devepoll_stat,
+};
+
+struct EpollItem {
+	int ei_fd;
+	int ei_sockid;		// the socket ei_fd was when it was added
+	uint32_t ei_events;
+	uint32_t ei_seq;	// for EPOLLET; 0 until first reported
+	epoll_data_t ei_data;
+};
+
+#define EPOLL_MAXFDS	((PGSIZE - sizeof(int)) / sizeof(struct EpollItem))
+
+struct Epoll {
+	int ep_nitems;
+	struct EpollItem ep_items[EPOLL_MAXFDS];
+};
+
+// What epoll_wait passes to nsipc_poll, and the item of each entry.
+static struct lwip_pollfd pollfds[EPOLL_MAXFDS];
+static int pollitem[EPOLL_MAXFDS];
+
+static int
+fd2epoll(int epfd, struct Epoll **ep)
+{
+	struct Fd *fd;
+	int r;
+
+	if ((r = fd_lookup(epfd, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devepoll.dev_id)
+		return -E_INVAL;
+	*ep = (struct Epoll *) fd2data(fd);
+	return 0;
+}
+
+static int
+fd2sockid(int fdnum)
+{
+	struct Fd *fd;
+	int r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devsock.dev_id)
+		return -E_NOT_SUPP;
+	return fd->fd_sock.sockid;
+}
+
+static struct EpollItem *
+epoll_item(struct Epoll *ep, int fd)
+{
+	int i;
+
+	for (i = 0; i < ep->ep_nitems; i++)
+		if (ep->ep_items[i].ei_fd == fd)
+			return &ep->ep_items[i];
+	return 0;
+}
+
+static void
+epoll_remove(struct Epoll *ep, struct EpollItem *it)
+{
+	*it = ep->ep_items[--ep->ep_nitems];
+}
+
+// Create an epoll instance.  'size' is only a hint, as on Linux.
+// Returns its file descriptor, or < 0 on error.
+int
+epoll_create(int size)
+{
+	struct Fd *fd;
+	struct Epoll *ep;
+	int r;
+
+	static_assert(sizeof(struct Epoll) <= PGSIZE);
+	if (size <= 0)
+		return -E_INVAL;
+	if ((r = fd_alloc(&fd)) < 0
+	    || (r = sys_page_alloc(0, fd, PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
+		return r;
+	ep = (struct Epoll *) fd2data(fd);
+	if ((r = sys_page_alloc(0, ep, PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0) {
+		sys_page_unmap(0, fd);
+		return r;
+	}
+	fd->fd_dev_id = devepoll.dev_id;
+	fd->fd_omode = O_RDONLY;
+	return fd2num(fd);
+}
+
+// Add socket 'fd' to, change it in, or remove it from epoll instance
+// 'epfd', according to 'op'.  Errors are:
+//	-E_INVAL if epfd is not an epoll instance, or op is invalid
+//	-E_NOT_SUPP if fd is not a socket
+//	-E_FILE_EXISTS if fd is already in the set
+//	-E_NOT_FOUND if fd is not in the set
+//	-E_NO_MEM if the set is full
+int
+epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+	struct Epoll *ep;
+	struct EpollItem *it;
+	int r, sockid;
+
+	if ((r = fd2epoll(epfd, &ep)) < 0)
+		return r;
+	if ((sockid = fd2sockid(fd)) < 0)
+		return sockid;
+	it = epoll_item(ep, fd);
+	if (it && it->ei_sockid != sockid) {
+		// fd was closed and reopened as another socket.
+		epoll_remove(ep, it);
+		it = 0;
+	}
+
+	switch (op) {
+	case EPOLL_CTL_ADD:
+		if (it)
+			return -E_FILE_EXISTS;
+		if (ep->ep_nitems == EPOLL_MAXFDS)
+			return -E_NO_MEM;
+		it = &ep->ep_items[ep->ep_nitems++];
+		it->ei_fd = fd;
+		it->ei_sockid = sockid;
+		break;
+	case EPOLL_CTL_MOD:
+		if (!it)
+			return -E_NOT_FOUND;
+		break;
+	case EPOLL_CTL_DEL:
+		if (!it)
+			return -E_NOT_FOUND;
+		epoll_remove(ep, it);
+		return 0;
+	default:
+		return -E_INVAL;
+	}
+	it->ei_events = event->events;
+	it->ei_data = event->data;
+	it->ei_seq = 0;
+	return 0;
+}
+
+// Wait for at most 'timeout' milliseconds, or forever if it is
+// negative, until a socket in epoll instance 'epfd' has an event it
+// watches for, and store up to 'maxevents' of them in 'events'.
+// Sockets that have been closed drop out of the set.
+// Returns the number of events stored, or < 0 on error.
+int
+epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
+{
+	struct Epoll *ep;
+	struct EpollItem *it;
+	uint32_t revents;
+	int i, n, r, nready;
+
+	if ((r = fd2epoll(epfd, &ep)) < 0)
+		return r;
+	if (maxevents <= 0)
+		return -E_INVAL;
+
+	for (i = n = 0; i < ep->ep_nitems; ) {
+		it = &ep->ep_items[i];
+		if (fd2sockid(it->ei_fd) != it->ei_sockid) {
+			epoll_remove(ep, it);
+			continue;
+		}
+		pollfds[n].fd = it->ei_sockid;
+		pollfds[n].events = it->ei_events & (EPOLLIN | EPOLLOUT);
+		if (it->ei_events & EPOLLET)
+			pollfds[n].events |= LWIP_POLLET;
+		pollfds[n].revents = 0;
+		pollfds[n].seq = it->ei_seq;
+		pollitem[n++] = i++;
+	}
+	if ((r = nsipc_poll(pollfds, n, timeout)) <= 0)
+		return r;
+
+	for (i = nready = 0; i < n && nready < maxevents; i++) {
+		revents = pollfds[i].revents
+			& (EPOLLIN | EPOLLOUT | EPOLLERR | EPOLLHUP);
+		if (!revents)
+			continue;
+		it = &ep->ep_items[pollitem[i]];
+		it->ei_seq = pollfds[i].seq;
+		events[nready].events = revents;
+		events[nready++].data = it->ei_data;
+	}
+	return nready;
+}
+
+static int
+devepoll_close(struct Fd *fd)
+{
+	(void) sys_page_unmap(0, fd);
+	return sys_page_unmap(0, fd2data(fd));
+}
+
+static int
+devepoll_stat(struct Fd *fd, struct Stat *stat)
+{
+	struct Epoll *ep = (struct Epoll *) fd2data(fd);
+
+	strcpy(stat->st_name, "<epoll>");
+	stat->st_size = ep->ep_nitems;
+	stat->st_isdir = 0;
+	stat->st_dev = &devepoll;
+	return 0;
+}
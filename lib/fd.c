@@ -3,18 +3,28 @@
 #define debug		0
 
 // Maximum number of file descriptors a program may hold open concurrently
-#define MAXFD		32
+#define MAXFD		4096
 // Bottom of file descriptor area
 #define FDTABLE		0xD0000000
 // Bottom of file data area.  We reserve one data page for each FD,
 // which devices can use if they choose.
 #define FILEDATA	(FDTABLE + MAXFD*PGSIZE)
+// Number of fds whose pages share one page table
+#define FDPERPT		(PTSIZE / PGSIZE)
 
 // Return the 'struct Fd*' for file descriptor index i
 #define INDEX2FD(i)	((struct Fd*) (FDTABLE + ((uint64_t)i)*PGSIZE))
 // Return the file data page for file descriptor index i
 #define INDEX2DATA(i)	((char*) (FILEDATA + (i)*PGSIZE))
 
+// A bit for each fd that we have seen in use, and a bit for each word
+// of those that is full, so fd_alloc finds a free fd in a couple of
+// steps.  The page table stays the truth: fds can be opened behind the
+// bitmap's back, by dup or by inheriting them, so fd_alloc checks each
+// candidate it finds, and the bitmap is rebuilt when it looks full.
+static uint64_t fdused[MAXFD / 64];
+static uint64_t fdfull;
+
 
 // --------------------------------------------------------------
 // File descriptor manipulators
@@ -32,6 +42,42 @@ fd2data(struct Fd *fd)
 	return INDEX2DATA(fd2num(fd));
 }
 
+static bool
+fd_mapped(struct Fd *fd)
+{
+	return (uvpd[VPD(fd)] & PTE_P) && (uvpt[PGNUM(fd)] & PTE_P);
+}
+
+static void
+fd_mark(int i, bool used)
+{
+	if (used)
+		fdused[i / 64] |= 1ULL << (i % 64);
+	else
+		fdused[i / 64] &= ~(1ULL << (i % 64));
+	if (fdused[i / 64] == ~0ULL)
+		fdfull |= 1ULL << (i / 64);
+	else
+		fdfull &= ~(1ULL << (i / 64));
+}
+
+// Rebuild the bitmap from the page table, skipping page tables that
+// map no fds at all.
+static void
+fd_resync(void)
+{
+	int i;
+
+	memset(fdused, 0, sizeof(fdused));
+	fdfull = 0;
+	for (i = 0; i < MAXFD; i++) {
+		if (!(uvpd[VPD(INDEX2FD(i))] & PTE_P))
+			i = ROUNDUP(i + 1, FDPERPT) - 1;
+		else if (uvpt[PGNUM(INDEX2FD(i))] & PTE_P)
+			fd_mark(i, 1);
+	}
+}
+
 // Finds the smallest i from 0 to MAXFD-1 that doesn't have
 // its fd page mapped.
 // Sets *fd_store to the corresponding fd page virtual address.
@@ -42,23 +88,29 @@ fd2data(struct Fd *fd)
 // without allocating the first page we return, we'll return the same
 // page the second time.
 //
-// Hint: Use INDEX2FD.
-//
 // Returns 0 on success, < 0 on error.  Errors are:
 //	-E_MAX_FD: no more file descriptors
 // On error, *fd_store is set to 0.
 int
 fd_alloc(struct Fd **fd_store)
 {
-	int i;
-	struct Fd *fd;
-
-	for (i = 0; i < MAXFD; i++) {
-		fd = INDEX2FD(i);
-		if ((uvpd[VPD(fd)] & PTE_P) == 0 || (uvpt[PGNUM(fd)] & PTE_P) == 0) {
-			*fd_store = fd;
-			return 0;
+	int i, w, pass;
+	uint64_t allfull = (MAXFD / 64 == 64) ? ~0ULL : (1ULL << (MAXFD / 64)) - 1;
+
+	static_assert(MAXFD % 64 == 0 && MAXFD / 64 <= 64);
+	for (pass = 0; pass < 2; pass++) {
+		while (fdfull != allfull) {
+			w = __builtin_ctzll(~fdfull);
+			i = w * 64 + __builtin_ctzll(~fdused[w]);
+			if (!fd_mapped(INDEX2FD(i))) {
+				*fd_store = INDEX2FD(i);
+				return 0;
+			}
+			fd_mark(i, 1);
 		}
+		// Every fd looks used, but some may have been closed
+		// without our noticing.
+		fd_resync();
 	}
 	*fd_store = 0;
 	return -E_MAX_OPEN;
@@ -106,6 +158,8 @@ fd_close(struct Fd *fd, bool must_exist)
 	if ((r = fd_lookup(fd2num(fd), &fd2)) < 0
 	    || fd != fd2)
 		return (must_exist ? r : 0);
+	if (fd->fd_dev_id == devfile.dev_id)
+		mmap_flush(fd);
 	if ((r = dev_lookup(fd->fd_dev_id, &dev)) >= 0) {
 		if (dev->dev_close)
 			r = (*dev->dev_close)(fd);
@@ -115,6 +169,7 @@ fd_close(struct Fd *fd, bool must_exist)
 	// Make sure fd is unmapped.  Might be a no-op if
 	// (*dev->dev_close)(fd) already unmapped it.
 	(void) sys_page_unmap(0, fd);
+	fd_mark(fd2num(fd), 0);
 	return r;
 }
 
@@ -129,6 +184,7 @@ static struct Dev *devtab[] =
 	&devsock,
 	&devpipe,
 	&devcons,
+	&devepoll,
 	0
 };
 
@@ -162,8 +218,17 @@ void
 close_all(void)
 {
 	int i;
-	for (i = 0; i < MAXFD; i++)
-		close(i);
+
+	// Write back every mapping, even those whose descriptors are
+	// already closed.
+	mmap_flush(NULL);
+	// Skip whole page tables of fds at a time if they are unmapped.
+	for (i = 0; i < MAXFD; i++) {
+		if (!(uvpd[VPD(INDEX2FD(i))] & PTE_P))
+			i = ROUNDUP(i + 1, FDPERPT) - 1;
+		else if (uvpt[PGNUM(INDEX2FD(i))] & PTE_P)
+			close(i);
+	}
 }
 
 // Make file descriptor 'newfdnum' a duplicate of file descriptor 'oldfdnum'.
@@ -181,6 +246,8 @@ dup(int oldfdnum, int newfdnum)
 
 	if ((r = fd_lookup(oldfdnum, &oldfd)) < 0)
 		return r;
+	if (newfdnum < 0 || newfdnum >= MAXFD)
+		return -E_INVAL;
 	close(newfdnum);
 
 	newfd = INDEX2FD(newfdnum);
@@ -193,6 +260,7 @@ dup(int oldfdnum, int newfdnum)
 	if ((r = sys_page_map(0, oldfd, 0, newfd, uvpt[PGNUM(oldfd)] & PTE_SYSCALL)) < 0)
 		goto err;
 
+	fd_mark(newfdnum, 1);
 	return newfdnum;
 
 err:
@@ -307,15 +375,43 @@ fstat(int fdnum, struct Stat *stat)
 	return (*dev->dev_stat)(fd, stat);
 }
 
+// Get (F_GETFL) or set (F_SETFL) the status flags of fdnum.  Only
+// O_NONBLOCK can be changed; the fd's dup()s and those of the
+// environments that share it see the change too.
 int
-stat(const char *path, struct Stat *stat)
+fcntl(int fdnum, int cmd, int arg)
 {
-	int fd, r;
+	int r;
+	struct Fd *fd;
 
-	if ((fd = open(path, O_RDONLY)) < 0)
-		return fd;
-	r = fstat(fd, stat);
-	close(fd);
-	return r;
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	switch (cmd) {
+	case F_GETFL:
+		return fd->fd_omode;
+	case F_SETFL:
+		fd->fd_omode = (fd->fd_omode & ~O_NONBLOCK) | (arg & O_NONBLOCK);
+		return 0;
+	default:
+		return -E_INVAL;
+	}
+}
+
+int
+stat(const char *path, struct Stat *stat)
+{
+	int f, st, r;
+
+	// Open, stat and close in one round trip to the file server.
+	fsbatch_begin();
+	if ((f = fsbatch_open(path)) < 0)
+		return f;
+	if ((st = fsbatch_stat(f, stat)) < 0 || (r = fsbatch_close(f)) < 0)
+		return -E_NO_MEM;
+	if ((r = fsbatch_submit()) < 0)
+		return r;
+	if ((r = fsbatch_result(-1 - f)) < 0)
+		return r;
+	return fsbatch_result(st);
 }
 
@@ -11,13 +11,13 @@
 union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 
 // Send an inter-environment request to the file server, and wait for
-// a reply.  The request body should be in fsipcbuf, and parts of the
-// response may be written back to fsipcbuf.
+// a reply.  The request body should be in 'req', and parts of the
+// response may be written back to 'req'.
 // type: request code, passed as the simple integer IPC value.
 // dstva: virtual address at which to receive reply page, 0 if none.
 // Returns result from the file server.
 static int
-fsipc(unsigned type, void *dstva)
+fsipc_page(unsigned type, union Fsipc *req, void *dstva)
 {
 	static envid_t fsenv;
 	if (fsenv == 0)
@@ -26,12 +26,19 @@ fsipc(unsigned type, void *dstva)
 	//static_assert(sizeof(fsipcbuf) == PGSIZE);
 
 	if (debug)
-		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *)&fsipcbuf);
+		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *)req);
 
-	ipc_send(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U);
+	ipc_send(fsenv, type, req, PTE_P | PTE_W | PTE_U);
 	return ipc_recv(NULL, dstva, NULL);
 }
 
+// fsipc_page with the request in fsipcbuf.
+static int
+fsipc(unsigned type, void *dstva)
+{
+	return fsipc_page(type, &fsipcbuf, dstva);
+}
+
 static int devfile_flush(struct Fd *fd);
 static ssize_t devfile_read(struct Fd *fd, void *buf, size_t n);
 static ssize_t devfile_write(struct Fd *fd, const void *buf, size_t n);
@@ -91,6 +98,13 @@ devfile_flush(struct Fd *fd)
 	return fsipc(FSREQ_FLUSH, NULL);
 }
 
+// Flush the file without closing it.
+int
+devfile_sync(struct Fd *fd)
+{
+	return devfile_flush(fd);
+}
+
 // Read at most 'n' bytes from 'fd' at the current position into 'buf'.
 //
 // Returns:
@@ -107,6 +121,71 @@ devfile_read(struct Fd *fd, void *buf, size_t n)
 	panic("devfile_read not implemented");
 }
 
+// Map the block of file 'fdnum' starting at 'offset', which must be a
+// multiple of BLKSIZE, read-only at 'dstva'.  The page is the file
+// server's own block cache page, so nothing is copied; it stays mapped
+// until the caller unmaps it or maps something else there.
+//
+// Returns:
+// 	The number of valid bytes at dstva, 0 at end of file.
+// 	-E_INVAL if 'fdnum' is not an open file.
+// 	< 0 on other errors.
+ssize_t
+read_map(int fdnum, off_t offset, void *dstva)
+{
+	struct Fd *fd;
+	int r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_INVAL;
+	fsipcbuf.read_map.req_fileid = fd->fd_file.id;
+	fsipcbuf.read_map.req_offset = offset;
+	return fsipc(FSREQ_READ_MAP, dstva);
+}
+
+// Like read, but instead of copying, map the block of file 'fdnum'
+// holding the current seek position read-only at 'dstva', as read_map
+// does, and set *pbuf to that position within it.  The seek position
+// moves past the bytes returned.
+//
+// Returns:
+// 	The number of bytes at *pbuf, 0 at end of file.
+// 	-E_INVAL if 'fdnum' is not an open file.
+// 	< 0 on other errors.
+ssize_t
+read_mapped(int fdnum, void *dstva, void **pbuf)
+{
+	struct Fd *fd;
+	off_t skip;
+	ssize_t n;
+	int r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	skip = fd->fd_offset % BLKSIZE;
+	if ((n = read_map(fdnum, fd->fd_offset - skip, dstva)) <= skip)
+		return n < 0 ? n : 0;
+	*pbuf = (char *) dstva + skip;
+	fd->fd_offset += n - skip;
+	return n - skip;
+}
+
+// Ask the file server to map the block of the open file 'fd' at
+// 'offset' at 'dstva', as mmap's page fault handler needs it.  With
+// FSMAP_DIRTY in 'flags', tell the server we wrote to our mapping of
+// the block instead.  Returns -E_EOF if the block is past the end of
+// the file.
+int
+devfile_map(struct Fd *fd, off_t offset, int flags, void *dstva)
+{
+	fsipcbuf.map.req_fileid = fd->fd_file.id;
+	fsipcbuf.map.req_offset = offset;
+	fsipcbuf.map.req_flags = flags;
+	return fsipc(FSREQ_MAP, dstva);
+}
+
 // Write at most 'n' bytes from 'buf' to 'fd' at the current seek position.
 //
 // Returns:
@@ -146,6 +225,187 @@ devfile_trunc(struct Fd *fd, off_t newsize)
 	return fsipc(FSREQ_SET_SIZE, NULL);
 }
 
+// Batched requests.  Several read-only sub-requests are queued in a
+// page of their own with fsbatch_open, fsbatch_stat, fsbatch_read and
+// fsbatch_close, then fsbatch_submit sends them all to the file server
+// in a single round trip and copies their output to the callers'
+// buffers.  The sub-request functions return the sub-request's index,
+// which fsbatch_result takes, or < 0 if the batch is full.
+static union Fsipc batchbuf __attribute__((aligned(PGSIZE)));
+static void *batchout[FSBATCH_MAXOPS];
+static uint32_t batchdata;
+
+// Start a new, empty batch.
+void
+fsbatch_begin(void)
+{
+	batchbuf.batch.req_nops = 0;
+	batchdata = 0;
+}
+
+// Queue sub-request 'op', reserving 'n' bytes of data for it.
+static int
+fsbatch_add(int op, int file, uint32_t off, uint32_t len, uint32_t n,
+	    void *out)
+{
+	struct Fsbatch_op *o;
+	struct Fd *fd;
+	int r;
+
+	if (batchbuf.batch.req_nops == FSBATCH_MAXOPS
+	    || n > sizeof(batchbuf.batch.req_data) - batchdata)
+		return -E_NO_MEM;
+	// Files are named by fd number, or by the FSBATCH_SLOT that
+	// fsbatch_open returned.
+	if (file >= 0) {
+		if ((r = fd_lookup(file, &fd)) < 0)
+			return r;
+		if (fd->fd_dev_id != devfile.dev_id)
+			return -E_INVAL;
+		file = fd->fd_file.id;
+	}
+	o = &batchbuf.batch.req_ops[batchbuf.batch.req_nops];
+	o->op = op;
+	o->file = file;
+	o->off = off;
+	o->len = len;
+	o->buf = batchdata;
+	o->result = -E_INVAL;
+	batchout[batchbuf.batch.req_nops] = out;
+	batchdata += ROUNDUP(n, 8);
+	return batchbuf.batch.req_nops++;
+}
+
+// Queue opening 'path' read-only.  Returns the FSBATCH_SLOT that
+// later sub-requests in the batch use to refer to the file.
+int
+fsbatch_open(const char *path)
+{
+	int i;
+
+	if (strlen(path) >= MAXPATHLEN)
+		return -E_BAD_PATH;
+	if ((i = fsbatch_add(FSBATCH_OPEN, -1, batchdata, O_RDONLY,
+			     strlen(path) + 1, NULL)) < 0)
+		return i;
+	strcpy(batchbuf.batch.req_data + batchbuf.batch.req_ops[i].buf, path);
+	return FSBATCH_SLOT(i);
+}
+
+int
+fsbatch_stat(int file, struct Stat *st)
+{
+	return fsbatch_add(FSBATCH_STAT, file, 0, 0,
+			   sizeof(struct Fsret_stat), st);
+}
+
+int
+fsbatch_read(int file, off_t offset, void *buf, size_t n)
+{
+	return fsbatch_add(FSBATCH_READ, file, offset, n, n, buf);
+}
+
+int
+fsbatch_close(int file)
+{
+	return fsbatch_add(FSBATCH_CLOSE, file, 0, 0, 0, NULL);
+}
+
+// Send the batch.  Returns 0 if the file server ran it, < 0 otherwise;
+// the results of the individual sub-requests come from fsbatch_result.
+int
+fsbatch_submit(void)
+{
+	struct Fsbatch_op *o;
+	struct Fsret_stat *ret;
+	struct Stat *st;
+	char *data = batchbuf.batch.req_data;
+	int i, r;
+
+	if ((r = fsipc_page(FSREQ_BATCH, &batchbuf, NULL)) < 0)
+		return r;
+	for (i = 0; i < batchbuf.batch.req_nops; i++) {
+		o = &batchbuf.batch.req_ops[i];
+		if (o->result < 0)
+			continue;
+		if (o->op == FSBATCH_STAT) {
+			ret = (struct Fsret_stat *) (data + o->buf);
+			st = batchout[i];
+			strcpy(st->st_name, ret->ret_name);
+			st->st_size = ret->ret_size;
+			st->st_isdir = ret->ret_isdir;
+			st->st_dev = &devfile;
+		} else if (o->op == FSBATCH_READ)
+			memmove(batchout[i], data + o->buf, o->result);
+	}
+	return 0;
+}
+
+// The result of sub-request 'i' of the last batch submitted.
+int
+fsbatch_result(int i)
+{
+	if (i < 0 || i >= batchbuf.batch.req_nops)
+		return -E_INVAL;
+	return batchbuf.batch.req_ops[i].result;
+}
+
+// Read up to 'n' bytes of the file 'path' into 'buf' in a single
+// round trip to the file server, if they fit in a batch.
+// Returns the number of bytes read, or < 0 on error.
+ssize_t
+readfile(const char *path, void *buf, size_t n)
+{
+	int f, fd, rd, r;
+	size_t chunk = sizeof(batchbuf.batch.req_data) - MAXPATHLEN;
+
+	fsbatch_begin();
+	if ((f = fsbatch_open(path)) < 0
+	    || (rd = fsbatch_read(f, 0, buf, MIN(n, chunk))) < 0
+	    || fsbatch_close(f) < 0)
+		return -E_NO_MEM;
+	if ((r = fsbatch_submit()) < 0)
+		return r;
+	if ((r = fsbatch_result(-1 - f)) < 0)
+		return r;
+	if ((r = fsbatch_result(rd)) < 0 || r < MIN(n, chunk) || n <= chunk)
+		return r;
+
+	// Too big for one batch; read the rest the usual way.
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return fd;
+	if ((r = seek(fd, chunk)) >= 0)
+		r = readn(fd, (char *) buf + chunk, n - chunk);
+	close(fd);
+	return r < 0 ? r : chunk + r;
+}
+
+// Create 'path' as a copy-on-write overlay of the file 'backing'.  It
+// shares backing's blocks until they are written, so it is created in
+// constant time however large backing is.  backing becomes read-only
+// until all its overlays are removed.
+int
+overlay(const char *path, const char *backing)
+{
+	if (strlen(path) >= MAXPATHLEN || strlen(backing) >= MAXPATHLEN)
+		return -E_BAD_PATH;
+	strcpy(fsipcbuf.overlay.req_path, path);
+	strcpy(fsipcbuf.overlay.req_backing, backing);
+	return fsipc(FSREQ_OVERLAY, NULL);
+}
+
+// Fetch the file server's counters.
+int
+fsstats(struct Fsret_stats *st)
+{
+	int r;
+
+	if ((r = fsipc(FSREQ_STATS, NULL)) < 0)
+		return r;
+	*st = fsipcbuf.statsRet;
+	return 0;
+}
+
 // Delete a file
 int
 remove(const char *path)
@@ -172,9 +432,10 @@ copy(char *src, char *dest)
 {
 	int r;
 	int fd_src, fd_dest;
-	char buffer[512];	//keep this small
+	// Copy a block at a time; disk images are large.
+	static char buffer[BLKSIZE];
 	ssize_t read_size;
-	ssize_t write_size;
+	ssize_t write_size, n;
 	fd_src = open(src, O_RDONLY);
 	if (fd_src < 0) {	//error
 		cprintf("cp open src error:%e\n", fd_src);
@@ -188,13 +449,18 @@ copy(char *src, char *dest)
 		return fd_dest;
 	}
 	
-	while ((read_size = read(fd_src, buffer, 512)) > 0) {
-		write_size = write(fd_dest, buffer, read_size);
-		if (write_size < 0) {
-			cprintf("cp write error:%e\n", write_size);
+	while ((read_size = read(fd_src, buffer, sizeof(buffer))) > 0) {
+		// write may write fewer bytes than asked.
+		for (n = 0; n < read_size; n += write_size)
+			if ((write_size = write(fd_dest, buffer + n,
+						read_size - n)) <= 0)
+				break;
+		if (write_size <= 0) {
+			r = write_size < 0 ? write_size : -E_NO_DISK;
+			cprintf("cp write error:%e\n", r);
 			close(fd_src);
 			close(fd_dest);
-			return write_size;
+			return r;
 		}		
 	}
 	if (read_size < 0) {
@@ -0,0 +1,239 @@
+// Memory-mapped files.
+//
+// Each mapping gets its own window of the address space, much like each
+// file descriptor gets its own Fd page.  Pages are mapped on demand by
+// a page fault handler that asks the file server for the block cache
+// page behind them (FSREQ_MAP), so reading a mapped file copies
+// nothing.  MAP_SHARED writable mappings write straight into the block
+// cache; msync and munmap tell the server which pages we dirtied and
+// flush the file, and so do close and exit (see mmap_flush).  MAP_PRIVATE mappings copy a page the first time it
+// is written.
+
+#include <inc/lib.h>
+
+#define debug		0
+
+// Maximum number of mappings a program may have at once
+#define MAXMMAP		16
+// Size of each mapping's window
+#define MMAPSIZE	(64 * 1024 * 1024)
+// Bottom of the mapping windows
+#define MMAPBASE	0x100000000
+// Each mapping keeps the file open by mapping its Fd page here.
+#define MMAPFDS		(MMAPBASE - MAXMMAP * PGSIZE)
+
+#define INDEX2MAP(i)	(MMAPBASE + ((uintptr_t) (i)) * MMAPSIZE)
+#define INDEX2MAPFD(i)	((struct Fd*) (MMAPFDS + ((uintptr_t) (i)) * PGSIZE))
+
+struct Mapping {
+	size_t m_len;
+	off_t m_offset;		// File offset of the window's first page
+	int m_prot;
+	int m_flags;
+};
+
+static struct Mapping maps[MAXMMAP];
+static void (*prev_pgfault_handler)(struct UTrapframe *utf);
+
+extern void (*_pgfault_handler)(struct UTrapframe *utf);
+
+static bool
+va_mapped(uintptr_t va)
+{
+	return (uvpml4e[VPML4E(va)] & PTE_P) && (uvpde[VPDPE(va)] & PTE_P)
+		&& (uvpd[VPD(va)] & PTE_P) && (uvpt[PGNUM(va)] & PTE_P);
+}
+
+// Find the mapping containing va.  Returns its index, or -1.
+static int
+mapping_lookup(uintptr_t va)
+{
+	int i;
+
+	if (va < MMAPBASE || va >= INDEX2MAP(MAXMMAP))
+		return -1;
+	i = (va - MMAPBASE) / MMAPSIZE;
+	if (!va_mapped((uintptr_t) INDEX2MAPFD(i))
+	    || va >= INDEX2MAP(i) + maps[i].m_len)
+		return -1;
+	return i;
+}
+
+static void
+mmap_pgfault(struct UTrapframe *utf)
+{
+	uintptr_t va = ROUNDDOWN(utf->utf_fault_va, PGSIZE);
+	bool write = utf->utf_err & FEC_WR;
+	struct Mapping *m;
+	off_t offset;
+	int i, r, flags;
+
+	if ((i = mapping_lookup(va)) < 0) {
+		if (prev_pgfault_handler) {
+			prev_pgfault_handler(utf);
+			return;
+		}
+		panic("page fault at %08x, rip %08x", utf->utf_fault_va,
+		      utf->utf_rip);
+	}
+	m = &maps[i];
+	if (write && !(m->m_prot & PROT_WRITE))
+		panic("write to read-only mapping at %08x", utf->utf_fault_va);
+	offset = m->m_offset + (va - INDEX2MAP(i));
+
+	if (!va_mapped(va)) {
+		flags = 0;
+		if ((m->m_prot & PROT_WRITE) && (m->m_flags & MAP_SHARED))
+			flags = FSMAP_WRITE;
+		r = devfile_map(INDEX2MAPFD(i), offset, flags, (void *) va);
+		// Past the end of the file, the mapping reads as zeroes.
+		// Any other error is a real fault: carrying on with a
+		// private page would silently drop writes to the file.
+		if (r == -E_EOF && !va_mapped(va))
+			r = sys_page_alloc(0, (void *) va, PTE_P|PTE_U|PTE_W);
+		if (r < 0)
+			panic("mmap fault at %08x: %e", utf->utf_fault_va, r);
+		if (debug)
+			cprintf("mmap fault %08x -> offset %08x\n", va, offset);
+	}
+
+	// Give a private mapping its own copy of a page on first write.
+	if (write && !(uvpt[PGNUM(va)] & PTE_W)) {
+		if ((r = sys_page_alloc(0, PFTEMP, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("mmap sys_page_alloc: %e", r);
+		memmove(PFTEMP, (void *) va, PGSIZE);
+		if ((r = sys_page_map(0, PFTEMP, 0, (void *) va,
+				      PTE_P|PTE_U|PTE_W)) < 0)
+			panic("mmap sys_page_map: %e", r);
+		sys_page_unmap(0, PFTEMP);
+	}
+}
+
+// Map 'len' bytes of open file 'fdnum' starting at 'offset', which must
+// be page-aligned.  'prot' is PROT_READ, optionally with PROT_WRITE;
+// 'flags' is MAP_SHARED or MAP_PRIVATE.  'addr' is only a hint and is
+// ignored.  The file may be closed once it is mapped.
+//
+// Returns the address of the mapping, or MAP_FAILED.
+void *
+mmap(void *addr, size_t len, int prot, int flags, int fdnum, off_t offset)
+{
+	struct Fd *fd;
+	int i, mode;
+
+	if (fd_lookup(fdnum, &fd) < 0 || fd->fd_dev_id != devfile.dev_id)
+		return MAP_FAILED;
+	if (len == 0 || len > MMAPSIZE || offset < 0 || offset % PGSIZE)
+		return MAP_FAILED;
+	if ((flags & (MAP_SHARED|MAP_PRIVATE)) == 0
+	    || (flags & (MAP_SHARED|MAP_PRIVATE)) == (MAP_SHARED|MAP_PRIVATE))
+		return MAP_FAILED;
+	mode = fd->fd_omode & O_ACCMODE;
+	if (mode == O_WRONLY
+	    || ((prot & PROT_WRITE) && (flags & MAP_SHARED) && mode != O_RDWR))
+		return MAP_FAILED;
+
+	for (i = 0; i < MAXMMAP; i++)
+		if (!va_mapped((uintptr_t) INDEX2MAPFD(i)))
+			break;
+	if (i == MAXMMAP)
+		return MAP_FAILED;
+	if (sys_page_map(0, fd, 0, INDEX2MAPFD(i),
+			 uvpt[PGNUM(fd)] & PTE_SYSCALL) < 0)
+		return MAP_FAILED;
+	maps[i].m_len = ROUNDUP(len, PGSIZE);
+	maps[i].m_offset = offset;
+	maps[i].m_prot = prot;
+	maps[i].m_flags = flags;
+
+	if (_pgfault_handler != mmap_pgfault) {
+		prev_pgfault_handler = _pgfault_handler;
+		set_pgfault_handler(mmap_pgfault);
+	}
+	return (void *) INDEX2MAP(i);
+}
+
+// Tell the file server about the dirty pages of mapping i in
+// [va, end).  Returns the number of pages, or < 0 on error.
+static int
+mapping_writeback(int i, uintptr_t va, uintptr_t end)
+{
+	struct Mapping *m = &maps[i];
+	int n = 0, r, perm;
+
+	if (!(m->m_flags & MAP_SHARED) || !(m->m_prot & PROT_WRITE))
+		return 0;
+	end = MIN(end, INDEX2MAP(i) + m->m_len);
+
+	for (; va < end; va += PGSIZE) {
+		if (!va_mapped(va) || !(uvpt[PGNUM(va)] & PTE_D)
+		    || !(uvpt[PGNUM(va)] & PTE_SHARE))
+			continue;
+		if ((r = devfile_map(INDEX2MAPFD(i), m->m_offset + (va - INDEX2MAP(i)),
+				     FSMAP_DIRTY, 0)) < 0)
+			return r;
+		// Remapping clears PTE_D.
+		perm = uvpt[PGNUM(va)] & PTE_SYSCALL;
+		if ((r = sys_page_map(0, (void *) va, 0, (void *) va, perm)) < 0)
+			return r;
+		n++;
+	}
+	return n;
+}
+
+// Write the dirty pages of the shared mapping in [addr, addr+len) back
+// to the file.
+int
+msync(void *addr, size_t len)
+{
+	uintptr_t va = ROUNDDOWN((uintptr_t) addr, PGSIZE);
+	int i, r;
+
+	if ((i = mapping_lookup(va)) < 0)
+		return -E_INVAL;
+	if (!(maps[i].m_flags & MAP_SHARED) || !(maps[i].m_prot & PROT_WRITE))
+		return 0;
+	if ((r = mapping_writeback(i, va, (uintptr_t) addr + len)) < 0)
+		return r;
+	return devfile_sync(INDEX2MAPFD(i));
+}
+
+// Write back the dirty pages of every shared mapping of the open file
+// 'fd', or of every mapping if fd is NULL, flushing the files that had
+// any.  close calls this for each file and close_all for all of them,
+// so that writes through a mapping reach the file even if the program
+// exits without msync or munmap.
+void
+mmap_flush(struct Fd *fd)
+{
+	int i;
+
+	for (i = 0; i < MAXMMAP; i++) {
+		if (!va_mapped((uintptr_t) INDEX2MAPFD(i)))
+			continue;
+		if (fd && PTE_ADDR(uvpt[PGNUM(fd)])
+		    != PTE_ADDR(uvpt[PGNUM(INDEX2MAPFD(i))]))
+			continue;
+		if (mapping_writeback(i, INDEX2MAP(i), INDEX2MAP(i) + maps[i].m_len) > 0)
+			(void) devfile_sync(INDEX2MAPFD(i));
+	}
+}
+
+// Remove the mapping starting at 'addr', writing back dirty shared
+// pages first.  Only whole mappings can be unmapped.
+int
+munmap(void *addr, size_t len)
+{
+	uintptr_t va = (uintptr_t) addr;
+	int i, r;
+
+	if ((i = mapping_lookup(va)) < 0 || va != INDEX2MAP(i)
+	    || ROUNDUP(len, PGSIZE) != maps[i].m_len)
+		return -E_INVAL;
+	if ((r = msync(addr, len)) < 0)
+		return r;
+	for (; va < INDEX2MAP(i) + maps[i].m_len; va += PGSIZE)
+		if (va_mapped(va))
+			sys_page_unmap(0, (void *) va);
+	return sys_page_unmap(0, INDEX2MAPFD(i));
+}
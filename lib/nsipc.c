@@ -8,34 +8,68 @@
 #define REQVA		0x0ffff000
 union Nsipc nsipcbuf __attribute__((aligned(PGSIZE)));
 
-// Send an IP request to the network server, and wait for a reply.
+// Environment ids of the network server's instances; see NS_NSHARDS.
+static envid_t nsenv[NS_MAXSHARDS];
+
+#if NS_NSHARDS > 1
+// Instance 0 lists the others here, so as not to overwrite a request
+// that is already in nsipcbuf.
+static union Nsipc shardsbuf __attribute__((aligned(PGSIZE)));
+#endif
+
+static envid_t
+shard_env(int shard)
+{
+	if (nsenv[0] == 0) {
+		nsenv[0] = ipc_find_env(ENV_TYPE_NS);
+#if NS_NSHARDS > 1
+		ipc_send(nsenv[0], NSREQ_SHARDS, &shardsbuf, PTE_P|PTE_W|PTE_U);
+		if (ipc_recv(NULL, NULL, NULL) >= 0)
+			memmove(nsenv, shardsbuf.shardsRet.ret_envid, sizeof(nsenv));
+#endif
+	}
+	return nsenv[shard];
+}
+
+// Send an IP request to instance 'shard' of the network server, and
+// wait for a reply.
 // The request body should be in nsipcbuf, and parts of the response
 // may be written back to nsipcbuf.
 // type: request code, passed as the simple integer IPC value.
 // Returns 0 if successful, < 0 on failure.
 static int
-nsipc(unsigned type)
+nsipc(int shard, unsigned type)
 {
-	static envid_t nsenv;
-	if (nsenv == 0)
-		nsenv = ipc_find_env(ENV_TYPE_NS);
+	envid_t to = shard_env(shard);
 
 	static_assert(sizeof(nsipcbuf) == PGSIZE);
 
 	if (debug)
-		cprintf("[%08x] nsipc %d\n", thisenv->env_id, type);
+		cprintf("[%08x] nsipc %d to %08x\n", thisenv->env_id, type, to);
 
-	ipc_send(nsenv, type, &nsipcbuf, PTE_P|PTE_W|PTE_U);
+	ipc_send(to, type, &nsipcbuf, PTE_P|PTE_W|PTE_U);
 	return ipc_recv(NULL, NULL, NULL);
 }
 
+static int
+socket_on(int shard, int domain, int type, int protocol)
+{
+	nsipcbuf.socket.req_domain = domain;
+	nsipcbuf.socket.req_type = type;
+	nsipcbuf.socket.req_protocol = protocol;
+	return nsipc(shard, NSREQ_SOCKET);
+}
+
 int
-nsipc_accept(int s, struct sockaddr *addr, socklen_t *addrlen)
+nsipc_accept(int s, struct sockaddr *addr, socklen_t *addrlen,
+	     unsigned int flags)
 {
 	int r;
 
+	// Instance 0 serves every listening socket's accept queue.
 	nsipcbuf.accept.req_s = s;
-	if ((r = nsipc(NSREQ_ACCEPT)) >= 0) {
+	nsipcbuf.accept.req_flags = flags;
+	if ((r = nsipc(0, NSREQ_ACCEPT)) >= 0) {
 		struct Nsret_accept *ret = &nsipcbuf.acceptRet;
 		memmove(addr, &ret->ret_addr, ret->ret_addrlen);
 		*addrlen = ret->ret_addrlen;
@@ -49,7 +83,7 @@ nsipc_bind(int s, struct sockaddr *name, socklen_t namelen)
 	nsipcbuf.bind.req_s = s;
 	memmove(&nsipcbuf.bind.req_name, name, namelen);
 	nsipcbuf.bind.req_namelen = namelen;
-	return nsipc(NSREQ_BIND);
+	return nsipc(NS_SOCKSHARD(s), NSREQ_BIND);
 }
 
 int
@@ -57,14 +91,14 @@ nsipc_shutdown(int s, int how)
 {
 	nsipcbuf.shutdown.req_s = s;
 	nsipcbuf.shutdown.req_how = how;
-	return nsipc(NSREQ_SHUTDOWN);
+	return nsipc(NS_SOCKSHARD(s), NSREQ_SHUTDOWN);
 }
 
 int
 nsipc_close(int s)
 {
 	nsipcbuf.close.req_s = s;
-	return nsipc(NSREQ_CLOSE);
+	return nsipc(NS_SOCKSHARD(s), NSREQ_CLOSE);
 }
 
 int
@@ -73,15 +107,110 @@ nsipc_connect(int s, const struct sockaddr *name, socklen_t namelen)
 	nsipcbuf.connect.req_s = s;
 	memmove(&nsipcbuf.connect.req_name, name, namelen);
 	nsipcbuf.connect.req_namelen = namelen;
-	return nsipc(NSREQ_CONNECT);
+	return nsipc(NS_SOCKSHARD(s), NSREQ_CONNECT);
 }
 
 int
 nsipc_listen(int s, int backlog)
 {
+	struct sockaddr name;
+	socklen_t namelen;
+	int shard, q, ls, r;
+
 	nsipcbuf.listen.req_s = s;
 	nsipcbuf.listen.req_backlog = backlog;
-	return nsipc(NSREQ_LISTEN);
+	nsipcbuf.listen.req_queue = -1;
+	if ((r = nsipc(NS_SOCKSHARD(s), NSREQ_LISTEN)) < 0 || NS_NSHARDS == 1)
+		return r;
+
+	// Connections to the socket's address may hash to any instance,
+	// so listen on the same address on every other one too, feeding
+	// the same accept queue.  The instances close these sockets
+	// themselves when s is closed.
+	q = nsipcbuf.listenRet.ret_queue;
+	namelen = nsipcbuf.listenRet.ret_namelen;
+	memmove(&name, &nsipcbuf.listenRet.ret_name, namelen);
+	for (shard = 0; shard < NS_NSHARDS; shard++) {
+		if (shard == NS_SOCKSHARD(s))
+			continue;
+		if ((ls = socket_on(shard, AF_INET, SOCK_STREAM, 0)) < 0)
+			return ls;
+		if ((r = nsipc_bind(ls, &name, namelen)) >= 0) {
+			nsipcbuf.listen.req_s = ls;
+			nsipcbuf.listen.req_backlog = backlog;
+			nsipcbuf.listen.req_queue = q;
+			r = nsipc(shard, NSREQ_LISTEN);
+		}
+		if (r < 0) {
+			nsipc_close(ls);
+			return r;
+		}
+	}
+	return 0;
+}
+
+// Poll those of the sockets in fds that belong to instance 'shard'.
+// With no sockets at all, the instance still waits out the timeout,
+// so that a poll of nothing sleeps rather than returning at once.
+static int
+poll_on(int shard, struct lwip_pollfd *fds, int nfds, int timeout)
+{
+	struct Nsreq_poll *req = &nsipcbuf.poll;
+	int i, n, r;
+
+	for (i = n = 0; i < nfds; i++)
+		if (NS_SOCKSHARD(fds[i].fd) == shard)
+			req->req_fds[n++] = fds[i];
+	if (n == 0 && (nfds > 0 || timeout == 0))
+		return 0;
+	req->req_nfds = n;
+	req->req_timeout = timeout;
+	if ((r = nsipc(shard, NSREQ_POLL)) < 0)
+		return r;
+	for (i = n = 0; i < nfds; i++)
+		if (NS_SOCKSHARD(fds[i].fd) == shard) {
+			fds[i].revents = req->req_fds[n].revents;
+			fds[i].seq = req->req_fds[n++].seq;
+		}
+	return r;
+}
+
+// Wait for at most 'timeout' milliseconds, or forever if it is
+// negative, until one of the sockets in fds has one of the events it
+// asks for, and fill in the revents of each.  The fd field of each
+// entry is a socket id.
+// Returns the number of sockets with events, or < 0 on error.
+int
+nsipc_poll(struct lwip_pollfd *fds, int nfds, int timeout)
+{
+	uint32_t deadline = sys_time_msec() + timeout;
+	int i, shard, wait, r, nready;
+
+	if (nfds < 0 || nfds > NSPOLL_MAX)
+		return -E_INVAL;
+	for (i = 1; i < nfds; i++)
+		if (NS_SOCKSHARD(fds[i].fd) != NS_SOCKSHARD(fds[0].fd))
+			break;
+	if (i >= nfds)
+		return poll_on(nfds ? NS_SOCKSHARD(fds[0].fd) : 0,
+			       fds, nfds, timeout);
+
+	// No instance can wait for another's sockets, so wait on each
+	// in turn for a slice of the time.
+	while (1) {
+		nready = 0;
+		for (shard = 0; shard < NS_NSHARDS; shard++) {
+			wait = nready || timeout == 0 ? 0 : NSPOLL_SLICE;
+			if (timeout > 0)
+				wait = MIN(wait, MAX((int32_t) (deadline - sys_time_msec()), 0));
+			if ((r = poll_on(shard, fds, nfds, wait)) < 0)
+				return r;
+			nready += r;
+		}
+		if (nready || timeout == 0
+		    || (timeout > 0 && (int32_t) (deadline - sys_time_msec()) <= 0))
+			return nready;
+	}
 }
 
 int
@@ -93,7 +222,7 @@ nsipc_recv(int s, void *mem, int len, unsigned int flags)
 	nsipcbuf.recv.req_len = len;
 	nsipcbuf.recv.req_flags = flags;
 
-	if ((r = nsipc(NSREQ_RECV)) >= 0) {
+	if ((r = nsipc(NS_SOCKSHARD(s), NSREQ_RECV)) >= 0) {
 		assert(r < 1600 && r <= len);
 		memmove(mem, nsipcbuf.recvRet.ret_buf, r);
 	}
@@ -109,14 +238,21 @@ nsipc_send(int s, const void *buf, int size, unsigned int flags)
 	memmove(&nsipcbuf.send.req_buf, buf, size);
 	nsipcbuf.send.req_size = size;
 	nsipcbuf.send.req_flags = flags;
-	return nsipc(NSREQ_SEND);
+	return nsipc(NS_SOCKSHARD(s), NSREQ_SEND);
 }
 
 int
 nsipc_socket(int domain, int type, int protocol)
 {
-	nsipcbuf.socket.req_domain = domain;
-	nsipcbuf.socket.req_type = type;
-	nsipcbuf.socket.req_protocol = protocol;
-	return nsipc(NSREQ_SOCKET);
+	static int next_shard = -1;
+	int shard = 0;
+
+	// Spread TCP sockets over the instances; everything else is
+	// instance 0's.
+	if (NS_NSHARDS > 1 && type == SOCK_STREAM) {
+		if (next_shard < 0)
+			next_shard = ENVX(thisenv->env_id);
+		shard = next_shard++ % NS_NSHARDS;
+	}
+	return socket_on(shard, domain, type, protocol);
 }
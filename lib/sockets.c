@@ -29,6 +29,13 @@ fd2sockid(int fd)
 	return sfd->fd_sock.sockid;
 }
 
+// MSG_DONTWAIT if socket fd 'sfd' is non-blocking, for nsipc flags.
+static unsigned int
+sockfd_flags(struct Fd *sfd)
+{
+	return (sfd->fd_omode & O_NONBLOCK) ? MSG_DONTWAIT : 0;
+}
+
 static int
 alloc_sockfd(int sockid)
 {
@@ -50,10 +57,12 @@ alloc_sockfd(int sockid)
 int
 accept(int s, struct sockaddr *addr, socklen_t *addrlen)
 {
+	struct Fd *sfd;
 	int r;
 	if ((r = fd2sockid(s)) < 0)
 		return r;
-	if ((r = nsipc_accept(r, addr, addrlen)) < 0)
+	fd_lookup(s, &sfd);
+	if ((r = nsipc_accept(r, addr, addrlen, sockfd_flags(sfd))) < 0)
 		return r;
 	return alloc_sockfd(r);
 }
@@ -106,13 +115,38 @@ listen(int s, int backlog)
 static ssize_t
 devsock_read(struct Fd *fd, void *buf, size_t n)
 {
-	return nsipc_recv(fd->fd_sock.sockid, buf, n, 0);
+	return nsipc_recv(fd->fd_sock.sockid, buf, n, sockfd_flags(fd));
 }
 
 static ssize_t
 devsock_write(struct Fd *fd, const void *buf, size_t n)
 {
-	return nsipc_send(fd->fd_sock.sockid, buf, n, 0);
+	return nsipc_send(fd->fd_sock.sockid, buf, n, sockfd_flags(fd));
+}
+
+// Like read and write, but with MSG_* flags.  With MSG_DONTWAIT, or on
+// a socket set O_NONBLOCK with fcntl, a call that would wait returns
+// -E_AGAIN instead.
+ssize_t
+recv(int s, void *buf, size_t len, unsigned int flags)
+{
+	struct Fd *sfd;
+	int r;
+	if ((r = fd2sockid(s)) < 0)
+		return r;
+	fd_lookup(s, &sfd);
+	return nsipc_recv(r, buf, len, flags | sockfd_flags(sfd));
+}
+
+ssize_t
+send(int s, const void *buf, size_t len, unsigned int flags)
+{
+	struct Fd *sfd;
+	int r;
+	if ((r = fd2sockid(s)) < 0)
+		return r;
+	fd_lookup(s, &sfd);
+	return nsipc_send(r, buf, len, flags | sockfd_flags(sfd));
 }
 
 static int
@@ -130,3 +164,43 @@ socket(int domain, int type, int protocol)
 		return r;
 	return alloc_sockfd(r);
 }
+
+// Socket ids for poll: too many for the stack.
+static struct lwip_pollfd pollfds[NSPOLL_MAX];
+
+// Wait for at most 'timeout' milliseconds, or forever if it is
+// negative, until one of the sockets in fds has one of the events it
+// asks for.  Entries whose fd is negative are ignored; file descriptors
+// that are not sockets get POLLNVAL.
+// Returns the number of entries with events, or < 0 on error.
+int
+poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+	int i, n, r, nready = 0;
+
+	if (nfds > NSPOLL_MAX)
+		return -E_INVAL;
+	for (i = n = 0; i < nfds; i++) {
+		fds[i].revents = 0;
+		if (fds[i].fd < 0)
+			continue;
+		if ((r = fd2sockid(fds[i].fd)) < 0) {
+			fds[i].revents = POLLNVAL;
+			nready++;
+			continue;
+		}
+		pollfds[n].fd = r;
+		pollfds[n].events = fds[i].events & (POLLIN | POLLOUT);
+		pollfds[n].revents = 0;
+		pollfds[n++].seq = 0;
+	}
+	if ((r = nsipc_poll(pollfds, n, nready ? 0 : timeout)) < 0)
+		return r;
+	for (i = n = 0; i < nfds; i++) {
+		if (fds[i].fd < 0 || fds[i].revents)
+			continue;
+		if ((fds[i].revents = pollfds[n++].revents))
+			nready++;
+	}
+	return nready;
+}
@@ -135,6 +135,68 @@ envid_t
 sys_env_mkguest(uint64_t gphysz, uint64_t gRIP) {
 	return (envid_t) syscall(SYS_env_mkguest, 0, gphysz, gRIP, 0, 0, 0);
 }
+int64_t
+sys_dma_page_alloc(void *va, size_t npages, int perm)
+{
+	return syscall(SYS_dma_page_alloc, 0, (uint64_t) va, npages, perm, 0, 0);
+}
+
+int
+sys_dma_page_free(void *va, size_t npages)
+{
+	return syscall(SYS_dma_page_free, 0, (uint64_t) va, npages, 0, 0, 0);
+}
+
+int64_t
+sys_page_paddr(void *va)
+{
+	return syscall(SYS_page_paddr, 0, (uint64_t) va, 0, 0, 0, 0);
+}
+
+int
+sys_irq_wait(int irq)
+{
+	return syscall(SYS_irq_wait, 1, irq, 0, 0, 0, 0);
+}
+
+int
+sys_irq_notify(int irq)
+{
+	return syscall(SYS_irq_notify, 0, irq, 0, 0, 0, 0);
+}
+
+int
+sys_net_transmit(const void *buf, size_t len)
+{
+	return syscall(SYS_net_transmit, 0, (uint64_t) buf, len, 0, 0, 0);
+}
+
+int
+sys_net_transmit_sg(const struct net_frag *frags, int nfrags,
+		    const struct net_offload *off)
+{
+	return syscall(SYS_net_transmit_sg, 0, (uint64_t) frags, nfrags,
+		       (uint64_t) off, 0, 0);
+}
+
+int
+sys_net_receive(void *buf, size_t len)
+{
+	return syscall(SYS_net_receive, 0, (uint64_t) buf, len, 0, 0, 0);
+}
+
+int
+sys_net_receive_page(void *va)
+{
+	return syscall(SYS_net_receive_page, 0, (uint64_t) va, 0, 0, 0, 0);
+}
+
+int
+sys_net_wait(int what)
+{
+	return syscall(SYS_net_wait, 0, what, 0, 0, 0, 0);
+}
+
 #ifndef VMM_GUEST
 void
 sys_vmx_list_vms() {
@@ -1,16 +1,159 @@
 #include "ns.h"
+#include <lwip/inet.h>
+#include <lwip/ip.h>
+#include <lwip/tcp.h>
+#include <netif/etharp.h>
 
 extern union Nsipc nsipcbuf;
 
+// Set by the network server to pass packets through a ring at INRING(0)
+// rather than one NSREQ_INPUT page at a time.
+struct netring *input_ring;
+
+// Set by the network server when it runs as several instances, between
+// which input steers packets.
+struct ns_shared *ns_shared;
+
+// Block until a packet arrives, then map it at 'va' as a struct jif_pkt.
+static int
+receive(void *va)
+{
+    int r;
+
+    while ((r = sys_net_receive_page(va)) == -E_AGAIN)
+        if ((r = sys_net_wait(NET_RX)) < 0)
+            panic("sys_net_wait: %e", r);
+    if (r < 0)
+        panic("sys_net_receive_page: %e", r);
+    return r;
+}
+
+// Wait for room in 'ring', and return the page for its next entry.
+// While the ring is full, sleep until the network server frees an
+// entry and wakes us.
+static void *
+ring_slot(struct netring *ring, uintptr_t pages)
+{
+    while (ring->nr_prod - ring->nr_cons == NETRING_SIZE) {
+        ring->nr_wait = 1;
+        __sync_synchronize();
+        if (ring->nr_prod - ring->nr_cons != NETRING_SIZE
+            && __sync_bool_compare_and_swap(&ring->nr_wait, 1, 0))
+            break;
+        // the server took nr_wait, or will once it frees an entry
+        ipc_recv(NULL, NULL, NULL);
+    }
+    return (void *) (pages + (ring->nr_prod % NETRING_SIZE) * PGSIZE);
+}
+
+// Queue the entry that ring_slot returned, a 'len'-byte packet.
+static void
+ring_push(struct netring *ring, int len, envid_t ns_envid)
+{
+    uint32_t k = ring->nr_prod;
+
+    ring->nr_len[k % NETRING_SIZE] = len;
+    ring->nr_prod = k + 1;
+    __sync_synchronize();
+    if (!ring->nr_kick) {
+        ring->nr_kick = 1;
+        ipc_send(ns_envid, NSREQ_INPUT, 0, 0);
+    }
+}
+
+    static void
+input_batched(envid_t ns_envid, struct netring *ring)
+{
+    // Packets pile up in the ring while the network server is busy,
+    // and one IPC wakes it for however many it finds.
+    while (1)
+        ring_push(ring, receive(ring_slot(ring, INPAGES(0))), ns_envid);
+}
+
+// The network server instance that should see the frame in 'pkt', or
+// -1 for all of them.  TCP segments go to the instance that owns their
+// connection, and ARP replies to every instance, since each has its
+// own ARP table.  Everything else goes to instance 0, including IP
+// fragments, whose ports only the first fragment carries.
+static int
+steer(struct jif_pkt *pkt)
+{
+    struct eth_hdr *eth = (struct eth_hdr *) pkt->jp_data;
+    struct etharp_hdr *arp;
+    struct ip_hdr *iph;
+    struct tcp_hdr *tcph;
+
+    switch (ntohs(eth->type)) {
+    case ETHTYPE_ARP:
+        arp = (struct etharp_hdr *) eth;
+        return ntohs(arp->opcode) == ARP_REPLY ? -1 : 0;
+    case ETHTYPE_IP:
+        iph = (struct ip_hdr *) (eth + 1);
+        if (IPH_PROTO(iph) != IP_PROTO_TCP
+            || (IPH_OFFSET(iph) & htons(IP_OFFMASK | IP_MF)))
+            return 0;
+        tcph = (struct tcp_hdr *) ((uint8_t *) iph + IPH_HL(iph) * 4);
+        return ns_flow_shard(iph->src.addr, ntohs(tcph->src),
+                ntohs(tcph->dest));
+    default:
+        return 0;
+    }
+}
+
+// Receive each packet at INSCRATCH, then move it into the ring of the
+// instance that steer picks.  A packet for every instance is copied
+// for all but the last.  Instance 0 maps its packets from our own
+// INPAGES(0); the others are our children, so we map theirs into them.
+    static void
+input_steered(void)
+{
+    struct jif_pkt *pkt = (struct jif_pkt *) INSCRATCH;
+    struct netring *ring;
+    int len, shard, k, r;
+    envid_t dst;
+    void *va;
+
+    while (1) {
+        len = receive(pkt);
+        shard = steer(pkt);
+        for (k = 0; k < NS_NSHARDS; k++) {
+            if (shard >= 0 && k != shard)
+                continue;
+            ring = (struct netring *) INRING(k);
+            va = ring_slot(ring, INPAGES(k));
+            dst = k == 0 ? 0 : ns_shared->sh_shard[k];
+            if (shard < 0 && k < NS_NSHARDS - 1) {
+                if ((r = sys_page_alloc(0, (void *) INCOPY,
+                                        PTE_P|PTE_U|PTE_W)) < 0)
+                    panic("sys_page_alloc: %e", r);
+                memcpy((void *) INCOPY, pkt, sizeof(*pkt) + len);
+                r = sys_page_map(0, (void *) INCOPY, dst, va, PTE_P|PTE_U|PTE_W);
+                sys_page_unmap(0, (void *) INCOPY);
+            } else
+                r = sys_page_map(0, pkt, dst, va, PTE_P|PTE_U|PTE_W);
+            if (r < 0)
+                panic("sys_page_map: %e", r);
+            ring_push(ring, len, ns_shared->sh_shard[k]);
+        }
+    }
+}
+
     void
 input(envid_t ns_envid)
 {
     binaryname = "ns_input";
 
-    // LAB 6: Your code here:
-    // 	- read a packet from the device driver
-    //	- send it to the network server
-    // Hint: When you IPC a page to the network server, it will be
-    // reading from it for a while, so don't immediately receive
-    // another packet in to the same physical page.
+    // Drain every packet the card has, then sleep in sys_net_wait
+    // until the next receive interrupt, so that an idle network costs
+    // nothing.  sys_net_receive_page maps the page the card received
+    // the packet into, already laid out as a struct jif_pkt, so the
+    // packet reaches the network server without being copied.
+    if (ns_shared && NS_NSHARDS > 1)
+        input_steered();
+    if (input_ring)
+        input_batched(ns_envid, input_ring);
+    while (1) {
+        receive(&nsipcbuf);
+        ipc_send(ns_envid, NSREQ_INPUT, &nsipcbuf, PTE_P|PTE_U|PTE_W);
+    }
 }
@@ -70,8 +70,11 @@ struct lwip_socket {
   /** number of times data was received, set by event_callback(),
       tested by select */
   u16_t sendevent;
-  /** socket flags (currently, only used for O_NONBLOCK) */
+  /** socket flags (currently, only used for LWIP_O_NONBLOCK) */
   u16_t flags;
+  /** number of events that made the socket readable or writable, never 0;
+      set by event_callback(), tested by lwip_poll for LWIP_POLLET */
+  u32_t evseq;
   /** last error that occurred on this socket */
   int err;
 };
@@ -86,6 +89,10 @@ struct lwip_select_cb {
   fd_set *writeset;
   /** unimplemented: exceptset passed to select */
   fd_set *exceptset;
+  /** sockets passed to poll, if this is a poll rather than a select */
+  struct lwip_pollfd *poll_fds;
+  /** number of entries in poll_fds */
+  int poll_nfds;
   /** don't signal the same semaphore twice: set to 1 when signalled */
   int sem_signalled;
   /** semaphore to wake up a task waiting for select */
@@ -210,6 +217,13 @@ get_socket(int s)
  * @param newconn the netconn for which to allocate a socket
  * @return the index of the new socket; -1 on error
  */
+static void
+sock_evseq_next(struct lwip_socket *sock)
+{
+  if (++sock->evseq == 0)
+    sock->evseq = 1;
+}
+
 static int
 alloc_socket(struct netconn *newconn)
 {
@@ -228,6 +242,10 @@ alloc_socket(struct netconn *newconn)
       sockets[i].sendevent  = 1; /* TCP send buf is empty */
       sockets[i].flags      = 0;
       sockets[i].err        = 0;
+      /* count the socket's creation as an event for LWIP_POLLET: it
+         starts out writable. evseq is not reset, so that a poll
+         for an earlier socket with the same index sees a change. */
+      sock_evseq_next(&sockets[i]);
       sys_sem_signal(socksem);
       return i;
     }
@@ -480,7 +498,7 @@ lwip_recvfrom(int s, void *mem, int len, unsigned int flags,
       buf = sock->lastdata;
     } else {
       /* If this is non-blocking call, then check first */
-      if (((flags & MSG_DONTWAIT) || (sock->flags & O_NONBLOCK)) && !sock->rcvevent) {
+      if (((flags & MSG_DONTWAIT) || (sock->flags & LWIP_O_NONBLOCK)) && !sock->rcvevent) {
         LWIP_DEBUGF(SOCKETS_DEBUG, ("lwip_recvfrom(%d): returning EWOULDBLOCK\n", s));
         sock_set_errno(sock, EWOULDBLOCK);
         return -1;
@@ -627,6 +645,13 @@ lwip_send(int s, const void *data, int size, unsigned int flags)
 #endif /* (LWIP_UDP || LWIP_RAW) */
   }
 
+  /* If this is non-blocking call, then check first */
+  if (((flags & MSG_DONTWAIT) || (sock->flags & LWIP_O_NONBLOCK)) && !lwip_send_ready(s, size)) {
+    LWIP_DEBUGF(SOCKETS_DEBUG, ("lwip_send(%d): returning EWOULDBLOCK\n", s));
+    sock_set_errno(sock, EWOULDBLOCK);
+    return -1;
+  }
+
   err = netconn_write(sock->conn, data, size, NETCONN_COPY | ((flags & MSG_MORE)?NETCONN_MORE:0));
 
   LWIP_DEBUGF(SOCKETS_DEBUG, ("lwip_send(%d) err=%d size=%d\n", s, err, size));
@@ -634,6 +659,51 @@ lwip_send(int s, const void *data, int size, unsigned int flags)
   return (err==ERR_OK?size:-1);
 }
 
+/**
+ * Check whether lwip_accept(s, ...) would find a connection waiting.
+ *
+ * @return 1 if a connection is waiting, 0 otherwise
+ */
+int
+lwip_accept_ready(int s)
+{
+  struct lwip_socket *sock;
+
+  sock = get_socket(s);
+  return sock != NULL && sock->rcvevent > 0;
+}
+
+/**
+ * Check whether lwip_send(s, data, size, flags) would complete without
+ * waiting for the peer: the socket is not TCP, or its send buffer and
+ * segment queue have room for all of the data now.
+ *
+ * @return 1 if the send would not wait, 0 otherwise
+ */
+int
+lwip_send_ready(int s, int size)
+{
+  struct lwip_socket *sock;
+  struct tcp_pcb *pcb;
+
+  sock = get_socket(s);
+  if (!sock)
+    return 1; /* lwip_send fails at once */
+
+  if (sock->conn->type != NETCONN_TCP)
+    return 1;
+
+  pcb = sock->conn->pcb.tcp;
+  if (pcb == NULL)
+    return 1; /* not connected, or no longer: lwip_send fails at once */
+  if (sock->conn->state != NETCONN_NONE ||
+      !sock->sendevent || size < 0 || size > tcp_sndbuf(pcb))
+    return 0;
+
+  /* tcp_enqueue() wants a queue entry per segment */
+  return pcb->snd_queuelen + size / pcb->mss + 1 < TCP_SND_QUEUELEN;
+}
+
 int
 lwip_sendto(int s, const void *data, int size, unsigned int flags,
        struct sockaddr *to, socklen_t tolen)
@@ -861,6 +931,8 @@ lwip_select(int maxfdp1, fd_set *readset, fd_set *writeset, fd_set *exceptset,
   select_cb.readset = readset;
   select_cb.writeset = writeset;
   select_cb.exceptset = exceptset;
+  select_cb.poll_fds = NULL;
+  select_cb.poll_nfds = 0;
   select_cb.sem_signalled = 0;
 
   /* Protect ourselves searching through the list */
@@ -987,6 +1059,137 @@ lwip_select(int maxfdp1, fd_set *readset, fd_set *writeset, fd_set *exceptset,
   return nready;
 }
 
+/**
+ * The events of fd->events, plus POLLERR and POLLHUP, that socket sock
+ * has. Called with selectsem held.
+ */
+static short
+lwip_pollevents(struct lwip_pollfd *fd, struct lwip_socket *sock)
+{
+  short revents = 0;
+
+  if ((fd->events & LWIP_POLLET) && sock->evseq == fd->seq)
+    return 0;
+  if ((fd->events & POLLIN) && (sock->lastdata || sock->rcvevent))
+    revents |= POLLIN;
+  if ((fd->events & POLLOUT) && sock->sendevent)
+    revents |= POLLOUT;
+  if (sock->conn->err == ERR_ABRT || sock->conn->err == ERR_RST)
+    revents |= POLLERR;
+  else if (sock->conn->err == ERR_CLSD)
+    revents |= POLLHUP;
+  return revents;
+}
+
+/**
+ * Whether socket s, whose state just changed, has any of the events
+ * that the poll for fds waits for.
+ */
+static int
+lwip_pollmatch(struct lwip_pollfd *fds, int nfds, int s, struct lwip_socket *sock)
+{
+  int i;
+
+  for (i = 0; i < nfds; i++)
+    if (fds[i].fd == s && lwip_pollevents(&fds[i], sock))
+      return 1;
+  return 0;
+}
+
+/**
+ * Go through the sockets in fds and fill in their revents and seq.
+ * Called with selectsem held.
+ *
+ * @return number of sockets that had events
+ */
+static int
+lwip_pollscan(struct lwip_pollfd *fds, int nfds)
+{
+  int i, nready = 0;
+  struct lwip_socket *p_sock;
+
+  for (i = 0; i < nfds; i++) {
+    p_sock = get_socket(fds[i].fd);
+    if (!p_sock) {
+      fds[i].revents = POLLNVAL;
+    } else {
+      fds[i].revents = lwip_pollevents(&fds[i], p_sock);
+      fds[i].seq = p_sock->evseq;
+    }
+    if (fds[i].revents) {
+      LWIP_DEBUGF(SOCKETS_DEBUG, ("lwip_pollscan: fd=%d revents=%x\n", fds[i].fd, fds[i].revents));
+      nready++;
+    }
+  }
+  return nready;
+}
+
+/**
+ * Wait until one of the sockets in fds has one of the events it asks
+ * for, as poll() does, and fill in the revents of each. In an entry with
+ * LWIP_POLLET in its events, that counts only if the socket has had an
+ * event since seq.
+ *
+ * @param timeout milliseconds to wait at most; < 0 means forever
+ * @return number of sockets that had events, 0 on timeout, -1 on error
+ */
+int
+lwip_poll(struct lwip_pollfd *fds, int nfds, int timeout)
+{
+  int nready;
+  struct lwip_select_cb select_cb;
+  struct lwip_select_cb *p_selcb;
+
+  LWIP_DEBUGF(SOCKETS_DEBUG, ("lwip_poll(%p, %d, %d)\n", (void *)fds, nfds, timeout));
+
+  select_cb.next = 0;
+  select_cb.readset = NULL;
+  select_cb.writeset = NULL;
+  select_cb.exceptset = NULL;
+  select_cb.poll_fds = fds;
+  select_cb.poll_nfds = nfds;
+  select_cb.sem_signalled = 0;
+
+  sys_sem_wait(selectsem);
+  nready = lwip_pollscan(fds, nfds);
+  if (nready || timeout == 0) {
+    sys_sem_signal(selectsem);
+    set_errno(0);
+    return nready;
+  }
+
+  select_cb.sem = sys_sem_new(0);
+  if (select_cb.sem == SYS_SEM_NULL) {
+    sys_sem_signal(selectsem);
+    set_errno(ENOMEM);
+    return -1;
+  }
+  select_cb.next = select_cb_list;
+  select_cb_list = &select_cb;
+  sys_sem_signal(selectsem);
+
+  sys_sem_wait_timeout(select_cb.sem, timeout < 0 ? 0 : (u32_t)timeout);
+
+  /* Take us off the list, and see what's set */
+  sys_sem_wait(selectsem);
+  if (select_cb_list == &select_cb)
+    select_cb_list = select_cb.next;
+  else
+    for (p_selcb = select_cb_list; p_selcb; p_selcb = p_selcb->next) {
+      if (p_selcb->next == &select_cb) {
+        p_selcb->next = select_cb.next;
+        break;
+      }
+    }
+  nready = lwip_pollscan(fds, nfds);
+  sys_sem_signal(selectsem);
+
+  sys_sem_free(select_cb.sem);
+  LWIP_DEBUGF(SOCKETS_DEBUG, ("lwip_poll: nready=%d\n", nready));
+  set_errno(0);
+  return nready;
+}
+
 /**
  * Callback registered in the netconn layer for each socket-netconn.
  * Processes recvevent (data available) and wakes up tasks waiting for select.
@@ -1033,12 +1236,14 @@ event_callback(struct netconn *conn, enum netconn_evt evt, u16_t len)
   switch (evt) {
     case NETCONN_EVT_RCVPLUS:
       sock->rcvevent++;
+      sock_evseq_next(sock);
       break;
     case NETCONN_EVT_RCVMINUS:
       sock->rcvevent--;
       break;
     case NETCONN_EVT_SENDPLUS:
       sock->sendevent = 1;
+      sock_evseq_next(sock);
       break;
     case NETCONN_EVT_SENDMINUS:
       sock->sendevent = 0;
@@ -1067,6 +1272,8 @@ event_callback(struct netconn *conn, enum netconn_evt evt, u16_t len)
         if (scb->writeset && FD_ISSET(s, scb->writeset))
           if (sock->sendevent)
             break;
+        if (scb->poll_fds && lwip_pollmatch(scb->poll_fds, scb->poll_nfds, s, sock))
+          break;
       }
     }
     if (scb) {
@@ -1907,10 +2114,10 @@ lwip_ioctl(int s, long cmd, void *argp)
 
   case FIONBIO:
     if (argp && *(u32_t*)argp)
-      sock->flags |= O_NONBLOCK;
+      sock->flags |= LWIP_O_NONBLOCK;
     else
-      sock->flags &= ~O_NONBLOCK;
-    LWIP_DEBUGF(SOCKETS_DEBUG, ("lwip_ioctl(%d, FIONBIO, %d)\n", s, !!(sock->flags & O_NONBLOCK)));
+      sock->flags &= ~LWIP_O_NONBLOCK;
+    LWIP_DEBUGF(SOCKETS_DEBUG, ("lwip_ioctl(%d, FIONBIO, %d)\n", s, !!(sock->flags & LWIP_O_NONBLOCK)));
     sock_set_errno(sock, 0);
     return 0;
 
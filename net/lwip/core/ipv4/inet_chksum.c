@@ -378,6 +378,35 @@ inet_chksum_pseudo_partial(struct pbuf *p,
   return (u16_t)~(acc & 0xffffUL);
 }
 
+/* inet_chksum_pseudo_hdr:
+ *
+ * Calculates the sum of just the pseudo header, not complemented, for
+ * a netif that finishes the checksum over the data itself.
+ *
+ * @param src source ip address
+ * @param dst destination ip address
+ * @param proto ip protocol
+ * @param proto_len length of the ip data part, or 0 to leave it out
+ * @return sum (as u16_t) to be saved directly in the protocol header
+ */
+u16_t
+inet_chksum_pseudo_hdr(struct ip_addr *src, struct ip_addr *dest,
+       u8_t proto, u16_t proto_len)
+{
+  u32_t acc;
+
+  acc = (src->addr & 0xffffUL);
+  acc += ((src->addr >> 16) & 0xffffUL);
+  acc += (dest->addr & 0xffffUL);
+  acc += ((dest->addr >> 16) & 0xffffUL);
+  acc += (u32_t)htons((u16_t)proto);
+  acc += (u32_t)htons(proto_len);
+
+  acc = FOLD_U32T(acc);
+  acc = FOLD_U32T(acc);
+  return (u16_t)(acc & 0xffffUL);
+}
+
 /* inet_chksum:
  *
  * Calculates the Internet checksum over a portion of memory. Used primarily for IP
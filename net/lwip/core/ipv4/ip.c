@@ -224,7 +224,7 @@ ip_input(struct pbuf *p, struct netif *inp)
 
   /* verify checksum */
 #if CHECKSUM_CHECK_IP
-  if (inet_chksum(iphdr, iphdr_hlen) != 0) {
+  if (!(p->flags & PBUF_FLAG_RX_CSUM_IP) && inet_chksum(iphdr, iphdr_hlen) != 0) {
 
     LWIP_DEBUGF(IP_DEBUG | 2, ("Checksum (0x%"X16_F") failed, IP packet dropped.\n", inet_chksum(iphdr, iphdr_hlen)));
     ip_debug_print(p);
@@ -346,6 +346,9 @@ ip_input(struct pbuf *p, struct netif *inp)
 #if IP_REASSEMBLY /* packet fragment reassembly code present? */
     LWIP_DEBUGF(IP_DEBUG, ("IP packet is a fragment (id=0x%04"X16_F" tot_len=%"U16_F" len=%"U16_F" MF=%"U16_F" offset=%"U16_F"), calling ip_reass()\n",
       ntohs(IPH_ID(iphdr)), p->tot_len, ntohs(IPH_LEN(iphdr)), !!(IPH_OFFSET(iphdr) & htons(IP_MF)), (ntohs(IPH_OFFSET(iphdr)) & IP_OFFMASK)*8));
+    /* the netif checks no transport checksums in fragments, but the
+       reassembled packet may keep the first fragment's flags */
+    p->flags &= ~PBUF_FLAG_RX_CSUM_L4;
     /* reassemble the packet*/
     p = ip_reass(p);
     /* packet not fully reassembled yet? */
@@ -511,9 +514,13 @@ ip_output_if(struct pbuf *p, struct ip_addr *src, struct ip_addr *dest,
     }
 
     IPH_CHKSUM_SET(iphdr, 0);
+    if (netif->offload & NETIF_OFFLOAD_CSUM) {
+      p->flags |= PBUF_FLAG_TX_CSUM_IP;
+    } else {
 #if CHECKSUM_GEN_IP
-    IPH_CHKSUM_SET(iphdr, inet_chksum(iphdr, IP_HLEN));
+      IPH_CHKSUM_SET(iphdr, inet_chksum(iphdr, IP_HLEN));
 #endif
+    }
   } else {
     /* IP header already included in p */
     iphdr = p->payload;
@@ -521,8 +528,9 @@ ip_output_if(struct pbuf *p, struct ip_addr *src, struct ip_addr *dest,
   }
 
 #if IP_FRAG
-  /* don't fragment if interface has mtu set to 0 [loopif] */
-  if (netif->mtu && (p->tot_len > netif->mtu))
+  /* don't fragment if interface has mtu set to 0 [loopif], or if it
+     cuts the packet into TCP segments itself */
+  if (netif->mtu && (p->tot_len > netif->mtu) && !(p->flags & PBUF_FLAG_TSO))
     return ip_frag(p,netif,dest);
 #endif
 
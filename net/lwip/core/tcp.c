@@ -499,7 +499,11 @@ tcp_connect(struct tcp_pcb *pcb, struct ip_addr *ipaddr, u16_t port,
   }
   pcb->remote_port = port;
   if (pcb->local_port == 0) {
-    pcb->local_port = tcp_new_port();
+    do {
+      pcb->local_port = tcp_new_port();
+    } while (!TCP_PORT_OK(pcb));
+  } else if (!TCP_PORT_OK(pcb)) {
+    return ERR_USE;
   }
   iss = tcp_next_iss();
   pcb->rcv_nxt = 0;
@@ -57,7 +57,11 @@
 #include <string.h>
 
 /* Forward declarations.*/
-static void tcp_output_segment(struct tcp_seg *seg, struct tcp_pcb *pcb);
+static void tcp_output_segment(struct tcp_seg *seg, struct tcp_pcb *pcb,
+                               struct pbuf *more);
+static struct tcp_seg *tcp_tso_last(struct tcp_pcb *pcb, struct tcp_seg *seg,
+                                    u32_t wnd);
+static struct pbuf *tcp_tso_data(struct tcp_seg *seg, struct tcp_seg *last);
 
 /**
  * Called by tcp_close() to send a segment including flags but not data.
@@ -412,7 +416,8 @@ tcp_output(struct tcp_pcb *pcb)
 {
   struct pbuf *p;
   struct tcp_hdr *tcphdr;
-  struct tcp_seg *seg, *useg;
+  struct tcp_seg *seg, *useg, *last, *next;
+  struct pbuf *more;
   u32_t wnd;
 #if TCP_CWND_DEBUG
   s16_t i = 0;
@@ -535,43 +540,58 @@ tcp_output(struct tcp_pcb *pcb)
     ++i;
 #endif /* TCP_CWND_DEBUG */
 
-    pcb->unsent = seg->next;
+    /* send the segments up to last as one packet if the netif can cut
+       it back up */
+    last = tcp_tso_last(pcb, seg, wnd);
+    more = NULL;
+    if (last != seg && (more = tcp_tso_data(seg, last)) == NULL) {
+      last = seg;
+    }
+    pcb->unsent = last->next;
 
     if (pcb->state != SYN_SENT) {
       TCPH_SET_FLAG(seg->tcphdr, TCP_ACK);
       pcb->flags &= ~(TF_ACK_DELAY | TF_ACK_NOW);
     }
 
-    tcp_output_segment(seg, pcb);
-    pcb->snd_nxt = ntohl(seg->tcphdr->seqno) + TCP_TCPLEN(seg);
+    tcp_output_segment(seg, pcb, more);
+    pcb->snd_nxt = ntohl(last->tcphdr->seqno) + TCP_TCPLEN(last);
     if (TCP_SEQ_LT(pcb->snd_max, pcb->snd_nxt)) {
       pcb->snd_max = pcb->snd_nxt;
     }
-    /* put segment on unacknowledged list if length > 0 */
-    if (TCP_TCPLEN(seg) > 0) {
-      seg->next = NULL;
-      /* unacked list is empty? */
-      if (pcb->unacked == NULL) {
-        pcb->unacked = seg;
-        useg = seg;
-      /* unacked list is not empty? */
-      } else {
-        /* In the case of fast retransmit, the packet should not go to the tail
-         * of the unacked queue, but rather at the head. We need to check for
-         * this case. -STJ Jul 27, 2004 */
-        if (TCP_SEQ_LT(ntohl(seg->tcphdr->seqno), ntohl(useg->tcphdr->seqno))){
-          /* add segment to head of unacked list */
-          seg->next = pcb->unacked;
+    /* each segment sent stays separate, for retransmission */
+    for (;;) {
+      next = seg->next;
+      /* put segment on unacknowledged list if length > 0 */
+      if (TCP_TCPLEN(seg) > 0) {
+        seg->next = NULL;
+        /* unacked list is empty? */
+        if (pcb->unacked == NULL) {
           pcb->unacked = seg;
+          useg = seg;
+        /* unacked list is not empty? */
         } else {
-          /* add segment to tail of unacked list */
-          useg->next = seg;
-          useg = useg->next;
+          /* In the case of fast retransmit, the packet should not go to the tail
+           * of the unacked queue, but rather at the head. We need to check for
+           * this case. -STJ Jul 27, 2004 */
+          if (TCP_SEQ_LT(ntohl(seg->tcphdr->seqno), ntohl(useg->tcphdr->seqno))){
+            /* add segment to head of unacked list */
+            seg->next = pcb->unacked;
+            pcb->unacked = seg;
+          } else {
+            /* add segment to tail of unacked list */
+            useg->next = seg;
+            useg = useg->next;
+          }
         }
+      /* do not queue empty segments on the unacked list */
+      } else {
+        tcp_seg_free(seg);
       }
-    /* do not queue empty segments on the unacked list */
-    } else {
-      tcp_seg_free(seg);
+      if (seg == last) {
+        break;
+      }
+      seg = next;
     }
     seg = pcb->unsent;
   }
@@ -587,17 +607,116 @@ tcp_output(struct tcp_pcb *pcb)
   return ERR_OK;
 }
 
+/**
+ * Called by tcp_output() to find the run of unsent segments from seg on
+ * that it can send as one packet for the netif to cut back up (TCP
+ * segmentation offload). The run ends where the window or the nagle
+ * algorithm would stop tcp_output, before a SYN or FIN, or when the
+ * packet or its pbuf chain would grow too long. The netif cuts at its
+ * own MTU, so TSO is used only if that is no more than our MSS.
+ *
+ * @param pcb the tcp_pcb for the TCP connection
+ * @param seg the first segment to send, pcb->unsent
+ * @param wnd the window tcp_output is sending within
+ * @return the last segment to send along with seg, or seg itself
+ */
+static struct tcp_seg *
+tcp_tso_last(struct tcp_pcb *pcb, struct tcp_seg *seg, u32_t wnd)
+{
+  struct netif *netif;
+  struct tcp_seg *last, *next;
+  u32_t len;
+  u16_t clen;
+
+  if (seg->len == 0 || (TCPH_FLAGS(seg->tcphdr) & (TCP_SYN | TCP_FIN)) != 0) {
+    return seg;
+  }
+  netif = ip_route(&pcb->remote_ip);
+  if (netif == NULL || !(netif->offload & NETIF_OFFLOAD_TSO) ||
+      netif->mtu == 0 || netif->mtu - IP_HLEN - TCP_HLEN > pcb->mss) {
+    return seg;
+  }
+
+  len = seg->len;
+  clen = pbuf_clen(seg->p);
+  for (last = seg; (next = last->next) != NULL; last = next) {
+    if (next->len == 0 ||
+        (TCPH_FLAGS(next->tcphdr) & (TCP_SYN | TCP_FIN)) != 0 ||
+        ntohl(next->tcphdr->seqno) != ntohl(last->tcphdr->seqno) + last->len ||
+        ntohl(next->tcphdr->seqno) - pcb->lastack + next->len > wnd ||
+        len + next->len > 0xffff - IP_HLEN - TCP_HLEN ||
+        clen + pbuf_clen(next->p) > TCP_TSO_MAXPBUFS) {
+      break;
+    }
+    /* a small last segment waits for the nagle algorithm */
+    if (next->next == NULL && next->len < pcb->mss &&
+        (pcb->flags & TF_NODELAY) == 0) {
+      break;
+    }
+    len += next->len;
+    clen += pbuf_clen(next->p);
+  }
+  return last;
+}
+
+/**
+ * Called by tcp_output() to make a chain of PBUF_REF pbufs over the data
+ * of the segments after seg up to last, without their headers.
+ *
+ * @param seg the segment before the first one to take data from
+ * @param last the last segment to take data from
+ * @return the chain, or NULL if there are not enough pbufs
+ */
+static struct pbuf *
+tcp_tso_data(struct tcp_seg *seg, struct tcp_seg *last)
+{
+  struct pbuf *chain, *q, *r;
+  u16_t off;
+
+  chain = NULL;
+  do {
+    seg = seg->next;
+    /* the data follows the TCP header, and any IP and link headers
+       from an earlier send precede it */
+    off = (u16_t)((u8_t *)seg->tcphdr - (u8_t *)seg->p->payload) +
+      TCPH_HDRLEN(seg->tcphdr) * 4;
+    for (q = seg->p; q != NULL; q = q->next) {
+      if (q->len > off) {
+        r = pbuf_alloc(PBUF_RAW, q->len - off, PBUF_REF);
+        if (r == NULL) {
+          if (chain != NULL) {
+            pbuf_free(chain);
+          }
+          return NULL;
+        }
+        r->payload = (u8_t *)q->payload + off;
+        if (chain == NULL) {
+          chain = r;
+        } else {
+          pbuf_cat(chain, r);
+        }
+      }
+      off = off > q->len ? off - q->len : 0;
+    }
+  } while (seg != last);
+  return chain;
+}
+
 /**
  * Called by tcp_output() to actually send a TCP segment over IP.
  *
  * @param seg the tcp_seg to send
  * @param pcb the tcp_pcb for the TCP connection used to send the segment
+ * @param more NULL, or the data of the segments after seg, from
+ *        tcp_tso_data(), for the netif to send after seg's in segments
+ *        of its own
  */
 static void
-tcp_output_segment(struct tcp_seg *seg, struct tcp_pcb *pcb)
+tcp_output_segment(struct tcp_seg *seg, struct tcp_pcb *pcb, struct pbuf *more)
 {
   u16_t len;
   struct netif *netif;
+  struct pbuf *q;
 
   /** @bug Exclude retransmitted segments from this count. */
   snmp_inc_tcpoutsegs();
@@ -639,14 +758,33 @@ tcp_output_segment(struct tcp_seg *seg, struct tcp_pcb *pcb)
   seg->p->tot_len -= len;
 
   seg->p->payload = seg->tcphdr;
+  seg->p->flags &= ~(PBUF_FLAG_TX_CSUM_IP | PBUF_FLAG_TX_CSUM_TCP | PBUF_FLAG_TSO);
+
+  if (more != NULL) {
+    /* the netif copies the header into every segment it cuts, and
+       sets PSH only in the last */
+    pbuf_cat(seg->p, more);
+    seg->p->flags |= PBUF_FLAG_TSO;
+    TCPH_SET_FLAG(seg->tcphdr, TCP_PSH);
+  }
 
   seg->tcphdr->chksum = 0;
+  netif = ip_route(&(pcb->remote_ip));
+  if (netif != NULL && (netif->offload & NETIF_OFFLOAD_CSUM)) {
+    /* the netif sums the segment into this; with TSO, it also adds
+       the length of each segment it cuts */
+    seg->tcphdr->chksum = inet_chksum_pseudo_hdr(&(pcb->local_ip),
+             &(pcb->remote_ip), IP_PROTO_TCP,
+             more != NULL ? 0 : seg->p->tot_len);
+    seg->p->flags |= PBUF_FLAG_TX_CSUM_TCP;
+  } else {
 #if CHECKSUM_GEN_TCP
-  seg->tcphdr->chksum = inet_chksum_pseudo(seg->p,
+    seg->tcphdr->chksum = inet_chksum_pseudo(seg->p,
              &(pcb->local_ip),
              &(pcb->remote_ip),
              IP_PROTO_TCP, seg->p->tot_len);
 #endif
+  }
   TCP_STATS_INC(tcp.xmit);
 
 #if LWIP_NETIF_HWADDRHINT
@@ -664,6 +802,16 @@ tcp_output_segment(struct tcp_seg *seg, struct tcp_pcb *pcb)
   ip_output(seg->p, &(pcb->local_ip), &(pcb->remote_ip), pcb->ttl, pcb->tos,
       IP_PROTO_TCP);
 #endif /* LWIP_NETIF_HWADDRHINT*/
+
+  if (more != NULL) {
+    /* take the other segments' data back off seg */
+    for (q = seg->p; q->next != more; q = q->next) {
+      q->tot_len -= more->tot_len;
+    }
+    q->tot_len -= more->tot_len;
+    q->next = NULL;
+    pbuf_free(more);
+  }
 }
 
 /**
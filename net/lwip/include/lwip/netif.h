@@ -81,6 +81,13 @@ extern "C" {
 /** if set, the netif has IGMP capability */
 #define NETIF_FLAG_IGMP         0x40U
 
+/** if set in netif->offload, the netif can fill in IP header checksums
+ *  and finish TCP checksums (see PBUF_FLAG_TX_CSUM_*) */
+#define NETIF_OFFLOAD_CSUM      0x01U
+/** if set in netif->offload, the netif can cut runs of TCP segments
+ *  itself (see PBUF_FLAG_TSO) */
+#define NETIF_OFFLOAD_TSO       0x02U
+
 /** Generic data structure used for all lwIP network interfaces.
  *  The following fields should be filled in by the initialization
  *  function for the device driver: hwaddr_len, hwaddr[], mtu, flags */
@@ -139,6 +146,8 @@ struct netif {
   u16_t mtu;
   /** flags (see NETIF_FLAG_ above) */
   u8_t flags;
+  /** work the driver does for the stack (see NETIF_OFFLOAD_ above) */
+  u8_t offload;
   /** descriptive abbreviation */
   char name[2];
   /** number of this interface */
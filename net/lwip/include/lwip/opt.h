@@ -734,6 +734,26 @@
 #define TCP_SNDLOWAT                    (TCP_SND_BUF/2)
 #endif
 
+/**
+ * TCP_TSO_MAXPBUFS: The most pbufs in a run of segments that tcp_output
+ * hands a netif with NETIF_OFFLOAD_TSO as one packet. Keep this within
+ * what the netif can send in one go.
+ */
+#ifndef TCP_TSO_MAXPBUFS
+#define TCP_TSO_MAXPBUFS                32
+#endif
+
+/**
+ * TCP_PORT_OK(pcb): Whether a connection from pcb's local port to its
+ * remote address and port may be made from this stack. tcp_connect picks
+ * another ephemeral port until it is, and refuses a bound port that is not.
+ * For stacks that share an address and have incoming segments steered
+ * between them by connection.
+ */
+#ifndef TCP_PORT_OK
+#define TCP_PORT_OK(pcb)                1
+#endif
+
 /**
  * TCP_LISTEN_BACKLOG: Enable the backlog option for tcp listen pcb.
  */
@@ -60,6 +60,21 @@ typedef enum {
 
 /** indicates this packet's data should be immediately passed to the application */
 #define PBUF_FLAG_PUSH 0x01U
+/** indicates this is a custom pbuf: pbuf_free calls
+    pbuf_custom->custom_free_function instead of freeing it */
+#define PBUF_FLAG_IS_CUSTOM 0x02U
+/** outgoing packet: the netif fills in the IP header checksum */
+#define PBUF_FLAG_TX_CSUM_IP 0x04U
+/** outgoing packet: the netif finishes the TCP checksum, which holds
+    the sum of the pseudo header */
+#define PBUF_FLAG_TX_CSUM_TCP 0x08U
+/** outgoing packet: a run of TCP segments that the netif cuts up
+    itself; the TCP checksum leaves the length out of the pseudo header */
+#define PBUF_FLAG_TSO 0x10U
+/** incoming packet: the netif checked the IP header checksum */
+#define PBUF_FLAG_RX_CSUM_IP 0x20U
+/** incoming packet: the netif checked the TCP or UDP checksum */
+#define PBUF_FLAG_RX_CSUM_L4 0x40U
 
 struct pbuf {
   /** next pbuf in singly linked pbuf chain */
@@ -95,10 +110,21 @@ struct pbuf {
   
 };
 
+/** A custom pbuf is like a pbuf, but following a function pointer to free it. */
+struct pbuf_custom {
+  /** The actual pbuf */
+  struct pbuf pbuf;
+  /** This function is called when pbuf_free deallocates this pbuf(_custom) */
+  void (*custom_free_function)(struct pbuf *p);
+};
+
 /* Initializes the pbuf module. This call is empty for now, but may not be in future. */
 #define pbuf_init()
 
 struct pbuf *pbuf_alloc(pbuf_layer l, u16_t size, pbuf_type type);
+struct pbuf *pbuf_alloced_custom(pbuf_layer l, u16_t length, pbuf_type type,
+                                 struct pbuf_custom *p, void *payload_mem,
+                                 u16_t payload_mem_len);
 void pbuf_realloc(struct pbuf *p, u16_t size); 
 u8_t pbuf_header(struct pbuf *p, s16_t header_size);
 void pbuf_ref(struct pbuf *p);
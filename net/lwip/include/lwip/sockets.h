@@ -263,10 +263,10 @@ typedef struct ip_mreq {
 #define SIOCATMARK  _IOR('s',  7, unsigned long)  /* at oob mark? */
 #endif
 
-/* Socket flags: */
-#ifndef O_NONBLOCK
-#define O_NONBLOCK    04000U
-#endif
+/* Socket flags: lwIP's own, set with lwip_ioctl(FIONBIO). JOS programs
+   use the O_NONBLOCK of inc/lib.h instead, which nsipc passes to the
+   network server as MSG_DONTWAIT. */
+#define LWIP_O_NONBLOCK    04000U
 
 /* FD_SET used for lwip_select */
 #ifndef FD_SET
@@ -284,6 +284,36 @@ typedef struct ip_mreq {
 
 #endif /* FD_SET */
 
+/* Events for lwip_poll */
+#ifndef POLLIN
+#define POLLIN      0x01    /* data, or a connection to accept, is waiting */
+#define POLLOUT     0x02    /* there is room to send */
+#define POLLERR     0x04    /* the connection was aborted or reset */
+#define POLLHUP     0x08    /* the peer closed the connection */
+#define POLLNVAL    0x10    /* not a socket */
+
+typedef unsigned int nfds_t;
+
+struct pollfd {
+  int fd;
+  short events;
+  short revents;
+};
+#endif /* POLLIN */
+
+/** With LWIP_POLLET in its events, an lwip_pollfd reports its socket
+ * only if the socket has had an event since its event count was seq */
+#define LWIP_POLLET 0x4000
+
+/** lwip_poll's version of struct pollfd */
+struct lwip_pollfd {
+  int fd;
+  short events;
+  short revents;
+  /** the socket's event count; lwip_poll sets it */
+  u32_t seq;
+};
+
 /** LWIP_TIMEVAL_PRIVATE: if you want to use the struct timeval provided
  * by your system, set this to 0 and include <sys/time.h> in cc.h */ 
 #ifndef LWIP_TIMEVAL_PRIVATE
@@ -300,6 +330,7 @@ struct timeval {
 void lwip_socket_init(void);
 
 int lwip_accept(int s, struct sockaddr *addr, socklen_t *addrlen);
+int lwip_accept_ready(int s);
 int lwip_bind(int s, struct sockaddr *name, socklen_t namelen);
 int lwip_shutdown(int s, int how);
 int lwip_getpeername (int s, struct sockaddr *name, socklen_t *namelen);
@@ -314,12 +345,14 @@ int lwip_read(int s, void *mem, int len);
 int lwip_recvfrom(int s, void *mem, int len, unsigned int flags,
       struct sockaddr *from, socklen_t *fromlen);
 int lwip_send(int s, const void *dataptr, int size, unsigned int flags);
+int lwip_send_ready(int s, int size);
 int lwip_sendto(int s, const void *dataptr, int size, unsigned int flags,
     struct sockaddr *to, socklen_t tolen);
 int lwip_socket(int domain, int type, int protocol);
 int lwip_write(int s, const void *dataptr, int size);
 int lwip_select(int maxfdp1, fd_set *readset, fd_set *writeset, fd_set *exceptset,
                 struct timeval *timeout);
+int lwip_poll(struct lwip_pollfd *fds, int nfds, int timeout);
 int lwip_ioctl(int s, long cmd, void *argp);
 
 #if LWIP_COMPAT_SOCKETS
@@ -38,4 +38,9 @@ typedef uintptr_t mem_ptr_t;
 #define BYTE_ORDER LITTLE_ENDIAN
 #endif
 
+// Checksums 64 bits at a time; see chksum.c.
+u16_t jos_chksum(void *dataptr, int len);
+u16_t jos_chksum_copy(void *dst, const void *src, int len);
+#define LWIP_CHKSUM	jos_chksum
+
 #endif
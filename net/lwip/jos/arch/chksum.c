@@ -0,0 +1,135 @@
+// The Internet checksum, for LWIP_CHKSUM.
+//
+// lwIP's reference routines add up the data 16 bits at a time.  These
+// add 64 bits at a time instead, eight words per iteration, chaining
+// the carries with adc: the sum of 64-bit words, end-around carry
+// included, folds down to the same 16-bit ones' complement sum.  The
+// loops are in assembly because user code is built without
+// optimization.  Neither uses SSE or AVX registers, which the kernel
+// does not save across context switches.
+//
+// Like lwip_standard_chksum, both return the sum, not inverted, of the
+// data read as host-order 16-bit words, which the caller may store in a
+// header as it is; see RFC 1071 on byte order independence.
+
+#include <inc/lib.h>
+#include <arch/cc.h>
+
+typedef uint64_t __attribute__((__may_alias__)) word64_t;
+typedef uint32_t __attribute__((__may_alias__)) word32_t;
+typedef uint16_t __attribute__((__may_alias__)) word16_t;
+
+static uint64_t
+add_carry(uint64_t sum, uint64_t v)
+{
+    __asm __volatile("addq %1, %0\n\t"
+		     "adcq $0, %0"
+		     : "+r" (sum) : "r" (v) : "cc");
+    return sum;
+}
+
+static u16_t
+fold(uint64_t sum)
+{
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return sum;
+}
+
+// Add the last len < 8 bytes at p to sum.  The bytes before them are
+// a multiple of 8, so a lone last byte is the low half of its word.
+static uint64_t
+sum_tail(uint64_t sum, const uint8_t *p, int len)
+{
+    if (len & 4) {
+	sum = add_carry(sum, *(const word32_t *) p);
+	p += 4;
+    }
+    if (len & 2) {
+	sum = add_carry(sum, *(const word16_t *) p);
+	p += 2;
+    }
+    if (len & 1)
+	sum = add_carry(sum, *p);
+    return sum;
+}
+
+u16_t
+jos_chksum(void *dataptr, int len)
+{
+    const uint8_t *p = dataptr;
+    uint64_t sum = 0;
+    size_t blocks = len / 64;
+
+    if (blocks) {
+	__asm __volatile("clc\n"
+			 "1:\n\t"
+			 "adcq 0(%[p]), %[s]\n\t"
+			 "adcq 8(%[p]), %[s]\n\t"
+			 "adcq 16(%[p]), %[s]\n\t"
+			 "adcq 24(%[p]), %[s]\n\t"
+			 "adcq 32(%[p]), %[s]\n\t"
+			 "adcq 40(%[p]), %[s]\n\t"
+			 "adcq 48(%[p]), %[s]\n\t"
+			 "adcq 56(%[p]), %[s]\n\t"
+			 // lea and dec leave the carry alone
+			 "leaq 64(%[p]), %[p]\n\t"
+			 "decq %[n]\n\t"
+			 "jnz 1b\n\t"
+			 "adcq $0, %[s]"
+			 : [s] "+r" (sum), [p] "+r" (p), [n] "+r" (blocks)
+			 : : "memory", "cc");
+	len %= 64;
+    }
+    for (; len >= 8; len -= 8, p += 8)
+	sum = add_carry(sum, *(const word64_t *) p);
+    return fold(sum_tail(sum, p, len));
+}
+
+// Copy len bytes from src to dst, returning their sum as jos_chksum
+// would, in a single pass over the data.
+u16_t
+jos_chksum_copy(void *dst, const void *src, int len)
+{
+    const uint8_t *s = src;
+    uint8_t *d = dst;
+    uint64_t sum = 0;
+    size_t blocks = len / 32;
+    int tail;
+
+    if (blocks) {
+	__asm __volatile("clc\n"
+			 "1:\n\t"
+			 "movq 0(%[src]), %%rax\n\t"
+			 "movq 8(%[src]), %%rdx\n\t"
+			 "adcq %%rax, %[s]\n\t"
+			 "adcq %%rdx, %[s]\n\t"
+			 "movq %%rax, 0(%[dst])\n\t"
+			 "movq %%rdx, 8(%[dst])\n\t"
+			 "movq 16(%[src]), %%rax\n\t"
+			 "movq 24(%[src]), %%rdx\n\t"
+			 "adcq %%rax, %[s]\n\t"
+			 "adcq %%rdx, %[s]\n\t"
+			 "movq %%rax, 16(%[dst])\n\t"
+			 "movq %%rdx, 24(%[dst])\n\t"
+			 "leaq 32(%[src]), %[src]\n\t"
+			 "leaq 32(%[dst]), %[dst]\n\t"
+			 "decq %[n]\n\t"
+			 "jnz 1b\n\t"
+			 "adcq $0, %[s]"
+			 : [s] "+r" (sum), [src] "+r" (s), [dst] "+r" (d),
+			   [n] "+r" (blocks)
+			 : : "rax", "rdx", "memory", "cc");
+	len %= 32;
+    }
+    for (; len >= 8; len -= 8, s += 8, d += 8) {
+	*(word64_t *) d = *(const word64_t *) s;
+	sum = add_carry(sum, *(const word64_t *) s);
+    }
+    tail = len;
+    sum = sum_tail(sum, s, tail);
+    memcpy(d, s, tail);
+    return fold(sum);
+}
@@ -34,23 +34,74 @@
 #include <inc/ns.h>
 
 #include <jif/jif.h>
+#include <arch/thread.h>
 
 #include "lwip/opt.h"
 #include "lwip/def.h"
 #include "lwip/mem.h"
 #include "lwip/pbuf.h"
 #include "lwip/sys.h"
+#include "lwip/inet_chksum.h"
+#include "lwip/ip.h"
+#include "lwip/tcp.h"
 #include <lwip/stats.h>
 
 #include <netif/etharp.h>
 
 #define PKTMAP		0x10000000
 
+// Received packets stay in the page the input environment sent us.
+// low_level_input moves that page to one of the NRXPAGES slots at
+// RXMAP and wraps it in a PBUF_REF custom pbuf, whose free function
+// unmaps the page again, so lwIP reads packets where the card wrote
+// them.  When every slot is in use, packets are copied as before,
+// through RXTMP if they live in another environment.
+#define RXTMP		(RXMAP - PGSIZE)
+#define RXMAP		0x10100000
+#define NRXPAGES	128
+
 struct jif {
     struct eth_addr *ethaddr;
     envid_t envid;
+    struct netring *outring;	// see jif_output_ring
+    char *outbufs;
+};
+
+struct rxpage {
+    struct pbuf_custom pc;	// must be first
+    struct rxpage *next;	// next free slot
 };
 
+static struct rxpage rxpages[NRXPAGES];
+static struct rxpage *rxfree;
+
+// Packets are normally sent straight from their pbufs' payloads with
+// sys_net_transmit_sg.  Each such packet keeps a reference to its pbuf
+// here, oldest first, until the card has sent it.
+#define NTXPENDING	256
+
+static struct {
+    struct pbuf *p;
+    u32_t seq;
+} txpending[NTXPENDING];
+static u32_t txhead, txtail;
+
+static void *
+rxpage_va(struct rxpage *rp)
+{
+    return (void *) (RXMAP + (rp - rxpages) * PGSIZE);
+}
+
+static void
+rxpage_free(struct pbuf *p)
+{
+    struct rxpage *rp = (struct rxpage *) p;
+
+    sys_page_unmap(0, rxpage_va(rp));
+    rp->next = rxfree;
+    rxfree = rp;
+}
+
 static void
 low_level_init(struct netif *netif)
 {
@@ -67,42 +118,219 @@ low_level_init(struct netif *netif)
     netif->hwaddr[3] = 0x12;
     netif->hwaddr[4] = 0x34;
     netif->hwaddr[5] = 0x56;
+
+    // The card fills in checksums and cuts up TCP segments for packets
+    // sent with sys_net_transmit_sg, which works if there is a card.
+    // Packets that end up copied instead get their checksums here.
+    if (sys_net_transmit_sg(0, 0, 0) >= 0)
+	netif->offload = NETIF_OFFLOAD_CSUM | NETIF_OFFLOAD_TSO;
+
+    for (r = NRXPAGES - 1; r >= 0; r--) {
+	rxpages[r].pc.custom_free_function = rxpage_free;
+	rxpages[r].next = rxfree;
+	rxfree = &rxpages[r];
+    }
 }
 
 /*
- * low_level_output():
+ * tx_reap():
  *
- * Should do the actual transmission of the packet. The packet is
- * contained in the pbuf that is passed to the function. This pbuf
- * might be chained.
+ * Release the pbufs of packets that the card has finished sending.
+ *
+ */
+static void
+tx_reap(void)
+{
+    int sent;
+
+    if (txhead == txtail || (sent = sys_net_transmit_sg(0, 0, 0)) < 0)
+	return;
+    // Sequence numbers wrap at NET_SEQ_MASK; packet seq is sent
+    // once sent > seq.
+    while (txhead != txtail
+	   && ((sent - txpending[txhead % NTXPENDING].seq - 1) & NET_SEQ_MASK)
+	      < NET_SEQ_MASK / 2) {
+	pbuf_free(txpending[txhead % NTXPENDING].p);
+	txhead++;
+    }
+}
+
+/*
+ * fold():
+ *
+ * Fold a sum of 16-bit sums to 16 bits.
+ *
+ */
+static u16_t
+fold(u32_t sum)
+{
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return sum;
+}
+
+/*
+ * copy_sum():
+ *
+ * Copy the n bytes at src, which begin pos bytes into a frame, to dst,
+ * adding the Internet sum of those in the frame's [lo, hi) to *sum as
+ * they are copied, so that checking or filling in a checksum costs no
+ * second pass over the data.
+ *
+ */
+static void
+copy_sum(void *dst, const void *src, int n, int pos, int lo, int hi,
+	 u32_t *sum)
+{
+    int a = MAX(pos, lo) - pos, b = MIN(pos + n, hi) - pos;
+    u16_t s;
+
+    if (a >= b) {
+	memcpy(dst, src, n);
+	return;
+    }
+    memcpy(dst, src, a);
+    s = jos_chksum_copy((char *) dst + a, (const char *) src + a, b - a);
+    // Bytes that start at an odd offset into [lo, hi) sum swapped.
+    if ((pos + a - lo) & 1)
+	s = (s << 8) | (s >> 8);
+    *sum += s;
+    memcpy((char *) dst + b, (const char *) src + b, n - b);
+}
+
+/*
+ * copy_out():
+ *
+ * Copy the packet p to frame, filling in the checksums that lwIP left
+ * to the card.  The TCP checksum is summed during the copy.
+ *
+ */
+static void
+copy_out(struct pbuf *p, char *frame)
+{
+    struct ip_hdr *iph = (struct ip_hdr *) (frame + sizeof(struct eth_hdr));
+    struct tcp_hdr *tcph;
+    struct pbuf *q;
+    int lo, pos;
+    u32_t sum = 0;
+
+    lo = p->tot_len;
+    if (p->flags & PBUF_FLAG_TX_CSUM_TCP)
+	lo = sizeof(struct eth_hdr)
+	    + IPH_HL((struct ip_hdr *) ((char *) p->payload
+					+ sizeof(struct eth_hdr))) * 4;
+    for (q = p, pos = 0; q != NULL; pos += q->len, q = q->next)
+	copy_sum(frame + pos, q->payload, q->len, pos, lo, p->tot_len, &sum);
+
+    if (p->flags & PBUF_FLAG_TX_CSUM_IP)
+	IPH_CHKSUM_SET(iph, inet_chksum(iph, IPH_HL(iph) * 4));
+    if (p->flags & PBUF_FLAG_TX_CSUM_TCP) {
+	// The sum covered the checksum field, which held the pseudo
+	// header's sum.
+	tcph = (struct tcp_hdr *) (frame + lo);
+	tcph->chksum = ~fold(sum);
+    }
+}
+
+/*
+ * low_level_offload():
+ *
+ * Describe to the card the work lwIP's flags on p leave it.  Returns
+ * NULL if there is none.
+ *
+ */
+static struct net_offload *
+low_level_offload(struct netif *netif, struct pbuf *p,
+		  struct net_offload *off)
+{
+    struct ip_hdr *iph;
+    struct tcp_hdr *tcph;
+
+    if (!(p->flags & (PBUF_FLAG_TX_CSUM_IP | PBUF_FLAG_TX_CSUM_TCP
+		      | PBUF_FLAG_TSO)))
+	return NULL;
+    // lwIP puts all the headers in the first pbuf.
+    iph = (struct ip_hdr *) ((char *) p->payload + sizeof(struct eth_hdr));
+    off->no_flags = 0;
+    off->no_l3off = sizeof(struct eth_hdr);
+    off->no_l4off = off->no_l3off + IPH_HL(iph) * 4;
+    off->no_hdrlen = 0;
+    off->no_mss = 0;
+    if (p->flags & PBUF_FLAG_TX_CSUM_IP)
+	off->no_flags |= NET_OFFLOAD_IPCSUM;
+    if (p->flags & PBUF_FLAG_TX_CSUM_TCP)
+	off->no_flags |= NET_OFFLOAD_TCPCSUM;
+    if (p->flags & PBUF_FLAG_TSO) {
+	tcph = (struct tcp_hdr *) ((char *) p->payload + off->no_l4off);
+	off->no_flags |= NET_OFFLOAD_TSO;
+	off->no_hdrlen = off->no_l4off + TCPH_HDRLEN(tcph) * 4;
+	off->no_mss = netif->mtu - (off->no_hdrlen - off->no_l3off);
+    }
+    return off;
+}
+
+/*
+ * low_level_output_ring():
+ *
+ * Copy the packet into the output environment's ring, waking it if
+ * it is asleep.  While the ring is full, the calling thread waits
+ * for the output environment's wakeup (see struct netring).
  *
  */
 static err_t
-low_level_output(struct netif *netif, struct pbuf *p)
+low_level_output_ring(struct jif *jif, struct pbuf *p)
 {
-    int r = sys_page_alloc(0, (void *)PKTMAP, PTE_U|PTE_W|PTE_P);
-    if (r < 0)
-	panic("jif: could not allocate page of memory");
-    struct jif_pkt *pkt = (struct jif_pkt *)PKTMAP;
+    struct netring *ring = jif->outring;
+    u32_t k = ring->nr_prod;
+
+    if (p->tot_len > NETRING_BUFSIZE)
+	return ERR_BUF;
+    while (k - ring->nr_cons == NETRING_SIZE) {
+	ring->nr_wait = 1;
+	__sync_synchronize();
+	if (k - ring->nr_cons != NETRING_SIZE
+	    && __sync_bool_compare_and_swap(&ring->nr_wait, 1, 0))
+	    break;
+	thread_wait(&ring->nr_wait, 1, (uint32_t)~0);
+    }
+    copy_out(p, jif->outbufs + (k % NETRING_SIZE) * NETRING_BUFSIZE);
+    ring->nr_len[k % NETRING_SIZE] = p->tot_len;
+    ring->nr_prod = k + 1;
+    __sync_synchronize();
+    if (!ring->nr_kick) {
+	ring->nr_kick = 1;
+	ipc_send(jif->envid, NSREQ_OUTPUT, 0, 0);
+    }
+    return ERR_OK;
+}
 
+/*
+ * low_level_output_copy():
+ *
+ * Copy the packet to the output environment, which waits for room on
+ * the card: through its ring if it has one, otherwise in a fresh page.
+ * The copy gets any checksums lwIP left to the card.
+ *
+ */
+static err_t
+low_level_output_copy(struct netif *netif, struct pbuf *p)
+{
     struct jif *jif;
     jif = netif->state;
+    if (jif->outring)
+	return low_level_output_ring(jif, p);
 
-    char *txbuf = pkt->jp_data;
-    int txsize = 0;
-    struct pbuf *q;
-    for (q = p; q != NULL; q = q->next) {
-	/* Send the data from the pbuf to the interface, one pbuf at a
-	   time. The size of the data in each pbuf is kept in the ->len
-	   variable. */
+    int r = sys_page_alloc(0, (void *)PKTMAP, PTE_U|PTE_W|PTE_P);
+    if (r < 0)
+	panic("jif: could not allocate page of memory");
+    struct jif_pkt *pkt = (struct jif_pkt *)PKTMAP;
 
-	if (txsize + q->len > 2000)
-	    panic("oversized packet, fragment %d txsize %d\n", q->len, txsize);
-	memcpy(&txbuf[txsize], q->payload, q->len);
-	txsize += q->len;
+    if (p->tot_len > PGSIZE - sizeof(*pkt)) {
+	sys_page_unmap(0, (void *)pkt);
+	return ERR_BUF;
     }
-
-    pkt->jp_len = txsize;
+    copy_out(p, pkt->jp_data);
+    pkt->jp_len = p->tot_len;
 
     ipc_send(jif->envid, NSREQ_OUTPUT, (void *)pkt, PTE_P|PTE_W|PTE_U);
     sys_page_unmap(0, (void *)pkt);
@@ -110,22 +338,157 @@ low_level_output(struct netif *netif, struct pbuf *p)
     return ERR_OK;
 }
 
+/*
+ * low_level_output():
+ *
+ * Should do the actual transmission of the packet. The packet is
+ * contained in the pbuf that is passed to the function. This pbuf
+ * might be chained.  Each pbuf's payload becomes one fragment that
+ * the card reads in place, and the card does the checksumming and
+ * segmentation lwIP left it.  When the card's ring is full, fall back
+ * on copying the packet to the output environment; such packets may
+ * overtake ones still waiting there, which TCP tolerates.  A TSO
+ * packet is too big to copy, so it waits for room instead.
+ *
+ */
+static err_t
+low_level_output(struct netif *netif, struct pbuf *p)
+{
+    struct net_frag frags[NET_MAXFRAGS];
+    struct net_offload offbuf, *off;
+    struct pbuf *q;
+    int n, r;
+
+    n = 0;
+    for (q = p; q != NULL && n < NET_MAXFRAGS; q = q->next)
+	if (q->len) {
+	    frags[n].nf_va = (uintptr_t) q->payload;
+	    frags[n].nf_len = q->len;
+	    n++;
+	}
+    off = low_level_offload(netif, p, &offbuf);
+
+    while (1) {
+	tx_reap();
+	r = -E_AGAIN;
+	if (q == NULL && txtail - txhead < NTXPENDING)
+	    r = sys_net_transmit_sg(frags, n, off);
+	if (r >= 0 || !(p->flags & PBUF_FLAG_TSO))
+	    break;
+	// Only a full ring is worth waiting out.
+	if (q != NULL || r != -E_AGAIN)
+	    return ERR_IF;
+	if (sys_net_wait(NET_TX) < 0)
+	    sys_yield();
+    }
+    if (r < 0)
+	return low_level_output_copy(netif, p);
+
+    pbuf_ref(p);
+    txpending[txtail % NTXPENDING].p = p;
+    txpending[txtail % NTXPENDING].seq = r;
+    txtail++;
+    return ERR_OK;
+}
+
+/*
+ * rx_csum_flags():
+ *
+ * Tell lwIP which checksums of the received packet pkt the card has
+ * already checked, so that it need not.
+ *
+ */
+static void
+rx_csum_flags(struct pbuf *p, struct jif_pkt *pkt)
+{
+    if (pkt->jp_flags & NET_RXCSUM_IP)
+	p->flags |= PBUF_FLAG_RX_CSUM_IP;
+    if (pkt->jp_flags & NET_RXCSUM_L4)
+	p->flags |= PBUF_FLAG_RX_CSUM_L4;
+}
+
+/*
+ * rx_csum_window():
+ *
+ * If the len-byte frame is an unfragmented IPv4 TCP or UDP packet,
+ * return its protocol and set [*lo, *hi) to the part of the frame
+ * that its checksum covers.  Otherwise return 0.
+ *
+ */
+static int
+rx_csum_window(char *frame, int len, int *lo, int *hi)
+{
+    struct eth_hdr *ethhdr = (struct eth_hdr *) frame;
+    struct ip_hdr *iph = (struct ip_hdr *) (frame + sizeof(*ethhdr));
+
+    if (len < sizeof(*ethhdr) + IP_HLEN || ethhdr->type != htons(ETHTYPE_IP)
+	|| IPH_V(iph) != 4 || IPH_HL(iph) * 4 < IP_HLEN
+	|| (IPH_OFFSET(iph) & htons(IP_OFFMASK | IP_MF)) != 0
+	|| (IPH_PROTO(iph) != IP_PROTO_TCP && IPH_PROTO(iph) != IP_PROTO_UDP))
+	return 0;
+    *lo = sizeof(*ethhdr) + IPH_HL(iph) * 4;
+    *hi = sizeof(*ethhdr) + ntohs(IPH_LEN(iph));
+    if (*lo >= *hi || *hi > len)
+	return 0;
+    return IPH_PROTO(iph);
+}
+
 /*
  * low_level_input():
  *
  * Should allocate a pbuf and transfer the bytes of the incoming
- * packet from the interface into the pbuf.
+ * packet from the interface into the pbuf.  The packet is a struct
+ * jif_pkt page at va in environment envid (0 for ourselves).  If a
+ * receive slot is free, the pbuf refers to the packet's page instead.
  *
  */
 static struct pbuf *
-low_level_input(void *va)
+low_level_input(envid_t envid, void *va)
 {
-    struct jif_pkt *pkt = (struct jif_pkt *)va;
-    s16_t len = pkt->jp_len;
+    struct jif_pkt *pkt;
+    struct rxpage *rp;
+    struct pbuf *p;
+    struct ip_hdr *iph;
+    int proto, lo, hi;
+    u32_t sum = 0;
+    s16_t len;
+
+    if ((rp = rxfree) != NULL
+	&& sys_page_map(envid, va, 0, rxpage_va(rp), PTE_P|PTE_U|PTE_W) == 0) {
+	pkt = rxpage_va(rp);
+	len = pkt->jp_len;
+	if (len <= 0 || len > PGSIZE - sizeof(*pkt)) {
+	    sys_page_unmap(0, pkt);
+	    return 0;
+	}
+	rxfree = rp->next;
+	p = pbuf_alloced_custom(PBUF_RAW, len, PBUF_REF, &rp->pc,
+				pkt->jp_data, len);
+	rx_csum_flags(p, pkt);
+	return p;
+    }
 
-    struct pbuf *p = pbuf_alloc(PBUF_RAW, len, PBUF_POOL);
-    if (p == 0)
+    if (envid != 0) {
+	if (sys_page_map(envid, va, 0, (void *) RXTMP, PTE_P|PTE_U) < 0)
+	    return 0;
+	va = (void *) RXTMP;
+    }
+    pkt = (struct jif_pkt *)va;
+    len = pkt->jp_len;
+
+    // Unless the card has, check the TCP or UDP checksum as we copy.
+    proto = lo = hi = 0;
+    if (!(pkt->jp_flags & NET_RXCSUM_L4))
+	proto = rx_csum_window(pkt->jp_data, len, &lo, &hi);
+
+    p = 0;
+    if (len > 0 && len <= PGSIZE - sizeof(*pkt))
+	p = pbuf_alloc(PBUF_RAW, len, PBUF_POOL);
+    if (p == 0) {
+	if (envid != 0)
+	    sys_page_unmap(0, va);
 	return 0;
+    }
 
     /* We iterate over the pbuf chain until we have read the entire
      * packet into the pbuf. */
@@ -139,10 +502,21 @@ low_level_input(void *va)
 	int bytes = q->len;
 	if (bytes > (len - copied))
 	    bytes = len - copied;
-	memcpy(q->payload, rxbuf + copied, bytes);
+	copy_sum(q->payload, rxbuf + copied, bytes, copied, lo, hi, &sum);
 	copied += bytes;
     }
+    rx_csum_flags(p, pkt);
+    if (proto) {
+	iph = (struct ip_hdr *) (pkt->jp_data + sizeof(struct eth_hdr));
+	sum += inet_chksum_pseudo_hdr((struct ip_addr *) &iph->src,
+				      (struct ip_addr *) &iph->dest,
+				      proto, hi - lo);
+	if (fold(sum) == 0xffff)
+	    p->flags |= PBUF_FLAG_RX_CSUM_L4;
+    }
 
+    if (envid != 0)
+	sys_page_unmap(0, va);
     return p;
 }
 /*
@@ -174,15 +548,30 @@ jif_output(struct netif *netif, struct pbuf *p,
 
 void
 jif_input(struct netif *netif, void *va)
+{
+    jif_input_env(netif, 0, va);
+}
+
+/*
+ * jif_input_env():
+ *
+ * Like jif_input, but the packet's page is at va in environment
+ * envid, which must be ourselves (0) or one of our children.
+ *
+ */
+
+void
+jif_input_env(struct netif *netif, envid_t envid, void *va)
 {
     struct jif *jif;
     struct eth_hdr *ethhdr;
     struct pbuf *p;
 
     jif = netif->state;
+    tx_reap();
   
     /* move received packet into a new pbuf */
-    p = low_level_input(va);
+    p = low_level_input(envid, va);
 
     /* no packet could be read, silently ignore this */
     if (p == NULL) return;
@@ -209,6 +598,48 @@ jif_input(struct netif *netif, void *va)
     }
 }
 
+/*
+ * jif_output_ring():
+ *
+ * Send packets that cannot go straight to the card through 'ring',
+ * whose packet buffers are at 'bufs', rather than one page per
+ * packet.
+ *
+ */
+
+void
+jif_output_ring(struct netif *netif, struct netring *ring, void *bufs)
+{
+    struct jif *jif = netif->state;
+
+    jif->outring = ring;
+    jif->outbufs = bufs;
+}
+
+/*
+ * jif_set_shard():
+ *
+ * Say that this stack is network server instance 'shard', which the
+ * input environment sends the TCP connections that ns_flow_shard maps
+ * to it.  jif_tcp_port_ok then keeps its outgoing connections to those.
+ *
+ */
+
+static int jif_shard;
+
+void
+jif_set_shard(int shard)
+{
+    jif_shard = shard;
+}
+
+int
+jif_tcp_port_ok(struct tcp_pcb *pcb)
+{
+    return ns_flow_shard(pcb->remote_ip.addr, pcb->remote_port,
+			 pcb->local_port) == jif_shard;
+}
+
 /*
  * jif_init():
  *
@@ -240,6 +671,8 @@ jif_init(struct netif *netif)
 
     jif->ethaddr = (struct eth_addr *)&(netif->hwaddr[0]);
     jif->envid = *output_envid; 
+    jif->outring = NULL;
+    jif->outbufs = NULL;
 
     low_level_init(netif);
 
@@ -1,4 +1,7 @@
 #include <lwip/netif.h>
 
 void	jif_input(struct netif *netif, void *va);
+void	jif_input_env(struct netif *netif, envid_t envid, void *va);
+void	jif_output_ring(struct netif *netif, struct netring *ring, void *bufs);
+void	jif_set_shard(int shard);
 err_t	jif_init(struct netif *netif);
@@ -45,6 +45,11 @@ void *memcpy(void *dst, const void *src, size_t n);
 #define TCP_SND_QUEUELEN	(2 * TCP_SND_BUF/TCP_MSS)
 //#define TCP_SND_QUEUELEN	16
 
+// Several network server instances may share the card; see jif.c.
+struct tcp_pcb;
+int jif_tcp_port_ok(struct tcp_pcb *pcb);
+#define TCP_PORT_OK(pcb)	jif_tcp_port_ok(pcb)
+
 // Print error messages when we run out of memory
 #define LWIP_DEBUG	1
 //#define TCP_DEBUG	LWIP_DBG_ON
@@ -951,11 +951,15 @@ etharp_query(struct netif *netif, struct ip_addr *ipaddr, struct pbuf *q)
       }
       if(copy_needed) {
         /* copy the whole packet into new pbufs */
-        p = pbuf_alloc(PBUF_RAW, p->tot_len, PBUF_RAM);
+        p = pbuf_alloc(PBUF_RAW, q->tot_len, PBUF_RAM);
         if(p != NULL) {
           if (pbuf_copy(p, q) != ERR_OK) {
             pbuf_free(p);
             p = NULL;
+          } else {
+            /* the netif still has to do the same work on the copy */
+            p->flags |= q->flags & (PBUF_FLAG_TX_CSUM_IP |
+                                    PBUF_FLAG_TX_CSUM_TCP | PBUF_FLAG_TSO);
           }
         }
       } else {
@@ -11,12 +11,78 @@
 #define QUEUE_SIZE	20
 #define REQVA		(0x0ffff000 - QUEUE_SIZE * PGSIZE)
 
+// Packet rings between each instance of ns and its input and output
+// environments, allocated PTE_SHARE before they are forked.  The input
+// environment puts instance k's ring entry i in a page at
+// INPAGES(k) + i * PGSIZE: instance 0, its parent, maps the page from
+// the input environment's copy of the region, and the input
+// environment maps pages straight into the other instances, which are
+// its children.  The output ring's NETRING_BUFSIZE packet buffers at
+// OUTBUFS(k) are shared.  With several instances, the input
+// environment receives each packet at INSCRATCH first, to see whose it
+// is, and copies packets that several instances need through INCOPY.
+#define NS_SHARDSPACE	((uintptr_t) 0x100000)
+#define INRING(k)	((uintptr_t) 0x10200000 + (k) * NS_SHARDSPACE)
+#define INPAGES(k)	(INRING(k) + PGSIZE)
+#define OUTRING(k)	(INRING(k) + 0x80000)
+#define OUTBUFS(k)	(OUTRING(k) + PGSIZE)
+#define OUTBUFS_SIZE	(NETRING_SIZE * NETRING_BUFSIZE)
+#define INSCRATCH	((uintptr_t) 0x101ff000)
+#define INCOPY		(INSCRATCH - PGSIZE)
+
+// State shared by all of ns's environments, at NSSHARED.
+#define NSSHARED	INRING(NS_MAXSHARDS)
+
+// An accept queue collects the connections to one listening address
+// from every instance, which has its own listening socket on it, for
+// instance 0 to hand to clients.  Its fields are under aq_lock.
+#define NACCEPTQ	16
+#define ACCEPTQ_SIZE	16
+
+struct acceptq {
+    volatile uint32_t aq_lock;
+    uint32_t aq_gen;		// bumped each time it is allocated
+    int aq_refs;		// listening sockets on it; 0 if free
+    int aq_closed;		// its clients' socket was closed
+    volatile uint32_t aq_prod;
+    volatile uint32_t aq_cons;
+    int aq_waiting;		// instance 0 threads waiting to accept
+    struct {
+	int sockid;
+	struct sockaddr addr;
+	socklen_t addrlen;
+    } aq_conn[ACCEPTQ_SIZE];
+};
+
+struct ns_shared {
+    envid_t sh_input;			// the input environment
+    envid_t sh_shard[NS_MAXSHARDS];	// each instance
+    volatile uint32_t sh_lock;		// for allocating accept queues
+    volatile uint32_t sh_closes;	// bumped when a queue is closed
+    // Accept queue of each instance's listening sockets, or -1
+    int sh_listenq[NS_NSHARDS][MEMP_NUM_NETCONN];
+    struct acceptq sh_acceptq[NACCEPTQ];
+};
+
 /* timer.c */
 void timer(envid_t ns_envid, uint32_t initial_to);
 
 /* input.c */
+extern struct netring *input_ring;
 void input(envid_t ns_envid);
 
+/* shard.c */
+extern struct ns_shared *ns_shared;
+extern int shard_id;
+void shard_init(int shard);
+void shard_poll(void);
+int shard_listen(int s, int backlog, int queue, struct Nsret_listen *ret);
+int shard_accept(int sockid, unsigned int flags, struct Nsret_accept *ret);
+int shard_close(int s);
+int shard_listening(int s);
+int shard_poll_accept(struct lwip_pollfd *fds, int nfds);
+
 /* output.c */
+extern struct netring *output_ring;
 void output(envid_t ns_envid);
 
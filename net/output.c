@@ -2,12 +2,68 @@
 
 extern union Nsipc nsipcbuf;
 
+// Set by the network server to pass packets through a ring at OUTRING(k),
+// for instance k, as well as one NSREQ_OUTPUT page at a time.
+struct netring *output_ring;
+
+// Hand a packet to the card, waiting for room if its ring is full.
+static void
+transmit(const void *buf, size_t len)
+{
+    int r;
+
+    while ((r = sys_net_transmit(buf, len)) == -E_AGAIN)
+        if ((r = sys_net_wait(NET_TX)) < 0)
+            panic("sys_net_wait: %e", r);
+    if (r < 0)
+        cprintf("ns_output: dropping packet: %e\n", r);
+}
+
+// Send everything queued in the ring, whose buffers follow it (see
+// OUTBUFS), and return once it is empty and the network server knows
+// to send a wakeup for the next packet.  Wakes the network server if
+// it is waiting for room.
+    static void
+output_drain(struct netring *ring, envid_t ns_envid)
+{
+    uint32_t k;
+
+    while (1) {
+        while ((k = ring->nr_cons) != ring->nr_prod) {
+            transmit((char *) ring + PGSIZE + (k % NETRING_SIZE) * NETRING_BUFSIZE,
+                    ring->nr_len[k % NETRING_SIZE]);
+            ring->nr_cons = k + 1;
+            __sync_synchronize();
+            if (ring->nr_wait
+                && __sync_bool_compare_and_swap(&ring->nr_wait, 1, 0))
+                ipc_send(ns_envid, NSREQ_OUTPUT, 0, 0);
+        }
+        ring->nr_kick = 0;
+        __sync_synchronize();
+        if (ring->nr_prod == ring->nr_cons)
+            return;
+        ring->nr_kick = 1;
+    }
+}
+
     void
 output(envid_t ns_envid)
 {
+    envid_t whom;
+    int perm, r;
+
     binaryname = "ns_output";
 
-    // LAB 6: Your code here:
-    // 	- read a packet from the network server
-    //	- send the packet to the device driver
+    // Hand each packet from the network server to the card.  When the
+    // transmit ring is full, sleep until the card's transmit-done
+    // interrupt frees a descriptor instead of spinning.
+    while (1) {
+        r = ipc_recv(&whom, &nsipcbuf, &perm);
+        if (whom != ns_envid || r != NSREQ_OUTPUT)
+            continue;
+        if (perm & PTE_P)
+            transmit(nsipcbuf.pkt.jp_data, nsipcbuf.pkt.jp_len);
+        else if (output_ring)
+            output_drain(output_ring, ns_envid);
+    }
 }
@@ -44,7 +44,6 @@ static struct timer_thread t_tcpf;
 static struct timer_thread t_tcps;
 
 static envid_t timer_envid;
-static envid_t input_envid;
 static envid_t output_envid;
 
 static bool buse[QUEUE_SIZE];
@@ -143,6 +142,7 @@ serve_init(uint32_t ipaddr, uint32_t netmask, uint32_t gw)
     lwip_core_lock();
 
     lwip_init(&nif, &output_envid, ipaddr, netmask, gw);
+    jif_output_ring(&nif, output_ring, (void *) OUTBUFS(shard_id));
 
     start_timer(&t_arp, &etharp_tmr, "arp timer", ARP_TMR_INTERVAL);
     start_timer(&t_tcpf, &tcp_fasttmr, "tcp f timer", TCP_FAST_INTERVAL);
@@ -177,68 +177,238 @@ process_timer(envid_t envid) {
     ipc_send(envid, to, 0, 0);
 }
 
+// Pass every packet waiting in the input ring to lwIP, without a
+// thread or an IPC per packet, waking the input environment if it is
+// waiting for room.  Returns once the ring is empty and the input
+// environment knows to send a wakeup for the next packet.
+static void
+process_input(void) {
+    struct netring *ring = input_ring;
+    uint32_t k;
+
+    while (1) {
+        while ((k = ring->nr_cons) != ring->nr_prod) {
+            // the input environment maps instance 0's packets from
+            // its own pages and every other instance's into ours
+            jif_input_env(&nif, shard_id == 0 ? ns_shared->sh_input : 0,
+                    (void *) (INPAGES(shard_id) + (k % NETRING_SIZE) * PGSIZE));
+            ring->nr_cons = k + 1;
+            __sync_synchronize();
+            if (ring->nr_wait
+                && __sync_bool_compare_and_swap(&ring->nr_wait, 1, 0))
+                ipc_send(ns_shared->sh_input, NSREQ_INPUT, 0, 0);
+        }
+        ring->nr_kick = 0;
+        __sync_synchronize();
+        if (ring->nr_prod == ring->nr_cons)
+            return;
+        ring->nr_kick = 1;
+    }
+}
+
+// A client request, in the page at REQVA + i * PGSIZE for slot i.
 struct st_args {
     int32_t reqno;
     uint32_t whom;
     union Nsipc *req;
+    int next;           // next slot in the same socket queue, or -1
 };
 
-static void
-serve_thread(uint64_t a) {
-    struct st_args *args = (struct st_args *)a;
+static struct st_args reqs[QUEUE_SIZE];
+
+// Requests on one socket that must wait for an earlier one to finish.
+// Sends are queued behind a send that is waiting for the peer, and
+// receives and accepts behind a receive or accept, so that a socket's
+// data goes out and comes in in the order it was asked for, and so
+// that only one worker at a time is parked on each.
+struct sock_queue {
+    int sq_first, sq_last;      // slots waiting, or -1
+    bool sq_busy;               // a worker has a request on the socket
+};
+
+#define NSOCKQ MEMP_NUM_NETCONN
+static struct sock_queue sendq[NSOCKQ];
+static struct sock_queue recvq[NSOCKQ];
+
+// Worker threads, created as requests that may block need them and
+// kept for the next.  A busy worker holds at least one request slot,
+// and ipc_recv always holds one more, so there are never more than
+// QUEUE_SIZE of them.
+struct worker {
+    uint32_t w_req;             // slot + 1 of the request to serve, or 0
+    struct worker *w_next;      // next idle worker
+};
+
+static struct worker workers[QUEUE_SIZE];
+static struct worker *idle_workers;
+static int nworkers;
+
+// The lwIP socket that socket id 'sockid' names, or -1 if it is not
+// one of this instance's.
+static int
+lwip_sock(int sockid)
+{
+    if (sockid < 0 || NS_SOCKSHARD(sockid) != shard_id)
+        return -1;
+    return NS_SOCKLWIP(sockid);
+}
+
+static struct sock_queue *
+req_queue(struct st_args *args)
+{
+    struct sock_queue *q;
+    int s;
+
+    switch (args->reqno) {
+        case NSREQ_SEND:
+            q = sendq;
+            s = lwip_sock(args->req->send.req_s);
+            break;
+        case NSREQ_RECV:
+            q = recvq;
+            s = lwip_sock(args->req->recv.req_s);
+            break;
+        case NSREQ_ACCEPT:
+            // With several instances, accepts wait on an accept queue.
+            if (NS_NSHARDS > 1)
+                return 0;
+            q = recvq;
+            s = lwip_sock(args->req->accept.req_s);
+            break;
+        default:
+            return 0;
+    }
+    if (s < 0 || s >= NSOCKQ)
+        return 0;
+    return &q[s];
+}
+
+// Wait until one of the sockets that req polls has an event, or its
+// timeout passes.  With several instances, a listening socket's
+// connections wait in its accept queue, where lwIP does not see them,
+// so look at the queues every NSPOLL_SLICE milliseconds.
+static int
+serve_poll(struct Nsreq_poll *req)
+{
+    struct lwip_pollfd *fds = req->req_fds;
+    int i, n = req->req_nfds, timeout = req->req_timeout;
+    int wait, nready, listening = 0;
+    uint32_t deadline = sys_time_msec() + timeout;
+
+    if (n < 0 || n > NSPOLL_MAX)
+        return -E_INVAL;
+    for (i = 0; i < n; i++) {
+        fds[i].fd = lwip_sock(fds[i].fd);
+        fds[i].revents = 0;
+        if (NS_NSHARDS > 1 && shard_listening(fds[i].fd))
+            listening = 1;
+    }
+
+    while (1) {
+        wait = timeout;
+        if (timeout > 0)
+            wait = MAX((int32_t) (deadline - sys_time_msec()), 0);
+        if (listening && (wait < 0 || wait > NSPOLL_SLICE))
+            wait = NSPOLL_SLICE;
+        if (listening && shard_poll_accept(fds, n))
+            wait = 0;
+        if ((nready = lwip_poll(fds, n, wait)) < 0)
+            return nready;
+        if (listening)
+            nready += shard_poll_accept(fds, n);
+        if (nready || timeout == 0
+            || (timeout > 0 && (int32_t) (deadline - sys_time_msec()) <= 0))
+            return nready;
+    }
+}
+
+// Serve the request in slot i.  Returns the slot of the next request
+// waiting on the same socket, which the caller should serve next, or -1.
+static int
+serve_req(int i) {
+    struct st_args *args = &reqs[i];
     union Nsipc *req = args->req;
+    // The reply overwrites the request, so find its queue first.
+    struct sock_queue *q = req_queue(args);
     int r;
 
     switch (args->reqno) {
         case NSREQ_ACCEPT:
             {
                 struct Nsret_accept ret;
-                r = lwip_accept(req->accept.req_s, &ret.ret_addr,
-                        &ret.ret_addrlen);
+                int s = lwip_sock(req->accept.req_s);
+                if (NS_NSHARDS > 1) {
+                    r = shard_accept(req->accept.req_s, req->accept.req_flags,
+                            &ret);
+                } else if ((req->accept.req_flags & MSG_DONTWAIT)
+                        && s >= 0 && !lwip_accept_ready(s)) {
+                    r = -E_AGAIN;
+                } else if ((r = lwip_accept(s, &ret.ret_addr,
+                                &ret.ret_addrlen)) >= 0)
+                    r = NS_SOCKID(r, shard_id);
                 memmove(req, &ret, sizeof ret);
                 break;
             }
         case NSREQ_BIND:
-            r = lwip_bind(req->bind.req_s, &req->bind.req_name,
+            r = lwip_bind(lwip_sock(req->bind.req_s), &req->bind.req_name,
                     req->bind.req_namelen);
             break;
         case NSREQ_SHUTDOWN:
-            r = lwip_shutdown(req->shutdown.req_s, req->shutdown.req_how);
+            r = lwip_shutdown(lwip_sock(req->shutdown.req_s),
+                    req->shutdown.req_how);
             break;
         case NSREQ_CLOSE:
-            r = lwip_close(req->close.req_s);
+            r = shard_close(lwip_sock(req->close.req_s));
             break;
         case NSREQ_CONNECT:
-            r = lwip_connect(req->connect.req_s, &req->connect.req_name,
-                    req->connect.req_namelen);
+            r = lwip_connect(lwip_sock(req->connect.req_s),
+                    &req->connect.req_name, req->connect.req_namelen);
             break;
         case NSREQ_LISTEN:
-            r = lwip_listen(req->listen.req_s, req->listen.req_backlog);
+            if (NS_NSHARDS > 1) {
+                struct Nsreq_listen listen = req->listen;
+                r = shard_listen(lwip_sock(listen.req_s), listen.req_backlog,
+                        listen.req_queue, &req->listenRet);
+            } else
+                r = lwip_listen(lwip_sock(req->listen.req_s),
+                        req->listen.req_backlog);
             break;
         case NSREQ_RECV:
             // Note that we read the request fields before we
             // overwrite it with the response data.
-            r = lwip_recv(req->recv.req_s, req->recvRet.ret_buf,
+            r = lwip_recv(lwip_sock(req->recv.req_s), req->recvRet.ret_buf,
                     req->recv.req_len, req->recv.req_flags);
             break;
         case NSREQ_SEND:
-            r = lwip_send(req->send.req_s, &req->send.req_buf,
+            r = lwip_send(lwip_sock(req->send.req_s), &req->send.req_buf,
                     req->send.req_size, req->send.req_flags);
             break;
         case NSREQ_SOCKET:
-            r = lwip_socket(req->socket.req_domain, req->socket.req_type,
-                    req->socket.req_protocol);
+            if ((r = lwip_socket(req->socket.req_domain, req->socket.req_type,
+                            req->socket.req_protocol)) >= 0)
+                r = NS_SOCKID(r, shard_id);
+            break;
+        case NSREQ_SHARDS:
+            memmove(req->shardsRet.ret_envid, ns_shared->sh_shard,
+                    sizeof(req->shardsRet.ret_envid));
+            r = 0;
+            break;
+        case NSREQ_POLL:
+            r = serve_poll(&req->poll);
             break;
         case NSREQ_INPUT:
             jif_input(&nif, (void *)&req->pkt);
             r = 0;
             break;
         default:
-            cprintf("Invalid request code %d from %08x\n", args->whom, args->req);
+            cprintf("Invalid request code %d from %08x\n", args->reqno, args->whom);
             r = -E_INVAL;
             break;
     }
 
+    // lwIP's non-blocking calls fail with EWOULDBLOCK.
+    if (r == -1 && errno == EWOULDBLOCK)
+        r = -E_AGAIN;
     if (r == -1) {
         char buf[100];
         snprintf(buf, sizeof buf, "ns req type %d", args->reqno);
@@ -248,9 +418,123 @@ serve_thread(uint64_t a) {
     if (args->reqno != NSREQ_INPUT)
         ipc_send(args->whom, r, 0, 0);
 
-    put_buffer(args->req);
-    sys_page_unmap(0, (void*) args->req);
-    free(args);
+    put_buffer(req);
+    sys_page_unmap(0, (void*) req);
+
+    if (!q)
+        return -1;
+    if ((i = q->sq_first) < 0) {
+        q->sq_busy = 0;
+        return -1;
+    }
+    if ((q->sq_first = reqs[i].next) < 0)
+        q->sq_last = -1;
+    return i;
+}
+
+static void
+serve_worker(uint64_t arg) {
+    struct worker *w = &workers[arg];
+    int i;
+
+    while (1) {
+        while (!w->w_req)
+            thread_wait(&w->w_req, 0, (uint32_t)~0);
+        for (i = w->w_req - 1; i >= 0; i = serve_req(i))
+            ;
+        w->w_req = 0;
+        w->w_next = idle_workers;
+        idle_workers = w;
+    }
+}
+
+// Hand the request in slot i to an idle worker, starting a new one if
+// every worker is parked in lwIP.
+static void
+dispatch(int i) {
+    struct worker *w;
+    int r;
+
+    if ((w = idle_workers)) {
+        idle_workers = w->w_next;
+        w->w_req = i + 1;
+        thread_wakeup(&w->w_req);
+        return;
+    }
+
+    assert(nworkers < QUEUE_SIZE);
+    w = &workers[nworkers];
+    w->w_req = i + 1;
+    if ((r = thread_create(0, "serve_worker", serve_worker, nworkers)) < 0)
+        panic("cannot create worker thread: %s", e2s(r));
+    nworkers++;
+}
+
+// Whether the request in slot i has MSG_DONTWAIT, and so must never
+// wait, not even for another request on its socket.
+static bool
+req_dontwait(struct st_args *args) {
+    switch (args->reqno) {
+        case NSREQ_ACCEPT:
+            return (args->req->accept.req_flags & MSG_DONTWAIT) != 0;
+        case NSREQ_RECV:
+            return (args->req->recv.req_flags & MSG_DONTWAIT) != 0;
+        case NSREQ_SEND:
+            return (args->req->send.req_flags & MSG_DONTWAIT) != 0;
+        default:
+            return 0;
+    }
+}
+
+// Whether the request in slot i can be served by the main loop itself:
+// it may yield to the tcpip thread, but never waits on the network,
+// which only the main loop feeds.
+static bool
+serve_inline(int i) {
+    struct st_args *args = &reqs[i];
+
+    switch (args->reqno) {
+        case NSREQ_INPUT:
+        case NSREQ_SOCKET:
+        case NSREQ_BIND:
+        case NSREQ_LISTEN:
+        case NSREQ_SHARDS:
+            return 1;
+        case NSREQ_SEND:
+            if (req_dontwait(args))
+                return 1;
+            return lwip_send_ready(lwip_sock(args->req->send.req_s),
+                    args->req->send.req_size);
+        case NSREQ_POLL:
+            return args->req->poll.req_timeout == 0;
+        default:
+            return req_dontwait(args);
+    }
+}
+
+static void
+serve_request(int i) {
+    struct sock_queue *q = req_queue(&reqs[i]);
+
+    reqs[i].next = -1;
+    if (q && q->sq_busy && req_dontwait(&reqs[i])) {
+        // It would wait for the request that is parked on the socket.
+        ipc_send(reqs[i].whom, -E_AGAIN, 0, 0);
+        put_buffer(reqs[i].req);
+        sys_page_unmap(0, (void *) reqs[i].req);
+    } else if (q && q->sq_busy) {
+        if (q->sq_last >= 0)
+            reqs[q->sq_last].next = i;
+        else
+            q->sq_first = i;
+        q->sq_last = i;
+    } else if (serve_inline(i)) {
+        serve_req(i);
+    } else {
+        if (q)
+            q->sq_busy = 1;
+        dispatch(i);
+    }
 }
 
 void
@@ -260,7 +544,15 @@ serve(void) {
     int i, perm;
     void *va;
 
+    for (i = 0; i < NSOCKQ; i++) {
+        sendq[i].sq_first = sendq[i].sq_last = -1;
+        recvq[i].sq_first = recvq[i].sq_last = -1;
+    }
+
     while (1) {
+        if (NS_NSHARDS > 1)
+            shard_poll();
+
         // ipc_recv will block the entire process, so we flush
         // all pending work from other threads.  We limit the
         // number of yields in case there's a rogue thread.
@@ -280,6 +572,24 @@ serve(void) {
             put_buffer(va);
             continue;
         }
+        if (reqno == NSREQ_INPUT && whom == ns_shared->sh_input
+                && !(perm & PTE_P)) {
+            process_input();
+            put_buffer(va);
+            continue;
+        }
+        if (reqno == NSREQ_OUTPUT && whom == output_envid
+                && !(perm & PTE_P)) {
+            // output freed room in its ring for a waiting thread
+            thread_wakeup(&output_ring->nr_wait);
+            put_buffer(va);
+            continue;
+        }
+        if (reqno == NSREQ_WAKEUP && !(perm & PTE_P)) {
+            // shard_poll will find what another instance left us
+            put_buffer(va);
+            continue;
+        }
 
         // All remaining requests must contain an argument page
         if (!(perm & PTE_P)) {
@@ -287,18 +597,11 @@ serve(void) {
             continue; // just leave it hanging...
         }
 
-        // Since some lwIP socket calls will block, create a thread and
-        // process the rest of the request in the thread.
-        struct st_args *args = malloc(sizeof(struct st_args));
-        if (!args)
-            panic("could not allocate thread args structure");
-
-        args->reqno = reqno;
-        args->whom = whom;
-        args->req = va;
-
-        thread_create(0, "serve_thread", serve_thread, (uint64_t)args);
-        thread_yield(); // let the thread created run
+        i = ((uint64_t)va - REQVA) / PGSIZE;
+        reqs[i].reqno = reqno;
+        reqs[i].whom = whom;
+        reqs[i].req = va;
+        serve_request(i);
     }
 }
 
@@ -310,13 +613,72 @@ tmain(uint64_t arg) {
     serve();
 }
 
+static void
+alloc_shared(uintptr_t va)
+{
+    int r;
+
+    if ((r = sys_page_alloc(0, (void *) va, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+        panic("sys_page_alloc: %e", r);
+}
+
     void
 umain(int argc, char **argv)
 {
-    envid_t ns_envid = sys_getenvid();
+    envid_t ns_envid, input_envid;
+    uintptr_t va;
+    int i, shard;
 
     binaryname = "ns";
 
+    // Share struct ns_shared between all of our environments, and each
+    // instance's packet rings with the input environment and its own
+    // output environment.
+    for (va = NSSHARED; va < NSSHARED + sizeof(struct ns_shared); va += PGSIZE)
+        alloc_shared(va);
+    ns_shared = (struct ns_shared *) NSSHARED;
+    memset(ns_shared->sh_listenq, 0xff, sizeof(ns_shared->sh_listenq));
+    for (shard = 0; shard < NS_NSHARDS; shard++) {
+        alloc_shared(INRING(shard));
+        for (i = 0; i < PGSIZE + OUTBUFS_SIZE; i += PGSIZE)
+            alloc_shared(OUTRING(shard) + i);
+    }
+
+    // fork off the input environment, which will wait on the NIC
+    // driver for input packets and steer them to each instance.  It
+    // forks the other instances of the server, so that it can map
+    // packets into their rings; each goes on to start its own timer
+    // and output environments.
+    ns_shared->sh_shard[0] = sys_getenvid();
+    input_ring = (struct netring *) INRING(0);
+    if ((input_envid = fork()) < 0)
+        panic("error forking");
+    else if (input_envid == 0) {
+        for (shard = 1; shard < NS_NSHARDS; shard++) {
+            if ((ns_envid = fork()) < 0)
+                panic("error forking");
+            else if (ns_envid == 0)
+                break;
+            ns_shared->sh_shard[shard] = ns_envid;
+        }
+        if (shard == NS_NSHARDS) {
+            // before any instance can hear from us
+            ns_shared->sh_input = sys_getenvid();
+            input(ns_shared->sh_shard[0]);
+            return;
+        }
+    } else {
+        // so that NSREQ_SHARDS finds every instance
+        while (!ns_shared->sh_input)
+            sys_yield();
+        shard = 0;
+    }
+
+    ns_envid = sys_getenvid();
+    shard_init(shard);
+    input_ring = (struct netring *) INRING(shard);
+    output_ring = (struct netring *) OUTRING(shard);
+
     // fork off the timer thread which will send us periodic messages
     timer_envid = fork();
     if (timer_envid < 0)
@@ -326,16 +688,6 @@ umain(int argc, char **argv)
         return;
     }
 
-    // fork off the input thread which will poll the NIC driver for input
-    // packets
-    input_envid = fork();
-    if (input_envid < 0)
-        panic("error forking");
-    else if (input_envid == 0) {
-        input(ns_envid);
-        return;
-    }
-
     // fork off the output thread that will send the packets to the NIC
     // driver
     output_envid = fork();
@@ -0,0 +1,363 @@
+// Listening sockets across several instances of the network server.
+//
+// Each instance has its own lwIP stack, and the input environment
+// steers every TCP segment to the instance that owns its connection.
+// A connection to a listening address can therefore turn up on any
+// instance, so nsipc_listen listens on the address on all of them,
+// and each instance moves the connections its socket accepts into a
+// shared accept queue.  Clients accept from the queue through
+// instance 0.  Accepting happens in shard_poll, from the main loop,
+// and only when lwIP has a connection waiting, so that no thread is
+// ever left blocked in lwip_accept on a socket that another instance
+// closes.
+
+#include "ns.h"
+
+#include <inc/x86.h>
+#include <arch/thread.h>
+#include <lwip/sockets.h>
+#include <jif/jif.h>
+
+int shard_id;
+
+// This instance's listening sockets that feed an accept queue.
+static struct listener {
+    int l_queue;		// -1 if the socket is not one
+    uint32_t l_gen;		// the queue's aq_gen when we joined it
+    int l_conn;			// accepted, but the queue was full; or -1
+    struct sockaddr l_addr;
+    socklen_t l_addrlen;
+} listeners[MEMP_NUM_NETCONN];
+
+static int nlisteners;
+static uint32_t closes_seen;
+
+static void
+spin_lock(volatile uint32_t *lock)
+{
+    // The holder may be an environment waiting for this CPU.
+    while (xchg(lock, 1))
+	sys_yield();
+}
+
+static void
+spin_unlock(volatile uint32_t *lock)
+{
+    xchg(lock, 0);
+}
+
+void
+shard_init(int shard)
+{
+    int s;
+
+    shard_id = shard;
+    for (s = 0; s < MEMP_NUM_NETCONN; s++)
+	listeners[s].l_queue = -1;
+    jif_set_shard(shard);
+}
+
+static int
+acceptq_alloc(uint32_t *gen)
+{
+    struct acceptq *aq;
+    int q;
+
+    spin_lock(&ns_shared->sh_lock);
+    for (q = 0; q < NACCEPTQ; q++) {
+	aq = &ns_shared->sh_acceptq[q];
+	spin_lock(&aq->aq_lock);
+	if (aq->aq_refs == 0) {
+	    aq->aq_refs = 1;
+	    *gen = ++aq->aq_gen;
+	    aq->aq_closed = 0;
+	    aq->aq_prod = aq->aq_cons = 0;
+	    aq->aq_waiting = 0;
+	    spin_unlock(&aq->aq_lock);
+	    break;
+	}
+	spin_unlock(&aq->aq_lock);
+    }
+    spin_unlock(&ns_shared->sh_lock);
+    return q < NACCEPTQ ? q : -E_NO_MEM;
+}
+
+static int
+acceptq_join(int q, uint32_t *gen)
+{
+    struct acceptq *aq = &ns_shared->sh_acceptq[q];
+    int r = -E_INVAL;
+
+    spin_lock(&aq->aq_lock);
+    if (aq->aq_refs > 0 && !aq->aq_closed) {
+	aq->aq_refs++;
+	*gen = aq->aq_gen;
+	r = 0;
+    }
+    spin_unlock(&aq->aq_lock);
+    return r;
+}
+
+// Queue the connection that listener l holds for instance 0.  Returns
+// 1 if it was queued, 0 if the queue is full, or -1 if it is closed.
+static int
+acceptq_push(struct listener *l)
+{
+    struct acceptq *aq = &ns_shared->sh_acceptq[l->l_queue];
+    uint32_t k;
+    int r;
+
+    spin_lock(&aq->aq_lock);
+    if (aq->aq_gen != l->l_gen || aq->aq_closed)
+	r = -1;
+    else if ((k = aq->aq_prod) - aq->aq_cons == ACCEPTQ_SIZE)
+	r = 0;
+    else {
+	aq->aq_conn[k % ACCEPTQ_SIZE].sockid = NS_SOCKID(l->l_conn, shard_id);
+	aq->aq_conn[k % ACCEPTQ_SIZE].addr = l->l_addr;
+	aq->aq_conn[k % ACCEPTQ_SIZE].addrlen = l->l_addrlen;
+	aq->aq_prod = k + 1;
+	r = 1;
+    }
+    spin_unlock(&aq->aq_lock);
+    if (r <= 0)
+	return r;
+
+    // Instance 0 sets aq_waiting before it last looks at aq_prod.
+    __sync_synchronize();
+    if (aq->aq_waiting) {
+	if (shard_id == 0)
+	    thread_wakeup(&aq->aq_prod);
+	else
+	    ipc_send(ns_shared->sh_shard[0], NSREQ_WAKEUP, 0, 0);
+    }
+    l->l_conn = -1;
+    return 1;
+}
+
+// Stop feeding socket s's accept queue, closing the connections of
+// ours that are still in it.
+static void
+listener_drop(int s)
+{
+    struct listener *l = &listeners[s];
+    struct acceptq *aq = &ns_shared->sh_acceptq[l->l_queue];
+    int conns[ACCEPTQ_SIZE];
+    int i, n = 0;
+    uint32_t k;
+
+    spin_lock(&aq->aq_lock);
+    if (aq->aq_gen == l->l_gen) {
+	for (k = aq->aq_cons; k != aq->aq_prod; k++) {
+	    i = aq->aq_conn[k % ACCEPTQ_SIZE].sockid;
+	    if (i >= 0 && NS_SOCKSHARD(i) == shard_id) {
+		conns[n++] = NS_SOCKLWIP(i);
+		aq->aq_conn[k % ACCEPTQ_SIZE].sockid = -1;
+	    }
+	}
+	aq->aq_refs--;
+    }
+    spin_unlock(&aq->aq_lock);
+
+    ns_shared->sh_listenq[shard_id][s] = -1;
+    l->l_queue = -1;
+    nlisteners--;
+    if (l->l_conn >= 0)
+	conns[n++] = l->l_conn;
+    for (i = 0; i < n; i++)
+	lwip_close(conns[i]);
+}
+
+// Listen on lwIP socket s.  If 'queue' is -1, s gets a new accept
+// queue, which the sockets that stand in for s on the other instances
+// then join; otherwise s is one of those, and joins 'queue'.
+int
+shard_listen(int s, int backlog, int queue, struct Nsret_listen *ret)
+{
+    struct listener *l;
+    uint32_t gen;
+    int r;
+
+    if ((r = lwip_listen(s, backlog)) < 0)
+	return r;
+    if (s < 0 || s >= MEMP_NUM_NETCONN)
+	return -E_INVAL;
+    l = &listeners[s];
+    if (l->l_queue < 0) {
+	if (queue < 0)
+	    queue = r = acceptq_alloc(&gen);
+	else if (queue >= NACCEPTQ)
+	    r = -E_INVAL;
+	else
+	    r = acceptq_join(queue, &gen);
+	if (r < 0)
+	    return r;
+	l->l_queue = queue;
+	l->l_gen = gen;
+	l->l_conn = -1;
+	nlisteners++;
+	ns_shared->sh_listenq[shard_id][s] = queue;
+    }
+
+    ret->ret_queue = l->l_queue;
+    ret->ret_namelen = sizeof(ret->ret_name);
+    return lwip_getsockname(s, &ret->ret_name, &ret->ret_namelen);
+}
+
+// Take a connection from the accept queue of the listening socket
+// with id 'sockid', waiting for one if need be, unless 'flags' has
+// MSG_DONTWAIT.  Only instance 0 serves accepts.
+int
+shard_accept(int sockid, unsigned int flags, struct Nsret_accept *ret)
+{
+    struct acceptq *aq;
+    uint32_t k;
+    int s, q, r;
+
+    s = NS_SOCKLWIP(sockid);
+    if (sockid < 0 || s >= MEMP_NUM_NETCONN
+	|| (q = ns_shared->sh_listenq[NS_SOCKSHARD(sockid)][s]) < 0)
+	return -E_INVAL;
+    aq = &ns_shared->sh_acceptq[q];
+
+    while (1) {
+	spin_lock(&aq->aq_lock);
+	r = -E_AGAIN;
+	if (aq->aq_closed)
+	    r = -E_INVAL;
+	else if ((k = aq->aq_cons) != aq->aq_prod) {
+	    r = aq->aq_conn[k % ACCEPTQ_SIZE].sockid;
+	    ret->ret_addr = aq->aq_conn[k % ACCEPTQ_SIZE].addr;
+	    ret->ret_addrlen = aq->aq_conn[k % ACCEPTQ_SIZE].addrlen;
+	    aq->aq_cons = k + 1;
+	}
+	spin_unlock(&aq->aq_lock);
+	if (r != -E_AGAIN || (flags & MSG_DONTWAIT))
+	    return r;
+
+	// Producers look at aq_waiting after they advance aq_prod.
+	aq->aq_waiting++;
+	__sync_synchronize();
+	k = aq->aq_prod;
+	if (k == aq->aq_cons && !aq->aq_closed)
+	    thread_wait(&aq->aq_prod, k, (uint32_t)~0);
+	aq->aq_waiting--;
+    }
+}
+
+// Whether lwIP socket s is listening for every instance.
+int
+shard_listening(int s)
+{
+    return s >= 0 && s < MEMP_NUM_NETCONN && listeners[s].l_queue >= 0;
+}
+
+// Report POLLIN for the listening sockets in fds whose accept queue has
+// a connection.  Returns the number of entries that had no events
+// before.
+int
+shard_poll_accept(struct lwip_pollfd *fds, int nfds)
+{
+    struct acceptq *aq;
+    int i, n = 0;
+
+    for (i = 0; i < nfds; i++) {
+        if (!(fds[i].events & POLLIN) || !shard_listening(fds[i].fd))
+            continue;
+        aq = &ns_shared->sh_acceptq[listeners[fds[i].fd].l_queue];
+        if (aq->aq_prod == aq->aq_cons && !aq->aq_closed)
+            continue;
+        if (!fds[i].revents)
+            n++;
+        fds[i].revents |= POLLIN;
+    }
+    return n;
+}
+
+// Close lwIP socket s.  If it is listening for every instance, close
+// its accept queue too; each instance closes its own socket on the
+// queue when it notices, in shard_poll.
+int
+shard_close(int s)
+{
+    struct listener *l;
+    struct acceptq *aq;
+    int k;
+
+    if (s >= 0 && s < MEMP_NUM_NETCONN && (l = &listeners[s])->l_queue >= 0) {
+	aq = &ns_shared->sh_acceptq[l->l_queue];
+	spin_lock(&aq->aq_lock);
+	if (aq->aq_gen == l->l_gen)
+	    aq->aq_closed = 1;
+	spin_unlock(&aq->aq_lock);
+	__sync_fetch_and_add(&ns_shared->sh_closes, 1);
+
+	// Waking the others is only a hint: two instances that both
+	// blocked in ipc_send to each other would deadlock.
+	for (k = 0; k < NS_NSHARDS; k++)
+	    if (k != shard_id)
+		sys_ipc_try_send(ns_shared->sh_shard[k], NSREQ_WAKEUP, 0, 0);
+	listener_drop(s);
+    }
+    return lwip_close(s);
+}
+
+// Called from the main loop before it waits for the next request:
+// move newly accepted connections into their accept queues, close
+// listening sockets whose queue was closed elsewhere, and, on instance
+// 0, wake the accepts that the queues can now satisfy.
+void
+shard_poll(void)
+{
+    struct listener *l;
+    struct acceptq *aq;
+    uint32_t closes;
+    int s, q, r;
+
+    if ((closes = ns_shared->sh_closes) != closes_seen) {
+	closes_seen = closes;
+	for (s = 0; s < MEMP_NUM_NETCONN; s++) {
+	    l = &listeners[s];
+	    if (l->l_queue < 0)
+		continue;
+	    aq = &ns_shared->sh_acceptq[l->l_queue];
+	    if (aq->aq_closed || aq->aq_gen != l->l_gen) {
+		listener_drop(s);
+		lwip_close(s);
+	    }
+	}
+    }
+
+    // lwip_accept yields to the tcpip thread, and so may our caller's
+    // other threads, so check each listener again after every call.
+    for (s = 0; nlisteners && s < MEMP_NUM_NETCONN; s++) {
+	l = &listeners[s];
+	while (l->l_queue >= 0) {
+	    if (l->l_conn < 0) {
+		if (!lwip_accept_ready(s))
+		    break;
+		l->l_addrlen = sizeof(l->l_addr);
+		if ((l->l_conn = lwip_accept(s, &l->l_addr, &l->l_addrlen)) < 0)
+		    break;
+		if (l->l_queue < 0) {
+		    lwip_close(l->l_conn);
+		    break;
+		}
+	    }
+	    if ((r = acceptq_push(l)) < 0) {	// the queue was closed
+		lwip_close(l->l_conn);
+		l->l_conn = -1;
+	    }
+	    if (r <= 0)
+		break;
+	}
+    }
+
+    if (shard_id != 0)
+	return;
+    for (q = 0; q < NACCEPTQ; q++) {
+	aq = &ns_shared->sh_acceptq[q];
+	if (aq->aq_waiting && (aq->aq_prod != aq->aq_cons || aq->aq_closed))
+	    thread_wakeup(&aq->aq_prod);
+    }
+}
@@ -5,8 +5,21 @@ char buf[8192];
 void
 cat(int f, char *s)
 {
-	long n;
+	long n, total = 0;
 	int r;
+	void *p;
+
+	// Regular files are mapped block by block instead of copied.
+	while ((n = read_mapped(f, (void *) UTEMP, &p)) > 0) {
+		if ((r = write(1, p, n)) != n)
+			panic("write error copying %s: %e", s, r);
+		total += n;
+	}
+	sys_page_unmap(0, (void *) UTEMP);
+	if (n == 0)
+		return;
+	if (total > 0)
+		panic("error reading %s: %e", s, n);
 
 	while ((n = read(f, buf, (long)sizeof(buf))) > 0)
 		if ((r = write(1, buf, n)) != n)
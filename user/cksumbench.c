@@ -0,0 +1,133 @@
+// Internet checksum benchmark.
+//
+// Compares lwIP's reference checksum, which the network server used
+// until LWIP_CHKSUM became jos_chksum, with jos_chksum and with
+// jos_chksum_copy, the fused copy-and-checksum jif uses when it has to
+// copy a packet, on buffers from 64 bytes to 64KB.  It first checks
+// that all three agree, at every alignment.  Run it with
+// 'make cksumbench'.
+
+#include <inc/lib.h>
+#include <arch/cc.h>
+
+#define MAXLEN		65535	// lwIP checksums at most a u16_t's worth
+#define MINMS		200	// time each measurement at least this long
+
+static const int sizes[] = { 64, 256, 576, 1500, 4096, 16384, MAXLEN };
+#define NSIZES		(sizeof(sizes) / sizeof(sizes[0]))
+
+static uint8_t src[MAXLEN + 8];
+static uint8_t dst[MAXLEN + 8];
+static uint32_t seed = 1;
+
+static uint32_t
+rand(void)
+{
+	seed = seed * 1103515245 + 12345;
+	return seed >> 8;
+}
+
+// lwIP's checksum algorithm #1 from inet_chksum.c.
+static u16_t
+ref_chksum(void *dataptr, u16_t len)
+{
+	u32_t acc;
+	u16_t src;
+	u8_t *octetptr;
+
+	acc = 0;
+	octetptr = (u8_t *) dataptr;
+	while (len > 1) {
+		src = (*octetptr) << 8;
+		octetptr++;
+		src |= (*octetptr);
+		octetptr++;
+		acc += src;
+		len -= 2;
+	}
+	if (len > 0) {
+		src = (*octetptr) << 8;
+		acc += src;
+	}
+	acc = (acc >> 16) + (acc & 0x0000ffffUL);
+	if ((acc & 0xffff0000) != 0)
+		acc = (acc >> 16) + (acc & 0x0000ffffUL);
+	return (acc >> 8 | acc << 8) & 0xffff;
+}
+
+static u16_t
+run_ref(int len)
+{
+	return ref_chksum(src, len);
+}
+
+static u16_t
+run_new(int len)
+{
+	return jos_chksum(src, len);
+}
+
+static u16_t
+run_copy(int len)
+{
+	return jos_chksum_copy(dst, src, len);
+}
+
+static void
+check(void)
+{
+	int i, off, len;
+	u16_t r;
+
+	for (i = 0; i < 4096; i++) {
+		off = rand() % 8;
+		len = i < 64 ? MAXLEN - off : rand() % 2048;
+		r = ref_chksum(src + off, len);
+		if (jos_chksum(src + off, len) != r)
+			panic("jos_chksum: offset %d len %d: %04x, not %04x",
+			      off, len, jos_chksum(src + off, len), r);
+		if (jos_chksum_copy(dst + i % 8, src + off, len) != r
+		    || memcmp(dst + i % 8, src + off, len) != 0)
+			panic("jos_chksum_copy: offset %d len %d", off, len);
+	}
+}
+
+// Print the throughput of fn on len-byte buffers.
+static void
+bench(const char *what, u16_t (*fn)(int), int len)
+{
+	unsigned start, ms;
+	uint64_t bytes;
+	int n, i;
+
+	for (n = 1; ; n *= 2) {
+		start = sys_time_msec();
+		for (i = 0; i < n; i++)
+			fn(len);
+		if ((ms = sys_time_msec() - start) >= MINMS)
+			break;
+	}
+	bytes = (uint64_t) n * len;
+	cprintf(" %8s %6d MB/s", what, (int) (bytes * 1000 / ms / (1024 * 1024)));
+}
+
+void
+umain(int argc, char **argv)
+{
+	int i;
+
+	binaryname = "cksumbench";
+	for (i = 0; i < sizeof(src); i++)
+		src[i] = rand();
+
+	cprintf("cksumbench starting\n");
+	check();
+	for (i = 0; i < NSIZES; i++) {
+		cprintf("%6d bytes:", sizes[i]);
+		bench("ref", run_ref, sizes[i]);
+		bench("new", run_new, sizes[i]);
+		bench("copy+sum", run_copy, sizes[i]);
+		cprintf("\n");
+	}
+	cprintf("cksumbench done\n");
+}
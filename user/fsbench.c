@@ -0,0 +1,283 @@
+// File system benchmark.
+//
+// Measures sequential and random read and write throughput at several
+// file sizes, the rates of open, stat, create and remove, lookups in a
+// large directory, and fsync latency at the same file sizes.  Each line also shows the file
+// server's block cache hit ratio and the disk operations it did, from
+// FSREQ_STATS, so that a change to the file server can be compared
+// against a baseline.  Run it with 'make fsbench'.
+
+#include <inc/lib.h>
+
+#define DIR		"/fsbench"
+#define BIGDIR		DIR "/big"
+#define NBIGDIR		512	// files in the large directory
+#define NOPS		256	// iterations of the small operations
+#define NSYNC		32	// fsyncs timed
+
+static const size_t sizes[] = { 4096, 64 * 1024, 1024 * 1024 };
+#define NSIZES		(sizeof(sizes) / sizeof(sizes[0]))
+
+static char buf[BLKSIZE];
+static char path[MAXPATHLEN];
+static uint32_t seed = 1;
+
+static struct Fsret_stats before;
+static unsigned start;
+
+static uint32_t
+rand(void)
+{
+	seed = seed * 1103515245 + 12345;
+	return seed >> 8;
+}
+
+static void
+begin(void)
+{
+	int r;
+
+	if ((r = fsstats(&before)) < 0)
+		panic("fsstats: %e", r);
+	start = sys_time_msec();
+}
+
+// Report 'n' units of work done since begin(), and what the file
+// server did meanwhile.
+static void
+report(const char *what, uint64_t n, const char *unit)
+{
+	struct Fsret_stats now;
+	unsigned ms = sys_time_msec() - start;
+	uint64_t hits, lookups;
+	int r;
+
+	if ((r = fsstats(&now)) < 0)
+		panic("fsstats: %e", r);
+	if (ms == 0)
+		ms = 1;
+	hits = now.ret_bc_hits - before.ret_bc_hits;
+	lookups = hits + now.ret_bc_misses - before.ret_bc_misses;
+	cprintf("%-26s %8d %s/s %6d ms  hit %3d%%  disk r %5d w %5d\n",
+		what, (int) (n * 1000 / ms), unit, ms,
+		lookups ? (int) (hits * 100 / lookups) : 100,
+		(int) (now.ret_disk_reads - before.ret_disk_reads),
+		(int) (now.ret_disk_writes - before.ret_disk_writes));
+}
+
+static int
+xopen(const char *path, int mode)
+{
+	int fd;
+
+	if ((fd = open(path, mode)) < 0)
+		panic("open %s: %e", path, fd);
+	return fd;
+}
+
+static void
+xwrite(int fd, const void *buf, size_t n)
+{
+	ssize_t r;
+	size_t done;
+
+	for (done = 0; done < n; done += r)
+		if ((r = write(fd, (const char *) buf + done, n - done)) <= 0)
+			panic("write: %e", r < 0 ? r : -E_NO_DISK);
+}
+
+static void
+bench_sequential(size_t size)
+{
+	char what[32];
+	size_t off;
+	ssize_t r;
+	int fd;
+
+	snprintf(path, sizeof(path), DIR "/seq%d", size);
+
+	snprintf(what, sizeof(what), "write %dK", size / 1024);
+	begin();
+	fd = xopen(path, O_WRONLY|O_CREAT|O_TRUNC);
+	for (off = 0; off < size; off += sizeof(buf))
+		xwrite(fd, buf, MIN(sizeof(buf), size - off));
+	close(fd);
+	report(what, size / 1024, "KB");
+
+	snprintf(what, sizeof(what), "read %dK", size / 1024);
+	begin();
+	fd = xopen(path, O_RDONLY);
+	for (off = 0; off < size; off += r)
+		if ((r = readn(fd, buf, sizeof(buf))) <= 0)
+			panic("read %s: %e", path, r);
+	close(fd);
+	report(what, size / 1024, "KB");
+
+	snprintf(what, sizeof(what), "read_map %dK", size / 1024);
+	begin();
+	fd = xopen(path, O_RDONLY);
+	for (off = 0; off < size; off += BLKSIZE)
+		if ((r = read_map(fd, off, UTEMP)) <= 0)
+			panic("read_map %s: %e", path, r);
+	sys_page_unmap(0, UTEMP);
+	close(fd);
+	report(what, size / 1024, "KB");
+}
+
+static void
+bench_random(size_t size)
+{
+	char what[32];
+	int fd, i, r;
+
+	snprintf(path, sizeof(path), DIR "/seq%d", size);
+	fd = xopen(path, O_RDWR);
+
+	snprintf(what, sizeof(what), "random read %dK", size / 1024);
+	begin();
+	for (i = 0; i < NOPS; i++) {
+		seek(fd, rand() % (size / 512) * 512);
+		if ((r = readn(fd, buf, 512)) != 512)
+			panic("read %s: %e", path, r);
+	}
+	report(what, NOPS, "op");
+
+	snprintf(what, sizeof(what), "random write %dK", size / 1024);
+	begin();
+	for (i = 0; i < NOPS; i++) {
+		seek(fd, rand() % (size / 512) * 512);
+		xwrite(fd, buf, 512);
+	}
+	report(what, NOPS, "op");
+	close(fd);
+}
+
+// Time rewriting the first 'size' bytes of a file and syncing it.
+static void
+bench_fsync(size_t size)
+{
+	char what[32];
+	struct Fd *fd;
+	unsigned ms;
+	size_t off;
+	int fdnum, i, r;
+
+	fdnum = xopen(DIR "/sync", O_RDWR|O_CREAT|O_TRUNC);
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		panic("fd_lookup: %e", r);
+	snprintf(what, sizeof(what), "write+fsync %dK", size / 1024);
+	begin();
+	for (i = 0; i < NSYNC; i++) {
+		seek(fdnum, 0);
+		for (off = 0; off < size; off += sizeof(buf))
+			xwrite(fdnum, buf, MIN(sizeof(buf), size - off));
+		if ((r = devfile_sync(fd)) < 0)
+			panic("fsync: %e", r);
+	}
+	ms = sys_time_msec() - start;
+	report(what, NSYNC, "op");
+	snprintf(what, sizeof(what), "fsync latency %dK", size / 1024);
+	cprintf("%-26s %8d us\n", what, ms * 1000 / NSYNC);
+	close(fdnum);
+}
+
+static void
+bench_metadata(void)
+{
+	struct Stat st;
+	int i, r;
+
+	begin();
+	for (i = 0; i < NOPS; i++) {
+		snprintf(path, sizeof(path), DIR "/f%d", i);
+		close(xopen(path, O_WRONLY|O_CREAT|O_EXCL));
+	}
+	report("create", NOPS, "op");
+
+	begin();
+	for (i = 0; i < NOPS; i++) {
+		snprintf(path, sizeof(path), DIR "/f%d", i);
+		close(xopen(path, O_RDONLY));
+	}
+	report("open+close", NOPS, "op");
+
+	begin();
+	for (i = 0; i < NOPS; i++) {
+		snprintf(path, sizeof(path), DIR "/f%d", i);
+		if ((r = stat(path, &st)) < 0)
+			panic("stat %s: %e", path, r);
+	}
+	report("stat", NOPS, "op");
+
+	begin();
+	for (i = 0; i < NOPS; i++)
+		if ((r = stat(DIR "/missing", &st)) != -E_NOT_FOUND)
+			panic("stat " DIR "/missing: %e", r);
+	report("stat missing", NOPS, "op");
+
+	begin();
+	for (i = 0; i < NOPS; i++) {
+		snprintf(path, sizeof(path), DIR "/f%d", i);
+		if ((r = remove(path)) < 0)
+			panic("remove %s: %e", path, r);
+	}
+	report("remove", NOPS, "op");
+}
+
+static void
+bench_bigdir(void)
+{
+	struct Stat st;
+	int i, r;
+
+	close(xopen(BIGDIR, O_RDONLY|O_CREAT|O_MKDIR));
+	begin();
+	for (i = 0; i < NBIGDIR; i++) {
+		snprintf(path, sizeof(path), BIGDIR "/file%d", i);
+		close(xopen(path, O_WRONLY|O_CREAT|O_EXCL));
+	}
+	report("create in large dir", NBIGDIR, "op");
+
+	begin();
+	for (i = 0; i < NOPS; i++) {
+		snprintf(path, sizeof(path), BIGDIR "/file%d",
+			 rand() % NBIGDIR);
+		if ((r = stat(path, &st)) < 0)
+			panic("stat %s: %e", path, r);
+	}
+	report("lookup in large dir", NOPS, "op");
+
+	for (i = 0; i < NBIGDIR; i++) {
+		snprintf(path, sizeof(path), BIGDIR "/file%d", i);
+		remove(path);
+	}
+	remove(BIGDIR);
+}
+
+void
+umain(int argc, char **argv)
+{
+	int i;
+
+	binaryname = "fsbench";
+	memset(buf, 0xA5, sizeof(buf));
+	close(xopen(DIR, O_RDONLY|O_CREAT|O_MKDIR));
+
+	cprintf("fsbench starting\n");
+	for (i = 0; i < NSIZES; i++)
+		bench_sequential(sizes[i]);
+	for (i = 0; i < NSIZES; i++)
+		bench_random(sizes[i]);
+	for (i = 0; i < NSIZES; i++)
+		bench_fsync(sizes[i]);
+	bench_metadata();
+	bench_bigdir();
+
+	for (i = 0; i < NSIZES; i++) {
+		snprintf(path, sizeof(path), DIR "/seq%d", sizes[i]);
+		remove(path);
+	}
+	remove(DIR "/sync");
+	remove(DIR);
+	cprintf("fsbench done\n");
+}
@@ -76,8 +76,30 @@ send_header(struct http_request *req, int code)
 static int
 send_data(struct http_request *req, int fd)
 {
-	// LAB 6: Your code here.
-	panic("send_data not implemented");
+	char buf[BUFFSIZE];
+	off_t total = 0;
+	ssize_t n;
+	void *p;
+
+	// Send file blocks straight out of the file server's block
+	// cache, without copying them into our own buffer first.
+	while ((n = read_mapped(fd, (void *) UTEMP, &p)) > 0) {
+		if (write(req->sock, p, n) != n) {
+			sys_page_unmap(0, (void *) UTEMP);
+			die("Failed to send bytes to client");
+		}
+		total += n;
+	}
+	sys_page_unmap(0, (void *) UTEMP);
+	if (n == 0)
+		return 0;
+	if (total > 0)
+		return n;
+
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+		if (write(req->sock, buf, n) != n)
+			die("Failed to send bytes to client");
+	return n;
 }
 
 static int
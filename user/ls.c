@@ -19,21 +19,37 @@ ls(const char *path, const char *prefix)
 		ls1(0, st.st_isdir, st.st_size, path);
 }
 
+// The first entries come from readfile, which takes a single round
+// trip to the file server for a small directory; only a larger one is
+// opened and read further.
 void
 lsdir(const char *path, const char *prefix)
 {
-	int fd, n;
-	struct File f;
+	static struct File f[64];
+	int fd = -1, n, i;
 
-	if ((fd = open(path, O_RDONLY)) < 0)
-		panic("open %s: %e", path, fd);
-	while ((n = readn(fd, &f, sizeof f)) == sizeof f)
-		if (f.f_name[0])
-			ls1(prefix, f.f_type==FTYPE_DIR, f.f_size, f.f_name);
-	if (n > 0)
-		panic("short read in directory %s", path);
-	if (n < 0)
-		panic("error reading directory %s: %e", path, n);
+	n = readfile(path, f, sizeof f);
+	while (1) {
+		if (n < 0)
+			panic("error reading directory %s: %e", path, n);
+		if (n % sizeof f[0])
+			panic("short read in directory %s", path);
+		for (i = 0; i < n / sizeof f[0]; i++)
+			if (f[i].f_name[0])
+				ls1(prefix, f[i].f_type==FTYPE_DIR,
+				    f[i].f_size, f[i].f_name);
+		if (n < sizeof f)
+			break;
+		if (fd < 0) {
+			if ((fd = open(path, O_RDONLY)) < 0)
+				panic("open %s: %e", path, fd);
+			if ((n = seek(fd, sizeof f)) < 0)
+				continue;
+		}
+		n = readn(fd, f, sizeof f);
+	}
+	if (fd >= 0)
+		close(fd);
 }
 
 void
@@ -26,6 +26,7 @@ umain(int argc, char **argv)
 	struct Fd fdcopy;
 	struct Stat st;
 	char buf[512];
+	void *p;
 
 	// We open files manually first, to avoid the FD layer
 	if ((r = xopen("/not-found", O_RDONLY)) < 0 && r != -E_NOT_FOUND)
@@ -126,5 +127,80 @@ umain(int argc, char **argv)
 	}
 	close(f);
 	cprintf("large file is good\n");
-}
 
+	// Map the same blocks straight from the file server's cache.
+	if ((f = open("/big", O_RDONLY)) < 0)
+		panic("open /big: %e", f);
+	for (i = 0; i < (NDIRECT*3)*BLKSIZE; i += BLKSIZE) {
+		if ((r = read_map(f, i, (void *) UTEMP)) != BLKSIZE)
+			panic("read_map /big@%d: %e", i, r);
+		if (*(int*)UTEMP != i || *(int*)(UTEMP + sizeof(buf)) != i + sizeof(buf))
+			panic("read_map /big from %d returned bad data %d",
+			      i, *(int*)UTEMP);
+	}
+	if ((r = read_map(f, i, (void *) UTEMP)) != 0)
+		panic("read_map /big at end of file: %e", r);
+
+	// read_mapped starts at the seek position and moves it on.
+	if ((r = seek(f, sizeof(buf))) < 0)
+		panic("seek /big: %e", r);
+	if ((r = read_mapped(f, (void *) UTEMP, &p)) != BLKSIZE - sizeof(buf))
+		panic("read_mapped /big@%d: %e", sizeof(buf), r);
+	if (*(int*)p != sizeof(buf))
+		panic("read_mapped /big returned bad data %d", *(int*)p);
+	if ((r = readn(f, buf, sizeof(buf))) != sizeof(buf) || *(int*)buf != BLKSIZE)
+		panic("read /big after read_mapped: %e", r);
+	sys_page_unmap(0, (void *) UTEMP);
+	close(f);
+	cprintf("read_map is good\n");
+
+	// Stat and read several files in one batched request.
+	fsbatch_begin();
+	if ((f = fsbatch_open("/newmotd")) < 0)
+		panic("fsbatch_open: %e", f);
+	memset(buf, 0, sizeof(buf));
+	if ((i = fsbatch_stat(f, &st)) < 0 || (r = fsbatch_read(f, 0, buf, sizeof(buf))) < 0
+	    || fsbatch_close(f) < 0 || fsbatch_open("/not-found") < 0)
+		panic("fsbatch queue failed");
+	if ((f = fsbatch_submit()) < 0)
+		panic("fsbatch_submit: %e", f);
+	if (fsbatch_result(i) < 0 || st.st_size != strlen(msg))
+		panic("fsbatch stat returned size %d", st.st_size);
+	if (fsbatch_result(r) != strlen(msg) || strcmp(buf, msg) != 0)
+		panic("fsbatch read returned %d, \"%s\"", fsbatch_result(r), buf);
+	if (fsbatch_result(4) != -E_NOT_FOUND)
+		panic("fsbatch open /not-found: %e", fsbatch_result(4));
+	memset(buf, 0, sizeof(buf));
+	if ((r = readfile("/newmotd", buf, sizeof(buf))) != strlen(msg)
+	    || strcmp(buf, msg) != 0)
+		panic("readfile /newmotd: %e", r);
+	cprintf("fsbatch is good\n");
+
+	// Closed files must be reclaimed, and open ones survive the sweeps.
+	if ((f = open("/newmotd", O_RDONLY)) < 0)
+		panic("open /newmotd: %e", f);
+	for (i = 0; i < 3000; i++) {
+		if ((r = open("/big", O_RDONLY)) < 0)
+			panic("open /big #%d: %e", i, r);
+		close(r);
+	}
+	memset(buf, 0, sizeof(buf));
+	if ((r = readn(f, buf, sizeof(buf))) != strlen(msg) || strcmp(buf, msg) != 0)
+		panic("read /newmotd after many opens: %e", r);
+	close(f);
+	cprintf("many opens is good\n");
+
+	// Hold more files open at once than fit in a page table of fds.
+	// Allocation is lowest-first, so the fds are consecutive.
+	if ((f = open("/newmotd", O_RDONLY)) < 0)
+		panic("open /newmotd: %e", f);
+	for (i = 1; i < 600; i++)
+		if ((r = open("/newmotd", O_RDONLY)) != f + i)
+			panic("open /newmotd #%d returned %d, not fd %d", i, r, f + i);
+	close(f + 300);
+	if ((r = open("/newmotd", O_RDONLY)) != f + 300)
+		panic("open after close returned fd %d, not %d", r, f + 300);
+	for (i = 0; i < 600; i++)
+		close(f + i);
+	cprintf("many fds is good\n");
+}
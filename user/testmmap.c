@@ -0,0 +1,45 @@
+#include <inc/lib.h>
+
+const char *msg = "This is the mapped message of the day!\n";
+
+void
+umain(int argc, char **argv)
+{
+	int f, r;
+	char *p, *q;
+
+	if ((f = open("/mmap-test", O_RDWR|O_CREAT|O_TRUNC)) < 0)
+		panic("open /mmap-test: %e", f);
+	if ((r = ftruncate(f, 2*PGSIZE)) < 0)
+		panic("ftruncate /mmap-test: %e", r);
+
+	// Writes through a shared mapping reach the file.
+	if ((p = mmap(0, 2*PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED, f, 0)) == MAP_FAILED)
+		panic("mmap shared failed");
+	strcpy(p, msg);
+	strcpy(p + PGSIZE, msg);
+	if ((r = munmap(p, 2*PGSIZE)) < 0)
+		panic("munmap: %e", r);
+	if ((q = mmap(0, 2*PGSIZE, PROT_READ, MAP_SHARED, f, 0)) == MAP_FAILED)
+		panic("mmap read-only failed");
+	if (strcmp(q, msg) != 0 || strcmp(q + PGSIZE, msg) != 0)
+		panic("shared mapping did not write the file");
+	cprintf("mmap shared is good\n");
+
+	// Writes through a private mapping do not.
+	if ((p = mmap(0, PGSIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE, f, PGSIZE)) == MAP_FAILED)
+		panic("mmap private failed");
+	if (strcmp(p, msg) != 0)
+		panic("private mapping read the wrong data");
+	p[0] = 'X';
+	if ((r = msync(p, PGSIZE)) < 0)
+		panic("msync: %e", r);
+	if (q[PGSIZE] != msg[0])
+		panic("private mapping wrote the file");
+	if ((r = munmap(p, PGSIZE)) < 0 || (r = munmap(q, 2*PGSIZE)) < 0)
+		panic("munmap: %e", r);
+	cprintf("mmap private is good\n");
+
+	close(f);
+	remove("/mmap-test");
+}
@@ -0,0 +1,168 @@
+// Test poll, epoll and non-blocking sockets.  The test listens on the
+// echo port; the grader connects, sends "ping", waits for a byte back,
+// sends "pong" and waits for "ok".
+
+#include <inc/lib.h>
+#include <lwip/sockets.h>
+#include <lwip/inet.h>
+
+#define PORT 7
+
+static void
+must_poll(int fd, short events, int timeout, short expect, const char *what)
+{
+	struct pollfd pfd;
+	int r;
+
+	pfd.fd = fd;
+	pfd.events = events;
+	if ((r = poll(&pfd, 1, timeout)) < 0)
+		panic("poll %s: %e", what, r);
+	if (pfd.revents != expect)
+		panic("poll %s: revents %x, expected %x", what, pfd.revents, expect);
+}
+
+static void
+must_epoll(int ep, int timeout, int expect, const char *what)
+{
+	struct epoll_event ev;
+	int r;
+
+	if ((r = epoll_wait(ep, &ev, 1, timeout)) < 0)
+		panic("epoll_wait %s: %e", what, r);
+	if (r != expect)
+		panic("epoll_wait %s: %d events, expected %d", what, r, expect);
+	if (r && !(ev.events & EPOLLIN))
+		panic("epoll_wait %s: events %x", what, ev.events);
+}
+
+static void
+must_recv(int sock, const char *expect)
+{
+	char buf[8];
+	int n = 0, r;
+
+	while (n < strlen(expect)) {
+		if ((r = recv(sock, buf + n, strlen(expect) - n, 0)) <= 0)
+			panic("recv: %e", r);
+		n += r;
+	}
+	if (memcmp(buf, expect, n) != 0)
+		panic("received the wrong data");
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct sockaddr_in addr;
+	struct pollfd pfds[3];
+	struct epoll_event ev;
+	unsigned int addrlen;
+	int lsock, idle, sock, ep, p[2], r;
+	char c;
+	unsigned start;
+
+	if ((lsock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
+		panic("socket: %e", lsock);
+	if ((idle = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
+		panic("socket: %e", idle);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(PORT);
+	if ((r = bind(lsock, (struct sockaddr *) &addr, sizeof(addr))) < 0)
+		panic("bind: %e", r);
+	if ((r = listen(lsock, 5)) < 0)
+		panic("listen: %e", r);
+
+	// A file descriptor that is not a socket is reported at once,
+	// even with no timeout.
+	if ((r = pipe(p)) < 0)
+		panic("pipe: %e", r);
+	must_poll(p[0], POLLIN, -1, POLLNVAL, "pipe");
+	close(p[0]);
+	close(p[1]);
+	cprintf("poll POLLNVAL is good\n");
+
+	// Nothing is ready yet: poll waits out its timeout over all the
+	// sockets, whichever network server instances they belong to,
+	// and accept fails rather than waiting.
+	pfds[0].fd = lsock;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = idle;
+	pfds[1].events = POLLIN;
+	pfds[2].fd = -1;
+	start = sys_time_msec();
+	if ((r = poll(pfds, 3, 100)) != 0)
+		panic("poll of idle sockets: %d", r);
+	if (sys_time_msec() - start < 100)
+		panic("poll returned before its timeout");
+	// So does a poll with no sockets to look at.
+	start = sys_time_msec();
+	if ((r = poll(&pfds[2], 1, 50)) != 0)
+		panic("poll of no sockets: %d", r);
+	if (sys_time_msec() - start < 50)
+		panic("poll of no sockets returned before its timeout");
+	if ((r = fcntl(lsock, F_SETFL, O_NONBLOCK)) < 0)
+		panic("fcntl: %e", r);
+	if (!(fcntl(lsock, F_GETFL, 0) & O_NONBLOCK))
+		panic("fcntl did not set O_NONBLOCK");
+	addrlen = sizeof(addr);
+	if ((r = accept(lsock, (struct sockaddr *) &addr, &addrlen)) != -E_AGAIN)
+		panic("non-blocking accept: %e, expected -E_AGAIN", r);
+	cprintf("poll timeout is good\n");
+
+	// The listening socket becomes readable when a client connects.
+	cprintf("bound\n");
+	must_poll(lsock, POLLIN, -1, POLLIN, "listening socket");
+	addrlen = sizeof(addr);
+	if ((sock = accept(lsock, (struct sockaddr *) &addr, &addrlen)) < 0)
+		panic("accept: %e", sock);
+	must_poll(sock, POLLOUT, 0, POLLOUT, "connected socket");
+	cprintf("poll readiness is good\n");
+
+	// Level-triggered: reported for as long as "ping" is unread.
+	if ((ep = epoll_create(1)) < 0)
+		panic("epoll_create: %e", ep);
+	ev.events = EPOLLIN;
+	ev.data.fd = sock;
+	if ((r = epoll_ctl(ep, EPOLL_CTL_ADD, sock, &ev)) < 0)
+		panic("epoll_ctl add: %e", r);
+	must_epoll(ep, -1, 1, "level-triggered");
+	must_epoll(ep, 0, 1, "level-triggered again");
+	cprintf("epoll level-triggered is good\n");
+
+	// Edge-triggered: reported once, then not until new data comes,
+	// even though "ping" is still unread.
+	ev.events = EPOLLIN | EPOLLET;
+	if ((r = epoll_ctl(ep, EPOLL_CTL_MOD, sock, &ev)) < 0)
+		panic("epoll_ctl mod: %e", r);
+	must_epoll(ep, 0, 1, "edge-triggered");
+	must_epoll(ep, 0, 0, "edge-triggered again");
+
+	// Drain "ping"; then there is nothing more to read.
+	must_recv(sock, "ping");
+	if ((r = recv(sock, &c, 1, MSG_DONTWAIT)) != -E_AGAIN)
+		panic("recv MSG_DONTWAIT: %e, expected -E_AGAIN", r);
+	if ((r = fcntl(sock, F_SETFL, O_NONBLOCK)) < 0)
+		panic("fcntl: %e", r);
+	if ((r = read(sock, &c, 1)) != -E_AGAIN)
+		panic("non-blocking read: %e, expected -E_AGAIN", r);
+	if ((r = fcntl(sock, F_SETFL, 0)) < 0)
+		panic("fcntl: %e", r);
+	cprintf("non-blocking recv is good\n");
+
+	// New data re-arms the edge-triggered socket.
+	if ((r = write(sock, "1", 1)) != 1)
+		panic("write: %e", r);
+	must_epoll(ep, -1, 1, "edge-triggered re-arm");
+	must_recv(sock, "pong");
+	cprintf("epoll edge-triggered is good\n");
+
+	if ((r = write(sock, "ok", 2)) != 2)
+		panic("write: %e", r);
+	close(ep);
+	close(sock);
+	close(idle);
+	close(lsock);
+}
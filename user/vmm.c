@@ -75,7 +75,10 @@ umain(int argc, char **argv) {
 	snprintf(filename_buffer, 50, "/vmm/fs%d.img", vmdisk_number);
 	
 	cprintf("Creating a new virtual HDD at /vmm/fs%d.img\n", vmdisk_number);
-        r = copy("vmm/clean-fs.img", filename_buffer);
+	// The new disk shares clean-fs.img's blocks until the guest
+	// writes them, so this takes the same time for any image size.
+	remove(filename_buffer);
+	r = overlay(filename_buffer, "vmm/clean-fs.img");
         
         if (r < 0) {
         	cprintf("Create new virtual HDD failed: %e\n", r);